@@ -1,2 +1,2 @@
-#include "at91sam7s256.h"
+#include "AT91SAM7S256.h"
 #  define CLOCK_FREQUENCY 48054850
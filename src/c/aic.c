@@ -10,6 +10,7 @@
 
 #include "mytypes.h"
 #include "interrupts.h"
+#include "hal.h"
 
 #include "aic.h"
 
@@ -53,24 +54,24 @@ aic_initialise(void)
    *  - No pending interrupts,
    *  - AIC idle, not handling an interrupt.
    */
-  sysc->AIC_IDCR = 0xFFFFFFFF;
-  sysc->AIC_FFDR = 0xFFFFFFFF;
-  sysc->AIC_ICCR = 0xFFFFFFFF;
-  sysc->AIC_EOICR = 1;
+  REG_WR(&sysc->AIC_IDCR, 0xFFFFFFFF);
+  REG_WR(&sysc->AIC_FFDR, 0xFFFFFFFF);
+  REG_WR(&sysc->AIC_ICCR, 0xFFFFFFFF);
+  REG_WR(&sysc->AIC_EOICR, 1);
 
   /* Enable debug protection. This is necessary for JTAG debugging, so
    * that the hardware debugger can read AIC registers without
    * triggering side-effects.
    */
-  sysc->AIC_DCR = 1;
+  REG_WR(&sysc->AIC_DCR, 1);
 
   /* Set default handlers for all interrupt lines. */
   for (i = 0; i < 32; i++) {
-    sysc->AIC_SMR[i] = 0;
-    sysc->AIC_SVR[i] = (U32) default_isr;
+    REG_WR(&sysc->AIC_SMR[i], 0);
+    REG_WR(&sysc->AIC_SVR[i], (U32) default_isr);
   }
-  sysc->AIC_SVR[AT91C_ID_FIQ] = (U32) default_fiq;
-  sysc->AIC_SPU = (U32) spurious_isr;
+  REG_WR(&sysc->AIC_SVR[AT91C_ID_FIQ], (U32) default_fiq);
+  REG_WR(&sysc->AIC_SPU, (U32) spurious_isr);
 }
 
 
@@ -93,8 +94,8 @@ aic_set_vector(U32 vector, U32 mode, U32 isr)
   if (vector < 32) {
     int i_state = interrupts_get_and_disable();
 
-    sysc->AIC_SMR[vector] = mode;
-    sysc->AIC_SVR[vector] = isr;
+    REG_WR(&sysc->AIC_SMR[vector], mode);
+    REG_WR(&sysc->AIC_SVR[vector], isr);
     if (i_state)
       interrupts_enable();
   }
@@ -111,7 +112,7 @@ aic_mask_on(U32 vector)
 {
   int i_state = interrupts_get_and_disable();
 
-  sysc->AIC_IECR = (1 << vector);
+  REG_WR(&sysc->AIC_IECR, (1 << vector));
   if (i_state)
     interrupts_enable();
 }
@@ -127,7 +128,7 @@ aic_mask_off(U32 vector)
 {
   int i_state = interrupts_get_and_disable();
 
-  sysc->AIC_IDCR = (1 << vector);
+  REG_WR(&sysc->AIC_IDCR, (1 << vector));
   if (i_state)
     interrupts_enable();
 }
@@ -143,7 +144,7 @@ aic_clear(U32 vector)
 {
   int i_state = interrupts_get_and_disable();
 
-  sysc->AIC_ICCR = (1 << vector);
+  REG_WR(&sysc->AIC_ICCR, (1 << vector));
   if (i_state)
     interrupts_enable();
 }
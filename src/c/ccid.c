@@ -0,0 +1,59 @@
+/* CCID message framing, see ccid.h */
+
+#include "mytypes.h"
+#include "udp.h"
+#include "ccid.h"
+#include "ramfunc.h"
+
+HOTFUNC void ccid_parse_header(const U8 *msg, ccid_header *hdr)
+{
+  hdr->bMessageType = msg[0];
+  hdr->dwLength = msg[1] | (msg[2] << 8) | (msg[3] << 16) | ((U32)msg[4] << 24);
+  hdr->bSlot = msg[5];
+  hdr->bSeq = msg[6];
+  hdr->abParam[0] = msg[7];
+  hdr->abParam[1] = msg[8];
+  hdr->abParam[2] = msg[9];
+}
+
+/* Takes the next message off the receive ring into buf, which holds
+ * CCID_MAX_MESSAGE bytes, and parses its header into hdr. A frame that is
+ * longer than CCID_MAX_MESSAGE or whose size disagrees with its dwLength
+ * gives CCID_BAD_LENGTH; its header is still valid so that the command
+ * can be failed. A runt without a complete header cannot be answered and
+ * is dropped.
+ */
+HOTFUNC int ccid_read(U8 *buf, ccid_header *hdr)
+{
+  int size = udp_read(buf, 0, CCID_MAX_MESSAGE);
+
+  if (size < CCID_HEADER_SIZE)
+    return CCID_NONE;
+
+  ccid_parse_header(buf, hdr);
+  if (hdr->dwLength > CCID_MAX_MESSAGE - CCID_HEADER_SIZE ||
+      size != CCID_HEADER_SIZE + hdr->dwLength)
+    return CCID_BAD_LENGTH;
+  return CCID_OK;
+}
+
+/* The RDR_to_PC message that answers a PC_to_RDR message type */
+U8 ccid_reply_type(U8 bMessageType)
+{
+  switch (bMessageType) {
+  case PC_RDR_ICC_POWER_ON:
+  case PC_RDR_XFR_BLOCK:
+  case PC_RDR_SECURE:
+    return RDR_TO_PC_DATABLOCK;
+  case PC_RDR_GET_PARAMETERS:
+  case PC_RDR_RESET_PARAMETERS:
+  case PC_RDR_SET_PARAMETERS:
+    return RDR_TO_PC_PARAMETERS;
+  case PC_RDR_ESCAPE:
+    return RDR_TO_PC_ESCAPE;
+  case PC_RDR_SETDATARATEANDCLOCK:
+    return RDR_TO_PC_DATARATEANDCLOCK;
+  default:
+    return RDR_TO_PC_SLOTSTATUS;
+  }
+}
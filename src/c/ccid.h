@@ -0,0 +1,53 @@
+/* CCID message framing.
+ *
+ * Every bulk message starts with the same 10 byte header. The receive
+ * path in udp.c splits the bulk OUT stream into messages by dwLength;
+ * ccid_read() takes them from there, parses the header and checks that
+ * the frame has exactly the length it declares before the command layer
+ * sees it.
+ */
+
+#ifndef __CCID_H__
+#  define __CCID_H__
+
+#  include "mytypes.h"
+
+#  define CCID_HEADER_SIZE     10
+#  define CCID_MAX_MESSAGE     271    /* dwMaxCCIDMessageLength in the class descriptor */
+
+/* ccid_read() results */
+#  define CCID_NONE            0
+#  define CCID_OK              1
+#  define CCID_BAD_LENGTH      2      /* header valid, frame not usable */
+
+/* bStatus and bError of a failed command */
+#  define CCID_CMD_FAILED      0x40   /* ICC present and active, command failed */
+#  define CCID_TIME_EXTENSION  0x80   /* more time needed, bError is the multiplier */
+#  define CCID_ERR_CMD_NOT_SUPPORTED 0x00
+#  define CCID_ERR_BAD_LENGTH  0x01   /* offset of dwLength in the header */
+#  define CCID_ERR_BAD_LEVEL   0x08   /* offset of wLevelParameter */
+
+/* wLevelParameter of an XfrBlock and bChainParameter of the DataBlock
+ * that answers it, for an APDU that spans several messages
+ */
+#  define CCID_CHAIN_NONE      0x00   /* begins and ends in this message */
+#  define CCID_CHAIN_BEGIN     0x01   /* begins, continues in the next */
+#  define CCID_CHAIN_END       0x02   /* continues, ends in this message */
+#  define CCID_CHAIN_MORE      0x03   /* continues, and in the next */
+#  define CCID_CHAIN_NEXT      0x10   /* empty, asks for the next part */
+
+typedef struct {
+  U8  bMessageType;
+  U32 dwLength;
+  U8  bSlot;
+  U8  bSeq;
+  U8  abParam[3];                     /* message specific */
+} ccid_header;
+
+#  define CCID_LEVEL(hdr)      ((hdr)->abParam[1] | ((hdr)->abParam[2] << 8))
+
+void ccid_parse_header(const U8 *msg, ccid_header *hdr);
+int ccid_read(U8 *buf, ccid_header *hdr);
+U8 ccid_reply_type(U8 bMessageType);
+
+#endif
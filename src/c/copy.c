@@ -0,0 +1,75 @@
+/* Copy kernels, see copy.h */
+
+#include "mytypes.h"
+#include "hal.h"
+#include "copy.h"
+
+RAMFUNC void copy_words(unsigned int *dst, const unsigned int *src, U32 words)
+{
+  // 32 bytes per loop: two ldm/stm pairs of four registers
+  while (words >= 8) {
+#ifdef HOST
+    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = src[3];
+    dst[4] = src[4]; dst[5] = src[5]; dst[6] = src[6]; dst[7] = src[7];
+    dst += 8;
+    src += 8;
+#else
+    __asm__ volatile (
+      "ldmia %0!, {r3, r4, r5, r6}\n\t"
+      "stmia %1!, {r3, r4, r5, r6}\n\t"
+      "ldmia %0!, {r3, r4, r5, r6}\n\t"
+      "stmia %1!, {r3, r4, r5, r6}"
+      : "+r" (src), "+r" (dst)
+      :
+      : "r3", "r4", "r5", "r6", "memory");
+#endif
+    words -= 8;
+  }
+
+  while (words--)
+    *dst++ = *src++;
+}
+
+RAMFUNC void copy_bytes(U8 *dst, const U8 *src, U32 len)
+{
+  // Words only when both sides can be aligned together
+  if ((((U32)dst ^ (U32)src) & 3) == 0) {
+    while (((U32)dst & 3) && len) {
+      *dst++ = *src++;
+      len--;
+    }
+    copy_words((void *)dst, (const void *)src, len >> 2);
+    dst += len & ~3;
+    src += len & ~3;
+    len &= 3;
+  }
+
+  while (len--)
+    *dst++ = *src++;
+}
+
+RAMFUNC void fifo_write(volatile AT91_REG *fdr, const U8 *src, U32 len)
+{
+  while (len >= 8) {
+    REG_WR(fdr, src[0]); REG_WR(fdr, src[1]); REG_WR(fdr, src[2]); REG_WR(fdr, src[3]);
+    REG_WR(fdr, src[4]); REG_WR(fdr, src[5]); REG_WR(fdr, src[6]); REG_WR(fdr, src[7]);
+    src += 8;
+    len -= 8;
+  }
+
+  while (len--)
+    REG_WR(fdr, *src++);
+}
+
+RAMFUNC void fifo_read(volatile AT91_REG *fdr, U8 *dst, U32 len)
+{
+  while (len >= 8) {
+    dst[0] = REG_RD(fdr); dst[1] = REG_RD(fdr); dst[2] = REG_RD(fdr); dst[3] = REG_RD(fdr);
+    dst[4] = REG_RD(fdr); dst[5] = REG_RD(fdr); dst[6] = REG_RD(fdr); dst[7] = REG_RD(fdr);
+    dst += 8;
+    len -= 8;
+  }
+
+  while (len--)
+    *dst++ = REG_RD(fdr);
+}
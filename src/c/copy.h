@@ -0,0 +1,26 @@
+/* Copy kernels for the data paths.
+ *
+ * copy_words() moves aligned words eight at a time with multi-word loads
+ * and stores, from RAM or flash; copy_bytes() uses it for the aligned
+ * middle of any copy. fifo_write() and fifo_read() pump bytes through a
+ * UDP FIFO data register (FDRx), which is one byte wide, unrolled eight
+ * accesses per loop.
+ *
+ * All of them run from RAM (.fastrun) and call nothing in flash, so the
+ * receive path may use them while a flash page programs. copy.c is built
+ * in ARM mode (SRCARM in the Makefile).
+ */
+
+#ifndef __COPY_H__
+#  define __COPY_H__
+
+#  include "mytypes.h"
+#  include "AT91SAM7.h"
+#  include "ramfunc.h"
+
+RAMFUNC void copy_words(unsigned int *dst, const unsigned int *src, U32 words);
+RAMFUNC void copy_bytes(U8 *dst, const U8 *src, U32 len);
+RAMFUNC void fifo_write(volatile AT91_REG *fdr, const U8 *src, U32 len);
+RAMFUNC void fifo_read(volatile AT91_REG *fdr, U8 *dst, U32 len);
+
+#endif
@@ -0,0 +1,93 @@
+/* Escape channel.
+ *
+ * Management operations travel in PC_to_RDR_Escape messages instead of
+ * APDUs: abData is a sub-command byte followed by its parameters, and the
+ * RDR_to_PC_Escape reply carries the result alone. Either way there are up
+ * to CCID_MAX_MESSAGE - 10 bytes of abData, with no status word, no Lc
+ * limit and no GET RESPONSE. A sub-command that fails is answered with
+ * bStatus CCID_CMD_FAILED and bError CCID_ERR_CMD_NOT_SUPPORTED,
+ * CCID_ERR_BAD_LENGTH or one of the ESC_ERR codes below, from the range
+ * CCID leaves to the reader. Numbers are little-endian.
+ *
+ *   sub-command     parameters                        result
+ *   01 TRACE        ring                              ring, lost, n, n records (trace.h)
+ *   02 STATS        offset[2]                         gStats from offset (stats.h)
+ *   03 STATS CLEAR  -                                 -
+ *   04 INFO         -                                 esc_info
+ *   10 FIND         name                              handle[2] size[4]
+ *   11 CREATE       size[4] name                      handle[2]
+ *   12 READ         fd offset[4] len[2]               up to len bytes of the file
+ *   13 WRITE        fd offset[4] flags data           -
+ *   14 DELETE       handle[2]                         -
+ *   15 LIST         cursor[2]                         cursor[2], entries
+ *   16 OPEN         name                              fd handle[2] size[4]
+ *   17 CLOSE        fd                                -
+ *   20 FORMAT       -                                 -
+ *
+ * The file sub-commands answer ESC_ERR_NOT_INITED until INIT CARD. READ
+ * and WRITE take a descriptor from OPEN (file.h), any number of them at
+ * once up to FILE_MAX_OPEN; DELETE, CREATE over an existing name and
+ * FORMAT close the descriptors of the files they drop. WRITE goes through
+ * the page buffers like WRITE FILE: full pages are programmed after the
+ * reply, ESC_WRITE_FLUSH programs the last partial one too, and
+ * ESC_ERR_FLASH reports a page that failed since the previous WRITE. READ
+ * sees the data of a WRITE before it is programmed. FORMAT drops every
+ * file and keeps the password.
+ *
+ * LIST packs as many directory entries as fit in one reply, the occupied
+ * ones only, from the handle cursor on:
+ *
+ *   handle[2] size[4] flags name_len name[name_len]
+ *
+ * with the name stripped of its NUL padding. The cursor in the result is
+ * where the next LIST resumes, ESC_LIST_END once there are no more; a
+ * listing starts at 0. Cursors are handles, so a listing can be resumed
+ * after files were created or deleted, and then shows the changes at
+ * handles past the cursor.
+ */
+
+#ifndef __ESCAPE_H__
+#  define __ESCAPE_H__
+
+#  include "mytypes.h"
+#  include "ccid.h"
+
+#  define ESC_TRACE           0x01
+#  define ESC_STATS           0x02
+#  define ESC_STATS_CLEAR     0x03
+#  define ESC_INFO            0x04
+#  define ESC_FIND            0x10
+#  define ESC_CREATE          0x11
+#  define ESC_READ            0x12
+#  define ESC_WRITE           0x13
+#  define ESC_DELETE          0x14
+#  define ESC_LIST            0x15
+#  define ESC_OPEN            0x16
+#  define ESC_CLOSE           0x17
+#  define ESC_FORMAT          0x20
+
+#  define ESC_DATA_MAX        (CCID_MAX_MESSAGE - CCID_HEADER_SIZE)
+#  define ESC_WRITE_DATA_MAX  (ESC_DATA_MAX - 7)    /* after the sub-command and parameters */
+#  define ESC_WRITE_FLUSH     0x01
+#  define ESC_LIST_END        0xFFFF
+#  define ESC_LIST_ENTRY      8         /* bytes of a LIST entry before its name */
+
+/* bError */
+#  define ESC_ERR_NOT_INITED  0x81
+#  define ESC_ERR_NOT_FOUND   0x82    /* no such file or handle */
+#  define ESC_ERR_RANGE       0x83    /* offset or length outside the file */
+#  define ESC_ERR_NO_SPACE    0x84
+#  define ESC_ERR_FLASH       0x85    /* a page failed to program */
+#  define ESC_ERR_NO_DESC     0x86    /* every descriptor is open */
+
+/* INFO */
+typedef struct {
+  U16 page_size;
+  U16 data_pages;
+  U16 free_pages;
+  U16 max_files;
+  U16 files;
+  U16 max_message;          /* dwMaxCCIDMessageLength */
+} esc_info;
+
+#endif
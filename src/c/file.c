@@ -0,0 +1,229 @@
+/* Open files, see file.h */
+
+#include <string.h>
+
+#include "mytypes.h"
+#include "flash.h"
+#include "fs.h"
+#include "copy.h"
+#include "file.h"
+
+typedef struct {
+  int handle;           // -1 if the descriptor is free
+  U32 offset;
+  int n;                // file page looked up last, -1 if none
+  int page;             // and its flash page
+} file_desc;
+
+static file_desc files[FILE_MAX_OPEN] = {
+  [0 ... FILE_MAX_OPEN - 1] = { -1, 0, -1, -1 }
+};
+
+static int fill_page = -1;      // flash page in the fill buffer, -1 if none
+static int fill_handle = -1;    // the file it belongs to
+
+static file_desc *desc(int fd)
+{
+  if (fd < 0 || fd >= FILE_MAX_OPEN || files[fd].handle < 0)
+    return 0;
+  return &files[fd];
+}
+
+// A descriptor for the file with handle, at offset 0; -1 if there is no
+// such file or all descriptors are in use
+int file_open(int handle)
+{
+  int fd;
+
+  if (!fs_entry_get(handle))
+    return -1;
+  for (fd = 0; fd < FILE_MAX_OPEN; fd++)
+    if (files[fd].handle < 0)
+    {
+      files[fd].handle = handle;
+      files[fd].offset = 0;
+      files[fd].n = -1;
+      return fd;
+    }
+  return -1;
+}
+
+// Frees fd, after committing the fill buffer if it holds a page of its file
+void file_close(int fd)
+{
+  file_desc *d = desc(fd);
+
+  if (!d)
+    return;
+  if (fill_handle == d->handle)
+    file_flush();
+  d->handle = -1;
+}
+
+// Closes the descriptors of a file about to be deleted or replaced, and
+// drops the fill buffer if it holds one of its pages
+void file_forget(int handle)
+{
+  int fd;
+
+  if (handle < 0)
+    return;
+  for (fd = 0; fd < FILE_MAX_OPEN; fd++)
+    if (files[fd].handle == handle)
+      files[fd].handle = -1;
+  if (fill_handle == handle)
+    fill_page = fill_handle = -1;
+}
+
+// Closes every descriptor, for a store about to be formatted
+void file_reset(void)
+{
+  int fd;
+
+  for (fd = 0; fd < FILE_MAX_OPEN; fd++)
+    files[fd].handle = -1;
+  fill_page = fill_handle = -1;
+}
+
+int file_handle(int fd)
+{
+  file_desc *d = desc(fd);
+
+  return d ? d->handle : -1;
+}
+
+U32 file_size(int fd)
+{
+  file_desc *d = desc(fd);
+
+  return d ? fs_size(d->handle) : 0;
+}
+
+// Flash page holding page n of the file, -1 past its allocation
+int file_page(int fd, U32 n)
+{
+  file_desc *d = desc(fd);
+
+  if (!d)
+    return -1;
+  if (d->n != (int)n)
+  {
+    d->page = fs_page(d->handle, n);
+    d->n = d->page < 0 ? -1 : (int)n;
+  }
+  return d->page;
+}
+
+U32 file_tell(int fd)
+{
+  file_desc *d = desc(fd);
+
+  return d ? d->offset : 0;
+}
+
+void file_seek(int fd, U32 offset)
+{
+  file_desc *d = desc(fd);
+
+  if (d)
+    d->offset = offset;
+}
+
+// The file data at offset as one run, up to the end of its page or of the
+// file, from flash or from the fill buffer; 0 with len 0 past the end
+const U8 *file_data_at(int fd, U32 offset, U32 *len)
+{
+  int page = offset < file_size(fd) ? file_page(fd, offset / FLASH_PAGE_SIZE) : -1;
+  U32 pos = offset % FLASH_PAGE_SIZE;
+
+  if (page < 0)
+  {
+    *len = 0;
+    return 0;
+  }
+  *len = FLASH_PAGE_SIZE - pos < file_size(fd) - offset ? FLASH_PAGE_SIZE - pos : file_size(fd) - offset;
+  if (page == fill_page)
+    return (const U8 *)AT91F_Flash_Pipe_Buffer() + pos;
+  return (const U8 *)FS_PAGE_ADDRESS(page) + pos;
+}
+
+// Copies up to len bytes from offset to buf and returns how many there were
+int file_read_at(int fd, U32 offset, U8 *buf, int len)
+{
+  const U8 *data;
+  U32 n;
+  int done = 0;
+
+  while (done < len && (data = file_data_at(fd, offset, &n)))
+  {
+    if (n > (U32)(len - done))
+      n = len - done;
+    copy_bytes(buf + done, data, n);
+    offset += n;
+    done += n;
+  }
+  return done;
+}
+
+// Copies len bytes to offset into the fill buffer, a page at a time. The
+// pages allocated to the file bound the write rather than its size, as
+// for WRITE FILE. Returns len, or -1 if it does not fit.
+int file_write_at(int fd, U32 offset, const U8 *data, int len)
+{
+  int handle = file_handle(fd);
+  U32 limit = fs_pages(handle) * FLASH_PAGE_SIZE;
+  int done;
+
+  if (handle < 0 || offset > limit || (U32)len > limit - offset)
+    return -1;
+
+  for (done = 0; done < len; )
+  {
+    int page = file_page(fd, offset / FLASH_PAGE_SIZE);
+    U32 pos = offset % FLASH_PAGE_SIZE;
+    U32 n = FLASH_PAGE_SIZE - pos < (U32)(len - done) ? FLASH_PAGE_SIZE - pos : (U32)(len - done);
+
+    if (page != fill_page)
+    {
+      file_flush();
+      // keep whatever the write does not cover
+      copy_words(AT91F_Flash_Pipe_Buffer(), (const unsigned int *)FS_PAGE_ADDRESS(page), FLASH_PAGE_SIZE / 4);
+      fill_page = page;
+      fill_handle = handle;
+    }
+
+    memcpy((U8 *)AT91F_Flash_Pipe_Buffer() + pos, data + done, n);
+    if (pos + n == FLASH_PAGE_SIZE)
+      file_flush();
+
+    offset += n;
+    done += n;
+  }
+  return len;
+}
+
+int file_read(int fd, U8 *buf, int len)
+{
+  int n = file_read_at(fd, file_tell(fd), buf, len);
+
+  file_seek(fd, file_tell(fd) + n);
+  return n;
+}
+
+int file_write(int fd, const U8 *data, int len)
+{
+  int n = file_write_at(fd, file_tell(fd), data, len);
+
+  if (n > 0)
+    file_seek(fd, file_tell(fd) + n);
+  return n;
+}
+
+// Commits the fill buffer for programming, if it holds a page
+void file_flush(void)
+{
+  if (fill_page < 0)
+    return;
+  AT91F_Flash_Pipe_Commit(FS_PAGE_ADDRESS(fill_page));
+  fill_page = fill_handle = -1;
+}
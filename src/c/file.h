@@ -0,0 +1,40 @@
+/* Open files.
+ *
+ * A small table of descriptors over the file store (fs.h), so that
+ * several files can be read and written at once, each at its own
+ * position. A descriptor holds the handle of its file, the offset the
+ * sequential file_read() and file_write() go on from, and the flash page
+ * of the file page it used last, which spares the extent walk of
+ * fs_page() while it stays on that page.
+ *
+ * Writes go through the fill buffer of the flash pipeline, shared by all
+ * descriptors. It holds one flash page, read in first so that what a write
+ * does not cover is kept, and is committed for programming when a write
+ * fills it or moves to another page, and on file_flush() or file_close().
+ * Reads see the data still in it.
+ */
+
+#ifndef __FILE_H__
+#  define __FILE_H__
+
+#  include "mytypes.h"
+
+#  define FILE_MAX_OPEN    4
+
+int file_open(int handle);
+void file_close(int fd);
+void file_forget(int handle);
+void file_reset(void);
+int file_handle(int fd);
+U32 file_size(int fd);
+int file_page(int fd, U32 n);
+U32 file_tell(int fd);
+void file_seek(int fd, U32 offset);
+const U8 *file_data_at(int fd, U32 offset, U32 *len);
+int file_read_at(int fd, U32 offset, U8 *buf, int len);
+int file_write_at(int fd, U32 offset, const U8 *data, int len);
+int file_read(int fd, U8 *buf, int len);
+int file_write(int fd, const U8 *data, int len);
+void file_flush(void);
+
+#endif
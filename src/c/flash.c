@@ -18,6 +18,24 @@
 #include "Board.h"
 #include "flash.h"
 #include "interrupts.h"
+#include "timer.h"
+#include "hal.h"
+#include "stats.h"
+#include "trace.h"
+
+//* Called from RAM, with interrupts masked, while the flash is busy
+static AT91PF_Flash_Busy Flash_Busy_Hook;
+
+//* Called before each page command, while the flash is still idle
+static AT91PF_Flash_Wait Flash_Wait_Hook;
+
+//* Page program pipeline: the caller fills one buffer while the other one
+//* waits for, or is in, programming
+static unsigned int Pipe_Buffer[2][FLASH_PAGE_SIZE_LONG];
+static unsigned int Pipe_Address;       // page committed for programming, 0 if none
+static int Pipe_Fill;                   // buffer the caller fills
+static unsigned int Pipe_Completed;     // pages programmed so far
+static int Pipe_Failed;
 
 
 
@@ -30,7 +48,7 @@ void AT91F_Flash_Init (void)
     //* Set number of Flash Waite sate
     //  SAM7S64 features Single Cycle Access at Up to 30 MHz
     //  if MCK = 47923200, 72 Cycles for 1 seconde ( field MC_FMR->FMCN)
-        AT91C_BASE_MC->MC_FMR = ((AT91C_MC_FMCN)&(72 <<16)) | AT91C_MC_FWS_1FWS ;
+        REG_WR(&AT91C_BASE_MC->MC_FMR, ((AT91C_MC_FMCN)&(72 <<16)) | AT91C_MC_FWS_1FWS );
 }
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_Flash_Init
@@ -41,33 +59,61 @@ void AT91F_NVM_Init (void)
     //* Set number of Flash Waite sate
     //  SAM7S64 features Single Cycle Access at Up to 30 MHz
     //  if MCK = 47923200, 48 Cycles for 1 seconde ( field MC_FMR->FMCN)
-        AT91C_BASE_MC->MC_FMR = ((AT91C_MC_FMCN)&(48 <<16)) | AT91C_MC_FWS_1FWS ;
+        REG_WR(&AT91C_BASE_MC->MC_FMR, ((AT91C_MC_FMCN)&(48 <<16)) | AT91C_MC_FWS_1FWS );
 }
 
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_Flash_Ready
-//* \brief Wait the flash ready
+//* \brief Wait the flash ready, at most FLASH_READY_TIMEOUT_MS
+//* \output FSR status, FRDY is still clear on time out
 //*----------------------------------------------------------------------------
 RAMFUNC int AT91F_Flash_Ready (void)
 {
-    unsigned int status;
+    unsigned int status, start;
     status = 0;
+    start = REG_RD(AT91C_PITC_PIIR);
 
     //* Wait the end of command
         while ((status & AT91C_MC_FRDY) != AT91C_MC_FRDY )
         {
-          status = AT91C_BASE_MC->MC_FSR;
+          status = REG_RD(&AT91C_BASE_MC->MC_FSR);
+          if (systick_pit_elapsed_ms(start) > FLASH_READY_TIMEOUT_MS)
+              return REG_RD(&AT91C_BASE_MC->MC_FSR);
+          if (Flash_Busy_Hook)
+              Flash_Busy_Hook();
         }
         return status;
 }
 
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Set_Busy_Hook
+//* \brief Register a .fastrun function polled while a flash command runs.
+//*        Nothing can be fetched from the flash meanwhile, so the hook and
+//*        everything it calls must live in RAM.
+//*----------------------------------------------------------------------------
+void AT91F_Flash_Set_Busy_Hook (AT91PF_Flash_Busy hook)
+{
+    Flash_Busy_Hook = hook;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Set_Wait_Hook
+//* \brief Register a function called before every page command, so the
+//*        caller can tell that it is about to wait for the flash. The
+//*        flash is idle at that point and the hook may live in it.
+//*----------------------------------------------------------------------------
+void AT91F_Flash_Set_Wait_Hook (AT91PF_Flash_Wait hook)
+{
+    Flash_Wait_Hook = hook;
+}
+
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_Flash_Lock_Status
 //* \brief Get the Lock bits field status
 //*----------------------------------------------------------------------------
 RAMFUNC int AT91F_Flash_Lock_Status(void)
 {
-  return (AT91C_BASE_MC->MC_FSR & AT91C_MC_FSR_LOCK);
+  return (REG_RD(&AT91C_BASE_MC->MC_FSR) & AT91C_MC_FSR_LOCK);
 }
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_Flash_Lock
@@ -86,7 +132,7 @@ RAMFUNC int AT91F_Flash_Lock (unsigned int Flash_Lock_Page)
 //		AT91F_disable_interrupt();
 		interrupts_get_and_disable();
 	//* Write the Set Lock Bit command
-        ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_LOCK | (AT91C_MC_PAGEN & (Flash_Lock_Page << 8) ) ;
+        REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_LOCK | (AT91C_MC_PAGEN & (Flash_Lock_Page << 8) ) );
 
     //* Wait the end of command
          AT91F_Flash_Ready();
@@ -110,7 +156,7 @@ RAMFUNC int AT91F_Flash_Unlock(unsigned int Flash_Lock_Page)
 //		AT91F_disable_interrupt();
 		interrupts_get_and_disable();
     //* Write the Clear Lock Bit command
-        AT91C_BASE_MC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_UNLOCK | (AT91C_MC_PAGEN & (Flash_Lock_Page << 8) ) ;
+        REG_WR(&AT91C_BASE_MC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_UNLOCK | (AT91C_MC_PAGEN & (Flash_Lock_Page << 8) ) );
 
     //* Wait the end of command
         AT91F_Flash_Ready();
@@ -135,14 +181,14 @@ RAMFUNC int AT91F_Flash_Erase_All(void)
     //* set the Flash controller base address
         AT91PS_MC ptMC = AT91C_BASE_MC;
     //* Write the Erase All command
-        ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_ERASE_ALL ;
+        REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_ERASE_ALL );
     //* Wait the end of command
         AT91F_Flash_Ready();
    //* Protect
 //		AT91F_enable_interrupt();
 		interrupts_enable();
     //* Check the result
-        return ( (ptMC->MC_FSR & ( AT91C_MC_PROGE | AT91C_MC_LOCKE ))==0) ;
+        return ( (REG_RD(&ptMC->MC_FSR) & ( AT91C_MC_PROGE | AT91C_MC_LOCKE ))==0) ;
 }
 
 RAMFUNC int flash_write( unsigned int Flash_Address, int size, unsigned char * buff)
@@ -171,7 +217,7 @@ RAMFUNC int flash_write( unsigned int Flash_Address, int size, unsigned char * b
     interrupts_get_and_disable();
 		
     //* Write the write page command
-    ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_START_PROG | (AT91C_MC_PAGEN & (page <<8)) ;
+    REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_START_PROG | (AT91C_MC_PAGEN & (page <<8)) );
 	
     //* Wait the end of command
     status = AT91F_Flash_Ready();
@@ -181,18 +227,18 @@ RAMFUNC int flash_write( unsigned int Flash_Address, int size, unsigned char * b
     interrupts_enable();
 
     //* Check the result
-    if ( (status & ( AT91C_MC_PROGE | AT91C_MC_LOCKE ))!=0) 
+    if ( (status & ( AT91C_MC_PROGE | AT91C_MC_LOCKE | AT91C_MC_FRDY )) != AT91C_MC_FRDY )
 		return false;
 	
     return true;
 }
 
 //*----------------------------------------------------------------------------
-//* \fn    AT91F_Flash_Write
-//* \brief Write in one Flash page located in AT91C_IFLASH,  size in 32 bits
-//* \input Flash_Address: start at 0x0010 0000 size: in byte
+//* \fn    Flash_Write_Page
+//* \brief Write in one Flash page, size in bytes. buff 0 fills the page with
+//*        ERASE_VALUE. nebp AT91C_MC_NEBP skips the erase before programming.
 //*----------------------------------------------------------------------------
-RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned int * buff)
+static RAMFUNC int Flash_Write_Page( unsigned int Flash_Address, int size, unsigned int * buff, unsigned int nebp)
 {
     //* set the Flash controller base address
     AT91PS_MC ptMC = AT91C_BASE_MC;
@@ -202,15 +248,19 @@ RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned in
     //* init flash pointer
     Flash = (unsigned int *) Flash_Address;
 
+    if (Flash_Wait_Hook)
+        Flash_Wait_Hook();
+
     AT91F_Flash_Init();
+    REG_OR(&ptMC->MC_FMR, nebp);
 	
     //* Get the Flash page number
     page = ((Flash_Address - (unsigned int)AT91C_IFLASH ) /FLASH_PAGE_SIZE_BYTE);
 	
     //* copy the new value
-	for (i=0; (i < FLASH_PAGE_SIZE_BYTE) & (size > 0) ;i++, Flash++,buff++,size-=4 ){
+	for (i=0; (i < FLASH_PAGE_SIZE_BYTE) & (size > 0) ;i++, Flash++,size-=4 ){
 	//* copy the flash to the write buffer ensuring code generation
-	    *Flash=*buff;
+	    REG_WR(Flash, buff ? *buff++ : ERASE_VALUE);
 	}
 	
 	//* Protect
@@ -218,17 +268,21 @@ RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned in
 	interrupts_get_and_disable();
 	
     //* Write the write page command
-    ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_START_PROG | (AT91C_MC_PAGEN & (page <<8)) ;
+    trace(TRACE_MAIN, TRACE_FLASH_START, nebp != 0, page);
+    REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_START_PROG | (AT91C_MC_PAGEN & (page <<8)) );
 	
     //* Wait the end of command
     status = AT91F_Flash_Ready();
+    trace(TRACE_MAIN, TRACE_FLASH_END, !(status & (AT91C_MC_PROGE | AT91C_MC_LOCKE)), page);
 	
     //* Protect
     //	AT91F_enable_interrupt();
 	interrupts_enable();
 
+    REG_AND(&ptMC->MC_FMR, ~AT91C_MC_NEBP);
+
     //* Check the result
-    if ( (status & ( AT91C_MC_PROGE | AT91C_MC_LOCKE ))!=0) 
+    if ( (status & ( AT91C_MC_PROGE | AT91C_MC_LOCKE | AT91C_MC_FRDY )) != AT91C_MC_FRDY )
 		return false;
 	
     return true;
@@ -239,6 +293,96 @@ RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned in
 //* \brief Write in one Flash page located in AT91C_IFLASH,  size in 32 bits
 //* \input Flash_Address: start at 0x0010 0000 size: in byte
 //*----------------------------------------------------------------------------
+RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned int * buff)
+{
+    //* timed from flash code, which is safe here: the flash is idle
+    //* before and after the page cycle
+    U32 start = stats_start();
+    int ok = Flash_Write_Page(Flash_Address, size, buff, 0);
+
+    stats_end(STATS_FLASH_WRITE, start);
+    return ok;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Program
+//* \brief Like AT91F_Flash_Write for a page known to be erased: only the
+//*        program half of the page cycle is run
+//*----------------------------------------------------------------------------
+RAMFUNC int AT91F_Flash_Program( unsigned int Flash_Address, int size, unsigned int * buff)
+{
+    return Flash_Write_Page(Flash_Address, size, buff, AT91C_MC_NEBP);
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Erase_Page
+//* \brief Erase one Flash page, so that it can later be programmed with
+//*        AT91F_Flash_Program
+//*----------------------------------------------------------------------------
+RAMFUNC int AT91F_Flash_Erase_Page( unsigned int Flash_Address)
+{
+    return Flash_Write_Page(Flash_Address, FLASH_PAGE_SIZE_BYTE, 0, 0);
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Pipe_Buffer
+//* \brief Page buffer the caller fills next
+//*----------------------------------------------------------------------------
+unsigned int * AT91F_Flash_Pipe_Buffer (void)
+{
+    return Pipe_Buffer[Pipe_Fill];
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Pipe_Run
+//* \brief Program the committed page, if any. Called from the main loop once
+//*        the reply to the host has been queued.
+//*----------------------------------------------------------------------------
+HOTFUNC void AT91F_Flash_Pipe_Run (void)
+{
+    if (!Pipe_Address)
+        return;
+
+    if (!AT91F_Flash_Write(Pipe_Address, FLASH_PAGE_SIZE_BYTE, Pipe_Buffer[Pipe_Fill ^ 1]))
+        Pipe_Failed = true;
+
+    Pipe_Completed++;
+    Pipe_Address = 0;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Pipe_Commit
+//* \brief Queue the filled buffer for Flash_Address and switch the caller to
+//*        the other buffer. A page still waiting there is programmed first.
+//*----------------------------------------------------------------------------
+void AT91F_Flash_Pipe_Commit (unsigned int Flash_Address)
+{
+    AT91F_Flash_Pipe_Run();
+    Pipe_Address = Flash_Address;
+    Pipe_Fill ^= 1;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Pipe_Status
+//* \brief Report pages programmed so far and whether one failed since the
+//*        last call
+//* \output true if no page failed
+//*----------------------------------------------------------------------------
+int AT91F_Flash_Pipe_Status (unsigned int * completed)
+{
+    int failed = Pipe_Failed;
+
+    if (completed)
+        *completed = Pipe_Completed;
+    Pipe_Failed = false;
+    return failed ? false : true;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    AT91F_Flash_Read
+//* \brief Read from one Flash page located in AT91C_IFLASH,  size in 32 bits
+//* \input Flash_Address: start at 0x0010 0000 size: in words
+//*----------------------------------------------------------------------------
 void AT91F_Flash_Read( unsigned int Flash_Address, int size, unsigned int * buff)
 {
     unsigned int i;
@@ -260,7 +404,7 @@ void AT91F_Flash_Read( unsigned int Flash_Address, int size, unsigned int * buff
 //*----------------------------------------------------------------------------
 RAMFUNC int AT91F_NVM_Status(void)
 {
-  return (AT91C_BASE_MC->MC_FSR & AT91C_MC_FSR_MVM);
+  return (REG_RD(&AT91C_BASE_MC->MC_FSR) & AT91C_MC_FSR_MVM);
 }
 
 //*----------------------------------------------------------------------------
@@ -278,7 +422,7 @@ RAMFUNC int AT91F_NVM_Set (unsigned char NVM_Number)
 
 	 //* write the flash
     //* Write the Set NVM Bit command
-        ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_SET_GP_NVM | (AT91C_MC_PAGEN & (NVM_Number << 8) ) ;
+        REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_SET_GP_NVM | (AT91C_MC_PAGEN & (NVM_Number << 8) ) );
 
     //* Wait the end of command
         AT91F_Flash_Ready();
@@ -303,7 +447,7 @@ RAMFUNC int AT91F_NVM_Clear(unsigned char NVM_Number)
 		interrupts_get_and_disable();
 	 //* write the flash
     //* Write the Clear NVM Bit command
-        ptMC->MC_FCR = AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_CLR_GP_NVM | (AT91C_MC_PAGEN & (NVM_Number << 8) ) ;
+        REG_WR(&ptMC->MC_FCR, AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_CLR_GP_NVM | (AT91C_MC_PAGEN & (NVM_Number << 8) ) );
 
     //* Wait the end of command
        AT91F_Flash_Ready();
@@ -321,7 +465,7 @@ RAMFUNC int AT91F_NVM_Clear(unsigned char NVM_Number)
 //*----------------------------------------------------------------------------
 RAMFUNC int AT91F_SET_Security_Status (void)
 {
-  return (AT91C_BASE_MC->MC_FSR & AT91C_MC_SECURITY);
+  return (REG_RD(&AT91C_BASE_MC->MC_FSR) & AT91C_MC_SECURITY);
 }
 
 //*----------------------------------------------------------------------------
@@ -336,7 +480,7 @@ RAMFUNC int AT91F_SET_Security (void)
 		interrupts_get_and_disable();
 	 //* write the flash
     //* Write the Set Security Bit command
-        AT91C_BASE_MC->MC_FCR = ( AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_SET_SECURITY ) ;
+        REG_WR(&AT91C_BASE_MC->MC_FCR, ( AT91C_MC_CORRECT_KEY | AT91C_MC_FCMD_SET_SECURITY ) );
 
     //* Wait the end of command
        AT91F_Flash_Ready();
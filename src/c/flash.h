@@ -28,6 +28,7 @@
 #define AT91C_MC_CORRECT_KEY    ((unsigned int) 0x5A << 24) // (MC) Correct Protect Key
 
 #define	 ERASE_VALUE 		0xFFFFFFFF
+#define  FLASH_READY_TIMEOUT_MS	20	/* page program takes 6 ms at most */
 
 /*-----------------------*/
 /* Flash size Definition */
@@ -52,14 +53,30 @@
 /* External function Definition */
 /*------------------------------*/
 
+/* Busy hook, must be a RAMFUNC */
+typedef void (*AT91PF_Flash_Busy)(void);
+
+/* Wait hook, runs before a page command starts */
+typedef void (*AT91PF_Flash_Wait)(void);
+
 /* Flash function */
 extern void AT91F_Flash_Init(void);
 extern int AT91F_Flash_Check_Erase(unsigned int * start, unsigned int size);
 extern RAMFUNC int AT91F_Flash_Erase_All(void);
 extern RAMFUNC int AT91F_Flash_Write( unsigned int Flash_Address, int size, unsigned int * buff);
+extern RAMFUNC int AT91F_Flash_Program( unsigned int Flash_Address, int size, unsigned int * buff);
+extern RAMFUNC int AT91F_Flash_Erase_Page( unsigned int Flash_Address);
 extern RAMFUNC int flash_write( unsigned int Flash_Address, int size, unsigned char * buff);
 extern void AT91F_Flash_Read( unsigned int Flash_Address ,int size ,unsigned int * buff);
 extern int AT91F_Flash_Write_all( unsigned int Flash_Address ,int size ,unsigned char * buff);
+extern void AT91F_Flash_Set_Busy_Hook(AT91PF_Flash_Busy hook);
+extern void AT91F_Flash_Set_Wait_Hook(AT91PF_Flash_Wait hook);
+
+/* Page program pipeline */
+extern unsigned int * AT91F_Flash_Pipe_Buffer(void);
+extern void AT91F_Flash_Pipe_Commit(unsigned int Flash_Address);
+extern void AT91F_Flash_Pipe_Run(void);
+extern int AT91F_Flash_Pipe_Status(unsigned int * completed);
 
 /* Lock Bits functions */
 extern RAMFUNC int AT91F_Flash_Lock_Status(void);
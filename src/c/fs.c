@@ -0,0 +1,829 @@
+/* Flash file system.
+ *
+ * The directory is read straight out of flash, so looking up a handle
+ * is an address calculation. Which slots and data pages are in use is
+ * kept in two RAM bitmaps that are built by fs_mount() and kept up to
+ * date by every directory write, so creating a file never rescans the
+ * directory to find space.
+ *
+ * fs_mount() also builds a cache of every file's name hash, size and
+ * first extent, chained from a table of hash buckets. FIND probes one
+ * bucket and only touches the directory to confirm a hash match.
+ *
+ * Metadata pages are never rewritten in place. fs_log_write() programs
+ * the new version into the next free log page and fs_map[] is pointed
+ * at it; the old copy becomes stale. fs_mount() rebuilds fs_map[] from
+ * the newest sequence number of every page. Stale pages are erased by
+ * fs_gc() while the host is idle, so an append usually only has to
+ * program an already erased page. Data pages are spread the same way:
+ * allocation continues from where the last one ended instead of
+ * reusing the lowest free pages.
+ */
+
+#include "mytypes.h"
+#include "Board.h"
+#include "flash.h"
+#include "fs.h"
+#include <string.h>
+
+/* Where the volume marker lives in the super page. The first 32 bytes
+ * are the RFU area and the password as the old firmware left them.
+ */
+#define FS_SUPER_MAGIC    32
+#define FS_SUPER_VERSION  36
+#define FS_VERSION        2
+
+/* Layout of the FS_META_SUPER page after its header. */
+#define FS_META_HEADER    16     /* RFU area and password, 32 bytes */
+#define FS_META_FORMAT    48     /* directory pages older than this seq are empty */
+
+#define FS_LEGACY_ENTRIES 7
+
+#define FS_HASH_BUCKETS   64     /* power of two */
+
+#define FS_NO_PAGE        0xFF
+
+#define BIT_TEST(map, n)  ((map)[(n) >> 5] & (1UL << ((n) & 31)))
+#define BIT_SET(map, n)   ((map)[(n) >> 5] |= (1UL << ((n) & 31)))
+#define BIT_CLEAR(map, n) ((map)[(n) >> 5] &= ~(1UL << ((n) & 31)))
+
+static const U8 fs_magic[4] = { 'C', 'C', 'F', 'S' };
+static const U8 fs_log_magic[4] = { 'C', 'C', 'F', 'L' };
+
+static U32 fs_used_slots[(FS_MAX_FILES + 31) / 32];
+static U32 fs_used_pages[(FS_DATA_PAGES + 31) / 32];
+static U32 fs_free;
+static U32 fs_cursor;    /* data page the next allocation starts from */
+
+/* Metadata log state. */
+static U8 fs_map[FS_META_PAGES];    /* log page of each metadata page */
+static U32 fs_log_live[(FS_LOG_PAGES + 31) / 32];
+static U32 fs_log_erased[(FS_LOG_PAGES + 31) / 32];
+static U32 fs_log_stale;            /* pages neither live nor erased */
+static U32 fs_log_head;             /* where the search for a free page starts */
+static U32 fs_seq;                  /* last sequence number used */
+
+/* What a FIND or a transfer needs to know about a file. */
+typedef struct {
+  U32 hash;
+  U32 size;
+  U16 start;     /* first page of the first extent */
+  U16 count;     /* pages in the first extent */
+  U16 pages;     /* pages in all extents */
+  S16 next;      /* next handle in the bucket, -1 at the end */
+} fs_cache_entry;
+
+static fs_cache_entry fs_cache[FS_MAX_FILES];
+static S16 fs_bucket[FS_HASH_BUCKETS];
+
+/* Page image for metadata and super page updates. */
+static unsigned int fs_buf[FLASH_PAGE_SIZE / 4];
+
+
+static U32
+fs_get_be32(const U8 *b)
+{
+  return ((U32)b[0] << 24) | ((U32)b[1] << 16) | ((U32)b[2] << 8) | b[3];
+}
+
+static void
+fs_put_be32(U8 *b, U32 n)
+{
+  b[0] = (n >> 24) & 0xFF;
+  b[1] = (n >> 16) & 0xFF;
+  b[2] = (n >> 8) & 0xFF;
+  b[3] = n & 0xFF;
+}
+
+/* FNV-1a over the name without its trailing NUL padding. */
+static U32
+fs_hash(const U8 *name, int len)
+{
+  U32 h = 2166136261UL;
+
+  while (len > 0 && name[len - 1] == 0)
+    len--;
+  while (len-- > 0)
+    h = (h ^ *name++) * 16777619UL;
+  return h;
+}
+
+static void
+fs_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < FS_HASH_BUCKETS; i++)
+    fs_bucket[i] = -1;
+}
+
+static void
+fs_cache_add(int handle, const fs_entry *e)
+{
+  fs_cache_entry *c = &fs_cache[handle];
+  int i;
+
+  c->hash = fs_hash(e->name, FS_NAME_LEN);
+  c->size = fs_get_be32(e->size);
+  c->start = e->extent[0].start;
+  c->count = e->extent[0].count;
+  c->pages = 0;
+  for (i = 0; i < FS_MAX_EXTENTS; i++)
+    c->pages += e->extent[i].count;
+
+  c->next = fs_bucket[c->hash & (FS_HASH_BUCKETS - 1)];
+  fs_bucket[c->hash & (FS_HASH_BUCKETS - 1)] = handle;
+}
+
+static void
+fs_cache_drop(int handle)
+{
+  S16 *link = &fs_bucket[fs_cache[handle].hash & (FS_HASH_BUCKETS - 1)];
+
+  while (*link >= 0) {
+    if (*link == handle) {
+      *link = fs_cache[handle].next;
+      return;
+    }
+    link = &fs_cache[*link].next;
+  }
+}
+
+static const U8 *
+fs_log_page(int n)
+{
+  return (const U8 *)FS_PAGE_ADDRESS(FS_LOG_FIRST + n);
+}
+
+static U32
+fs_log_seq(int n)
+{
+  return fs_get_be32(((const fs_meta_header *)fs_log_page(n))->seq);
+}
+
+static U16
+fs_check(const unsigned int *page)
+{
+  const U8 *b = (const U8 *)page;
+  U16 sum = 0;
+  int i;
+
+  for (i = 0; i < FLASH_PAGE_SIZE; i++)
+    sum += b[i];
+  return sum;
+}
+
+static int
+fs_log_valid(int n)
+{
+  const fs_meta_header *h = (const fs_meta_header *)fs_log_page(n);
+  U16 check = h->check;
+
+  if (memcmp(h->magic, fs_log_magic, 4) != 0 || h->id >= FS_META_PAGES)
+    return 0;
+  /* the check was computed with the field itself at 0 */
+  return (U16)(fs_check((const unsigned int *)h) - (check & 0xFF) - (check >> 8)) == check;
+}
+
+static int
+fs_log_blank(int n)
+{
+  const unsigned int *w = (const unsigned int *)fs_log_page(n);
+  int i;
+
+  for (i = 0; i < FLASH_PAGE_SIZE / 4; i++)
+    if (w[i] != ERASE_VALUE)
+      return 0;
+  return 1;
+}
+
+/* Next log page to append to: an erased one if there is any, otherwise
+ * any page that holds no live copy. There are always more log pages
+ * than metadata pages, so one is found.
+ */
+static int
+fs_log_alloc(void)
+{
+  int i, n;
+
+  for (i = 0; i < FS_LOG_PAGES; i++) {
+    n = (fs_log_head + i) % FS_LOG_PAGES;
+    if (BIT_TEST(fs_log_erased, n))
+      return n;
+  }
+  for (i = 0; i < FS_LOG_PAGES; i++) {
+    n = (fs_log_head + i) % FS_LOG_PAGES;
+    if (!BIT_TEST(fs_log_live, n))
+      return n;
+  }
+  return -1;
+}
+
+/* Appends fs_buf as the new version of metadata page id. */
+static int
+fs_log_write(int id)
+{
+  fs_meta_header *h = (fs_meta_header *)fs_buf;
+  int n = fs_log_alloc(), old = fs_map[id], ok;
+
+  memcpy(h->magic, fs_log_magic, 4);
+  h->id = id;
+  fs_put_be32(h->seq, ++fs_seq);
+  h->cursor = fs_cursor;
+  h->check = 0;
+  h->check = fs_check(fs_buf);
+
+  if (BIT_TEST(fs_log_erased, n)) {
+    BIT_CLEAR(fs_log_erased, n);
+    ok = AT91F_Flash_Program(FS_PAGE_ADDRESS(FS_LOG_FIRST + n), FLASH_PAGE_SIZE, fs_buf);
+  }
+  else {
+    fs_log_stale--;
+    ok = AT91F_Flash_Write(FS_PAGE_ADDRESS(FS_LOG_FIRST + n), FLASH_PAGE_SIZE, fs_buf);
+  }
+  fs_log_head = (n + 1) % FS_LOG_PAGES;
+
+  if (!ok) {
+    fs_log_stale++;
+    return 0;
+  }
+
+  BIT_SET(fs_log_live, n);
+  fs_map[id] = n;
+  if (old != FS_NO_PAGE) {
+    BIT_CLEAR(fs_log_live, old);
+    fs_log_stale++;
+  }
+  return 1;
+}
+
+/* Drops the live copy of a metadata page. */
+static void
+fs_log_drop(int id)
+{
+  if (fs_map[id] == FS_NO_PAGE)
+    return;
+  BIT_CLEAR(fs_log_live, fs_map[id]);
+  fs_log_stale++;
+  fs_map[id] = FS_NO_PAGE;
+}
+
+/* Scans the log for the newest copy of every metadata page. */
+static void
+fs_log_scan(void)
+{
+  U32 newest = 0;
+  int n, id;
+
+  memset(fs_map, FS_NO_PAGE, sizeof(fs_map));
+  memset(fs_log_live, 0, sizeof(fs_log_live));
+  memset(fs_log_erased, 0, sizeof(fs_log_erased));
+  fs_log_stale = 0;
+  fs_seq = 0;
+  fs_cursor = 0;
+
+  for (n = 0; n < FS_LOG_PAGES; n++) {
+    if (fs_log_blank(n)) {
+      BIT_SET(fs_log_erased, n);
+      continue;
+    }
+    fs_log_stale++;
+    if (!fs_log_valid(n))
+      continue;
+
+    id = ((const fs_meta_header *)fs_log_page(n))->id;
+    if (fs_log_seq(n) > fs_seq) {
+      fs_seq = fs_log_seq(n);
+      fs_cursor = ((const fs_meta_header *)fs_log_page(n))->cursor % FS_DATA_PAGES;
+      newest = n;
+    }
+    if (fs_map[id] == FS_NO_PAGE || fs_log_seq(n) > fs_log_seq(fs_map[id]))
+      fs_map[id] = n;
+  }
+  fs_log_head = (newest + 1) % FS_LOG_PAGES;
+
+  /* a format leaves the directory pages written before it behind */
+  if (fs_map[FS_META_SUPER] != FS_NO_PAGE) {
+    U32 format = fs_get_be32(fs_log_page(fs_map[FS_META_SUPER]) + FS_META_FORMAT);
+
+    for (id = 0; id < FS_DIR_PAGES; id++)
+      if (fs_map[id] != FS_NO_PAGE && fs_log_seq(fs_map[id]) < format)
+        fs_map[id] = FS_NO_PAGE;
+  }
+
+  for (id = 0; id < FS_META_PAGES; id++) {
+    if (fs_map[id] != FS_NO_PAGE) {
+      BIT_SET(fs_log_live, fs_map[id]);
+      fs_log_stale--;
+    }
+  }
+}
+
+/* Writes the super metadata page: header is the 32-byte RFU and password
+ * area, format is 0 to keep the directory or 1 to empty it.
+ */
+static int
+fs_write_super(const U8 *header, int format)
+{
+  U8 *b = (U8 *)fs_buf;
+  U32 seq = fs_seq + 1;
+
+  if (!format && fs_map[FS_META_SUPER] != FS_NO_PAGE)
+    seq = fs_get_be32(fs_log_page(fs_map[FS_META_SUPER]) + FS_META_FORMAT);
+
+  memset(b, 0, FLASH_PAGE_SIZE);
+  memcpy(b + FS_META_HEADER, header, 32);
+  fs_put_be32(b + FS_META_FORMAT, seq);
+  return fs_log_write(FS_META_SUPER);
+}
+
+static const fs_dir_page *
+fs_dir(int n)
+{
+  return (const fs_dir_page *)fs_log_page(fs_map[n]);
+}
+
+/* Appends a new version of the directory page holding handle with its
+ * entry replaced by e, or cleared when e is 0.
+ */
+static int
+fs_put_entry(int handle, const fs_entry *e)
+{
+  int n = handle / FS_DIR_ENTRIES;
+  fs_dir_page *p = (fs_dir_page *)fs_buf;
+  fs_entry *slot = &p->entry[handle % FS_DIR_ENTRIES];
+
+  if (fs_map[n] != FS_NO_PAGE)
+    memcpy(p, fs_dir(n), FLASH_PAGE_SIZE);
+  else
+    memset(p, 0, FLASH_PAGE_SIZE);
+
+  if (e)
+    memcpy(slot, e, sizeof(fs_entry));
+  else
+    memset(slot, 0, sizeof(fs_entry));
+
+  return fs_log_write(n);
+}
+
+/* First free data page at or after from, FS_DATA_PAGES if there is none. */
+static U32
+fs_next_free(U32 from)
+{
+  while (from < FS_DATA_PAGES) {
+    if (fs_used_pages[from >> 5] == 0xFFFFFFFF)
+      from = (from | 31) + 1;
+    else if (BIT_TEST(fs_used_pages, from))
+      from++;
+    else
+      return from;
+  }
+  return FS_DATA_PAGES;
+}
+
+/* Length of the free run starting at from, at most max. */
+static U32
+fs_run(U32 from, U32 max)
+{
+  U32 n = 0;
+
+  while (n < max && from + n < FS_DATA_PAGES && !BIT_TEST(fs_used_pages, from + n))
+    n++;
+  return n;
+}
+
+static void
+fs_mark(const fs_extent *ext, int used)
+{
+  int i;
+  U32 p, end;
+
+  for (i = 0; i < FS_MAX_EXTENTS; i++) {
+    if (ext[i].count == 0 || ext[i].start < FS_DATA_FIRST ||
+        ext[i].start + ext[i].count > FS_LOG_FIRST)
+      continue;
+    end = ext[i].start - FS_DATA_FIRST + ext[i].count;
+    for (p = ext[i].start - FS_DATA_FIRST; p < end; p++) {
+      if (used && !BIT_TEST(fs_used_pages, p)) {
+        BIT_SET(fs_used_pages, p);
+        fs_free--;
+      }
+      else if (!used && BIT_TEST(fs_used_pages, p)) {
+        BIT_CLEAR(fs_used_pages, p);
+        fs_free++;
+      }
+    }
+  }
+}
+
+/* Finds pages for a file, searching from the allocation cursor round
+ * to it again: one run if there is a hole big enough, otherwise the
+ * first free runs up to FS_MAX_EXTENTS of them.
+ */
+static int
+fs_alloc(U32 pages, fs_extent *ext)
+{
+  U32 p, n, from, to, left = pages;
+  int i = 0, pass;
+
+  memset(ext, 0, FS_MAX_EXTENTS * sizeof(fs_extent));
+  if (pages > fs_free)
+    return 0;
+
+  for (pass = 0; pass < 2 && i == 0; pass++) {
+    from = pass ? 0 : fs_cursor;
+    to = pass ? fs_cursor : FS_DATA_PAGES;
+    for (p = fs_next_free(from); p < to; p = fs_next_free(p + n)) {
+      n = fs_run(p, pages);
+      if (n == pages) {
+        ext[0].start = FS_DATA_FIRST + p;
+        ext[0].count = n;
+        i = 1;
+        left = 0;
+        break;
+      }
+    }
+  }
+
+  for (pass = 0; pass < 2 && left; pass++) {
+    from = pass ? 0 : fs_cursor;
+    to = pass ? fs_cursor : FS_DATA_PAGES;
+    for (p = fs_next_free(from); left && i < FS_MAX_EXTENTS && p < to; p = fs_next_free(p + n)) {
+      n = fs_run(p, left < to - p ? left : to - p);
+      ext[i].start = FS_DATA_FIRST + p;
+      ext[i].count = n;
+      left -= n;
+      i++;
+    }
+  }
+
+  if (left) {
+    memset(ext, 0, FS_MAX_EXTENTS * sizeof(fs_extent));
+    return 0;
+  }
+  fs_mark(ext, 1);
+  fs_cursor = (ext[i - 1].start - FS_DATA_FIRST + ext[i - 1].count) % FS_DATA_PAGES;
+  return 1;
+}
+
+/* Moves the password and the entries of the old single index page into
+ * the log and marks the super page as formatted. Old files stay where
+ * they are.
+ */
+static void
+fs_migrate(void)
+{
+  const U8 *super = (const U8 *)FS_PAGE_ADDRESS(FS_SUPER_PAGE);
+  fs_dir_page *p = (fs_dir_page *)fs_buf;
+  U8 *b = (U8 *)fs_buf;
+  U32 page = FS_DATA_FIRST;
+  int i;
+
+  fs_write_super(super, 1);
+
+  memset(p, 0, FLASH_PAGE_SIZE);
+  for (i = 0; i < FS_LEGACY_ENTRIES; i++) {
+    const U8 *old = super + 32 * (i + 1);
+    fs_entry *e = &p->entry[i % FS_DIR_ENTRIES];
+    U32 size = fs_get_be32(old + FS_NAME_LEN);
+    U32 pages = size / FLASH_PAGE_SIZE + 1;
+
+    if (size == 0 || pages > FS_LOG_FIRST - page)
+      break;
+
+    memcpy(e->name, old, FS_NAME_LEN);
+    memcpy(e->size, old + FS_NAME_LEN, 4);
+    e->extent[0].start = page;
+    e->extent[0].count = pages;
+    e->flags = FS_ENTRY_USED;
+    page += pages;
+    fs_cursor = page - FS_DATA_FIRST;
+
+    if (i % FS_DIR_ENTRIES == FS_DIR_ENTRIES - 1) {
+      fs_log_write(i / FS_DIR_ENTRIES);
+      memset(p, 0, FLASH_PAGE_SIZE);
+    }
+  }
+  if (i % FS_DIR_ENTRIES)
+    fs_log_write(i / FS_DIR_ENTRIES);
+
+  memcpy(b, super, 32);
+  memset(b + 32, 0, FLASH_PAGE_SIZE - 32);
+  memcpy(b + FS_SUPER_MAGIC, fs_magic, 4);
+  b[FS_SUPER_VERSION] = FS_VERSION;
+  AT91F_Flash_Write(FS_PAGE_ADDRESS(FS_SUPER_PAGE), FLASH_PAGE_SIZE, fs_buf);
+}
+
+void
+fs_mount(void)
+{
+  const U8 *super = (const U8 *)FS_PAGE_ADDRESS(FS_SUPER_PAGE);
+  int n, i;
+
+  fs_log_scan();
+
+  if (memcmp(super + FS_SUPER_MAGIC, fs_magic, 4) != 0 || super[FS_SUPER_VERSION] != FS_VERSION)
+    fs_migrate();
+
+  memset(fs_used_slots, 0, sizeof(fs_used_slots));
+  memset(fs_used_pages, 0, sizeof(fs_used_pages));
+  fs_free = FS_DATA_PAGES;
+  fs_cache_clear();
+
+  for (n = 0; n < FS_DIR_PAGES; n++) {
+    const fs_dir_page *p;
+
+    if (fs_map[n] == FS_NO_PAGE)
+      continue;
+    p = fs_dir(n);
+    for (i = 0; i < FS_DIR_ENTRIES; i++) {
+      if (p->entry[i].flags != FS_ENTRY_USED)
+        continue;
+      BIT_SET(fs_used_slots, n * FS_DIR_ENTRIES + i);
+      fs_mark(p->entry[i].extent, 1);
+      fs_cache_add(n * FS_DIR_ENTRIES + i, &p->entry[i]);
+    }
+  }
+}
+
+/* Deletes every file with a single append of the super page. */
+void
+fs_format(void)
+{
+  int n;
+
+  if (!fs_write_super(fs_header(), 1))
+    return;
+  for (n = 0; n < FS_DIR_PAGES; n++)
+    fs_log_drop(n);
+
+  memset(fs_used_slots, 0, sizeof(fs_used_slots));
+  memset(fs_used_pages, 0, sizeof(fs_used_pages));
+  fs_free = FS_DATA_PAGES;
+  fs_cache_clear();
+}
+
+/* Erases one stale log page, if there is one. Called while the host is
+ * idle so that later appends find erased pages.
+ */
+void
+fs_gc(void)
+{
+  int i, n;
+
+  if (fs_log_stale == 0)
+    return;
+
+  for (i = 0; i < FS_LOG_PAGES; i++) {
+    n = (fs_log_head + i) % FS_LOG_PAGES;
+    if (BIT_TEST(fs_log_live, n) || BIT_TEST(fs_log_erased, n))
+      continue;
+    if (AT91F_Flash_Erase_Page(FS_PAGE_ADDRESS(FS_LOG_FIRST + n)))
+      BIT_SET(fs_log_erased, n);
+    fs_log_stale--;
+    return;
+  }
+}
+
+/* The 32-byte RFU and password area. */
+const U8 *
+fs_header(void)
+{
+  if (fs_map[FS_META_SUPER] == FS_NO_PAGE)
+    return (const U8 *)FS_PAGE_ADDRESS(FS_SUPER_PAGE);
+  return fs_log_page(fs_map[FS_META_SUPER]) + FS_META_HEADER;
+}
+
+int
+fs_set_password(const U8 *password, int len)
+{
+  U8 header[32];
+
+  if (len > 16)
+    len = 16;
+  memcpy(header, fs_header(), 32);
+  memcpy(header + 16, password, len);
+  return fs_write_super(header, 0);
+}
+
+const fs_entry *
+fs_entry_get(int handle)
+{
+  if (handle < 0 || handle >= FS_MAX_FILES || !BIT_TEST(fs_used_slots, handle))
+    return 0;
+  return &fs_dir(handle / FS_DIR_ENTRIES)->entry[handle % FS_DIR_ENTRIES];
+}
+
+/* Next handle in use after handle, -1 at the end. Pass -1 to start. */
+int
+fs_next(int handle)
+{
+  for (handle++; handle < FS_MAX_FILES; handle++) {
+    if (fs_used_slots[handle >> 5] == 0) {
+      handle |= 31;
+      continue;
+    }
+    if (BIT_TEST(fs_used_slots, handle))
+      return handle;
+  }
+  return -1;
+}
+
+/* Names are compared without their trailing NUL padding. */
+int
+fs_find(const U8 *name, int len)
+{
+  U32 hash;
+  int h;
+
+  if (len > FS_NAME_LEN)
+    len = FS_NAME_LEN;
+  while (len > 0 && name[len - 1] == 0)
+    len--;
+
+  hash = fs_hash(name, len);
+  for (h = fs_bucket[hash & (FS_HASH_BUCKETS - 1)]; h >= 0; h = fs_cache[h].next) {
+    const fs_entry *e;
+
+    if (fs_cache[h].hash != hash)
+      continue;
+    e = fs_entry_get(h);
+    if (memcmp(e->name, name, len) == 0 && (len == FS_NAME_LEN || e->name[len] == 0))
+      return h;
+  }
+  return -1;
+}
+
+/* Creates a file of size bytes, replacing any file of the same name.
+ * As on the old index page a file gets size/256 + 1 pages. Returns the
+ * handle, or -1 when the directory or the flash is full.
+ *
+ * A replacement takes over the handle of the old file. Its pages are
+ * allocated while the old ones are still in use and the entry is swapped
+ * in one directory write, so a create that fails leaves the old file as
+ * it was; replacing a file therefore needs room for both.
+ */
+int
+fs_create(const U8 *name, int len, U32 size)
+{
+  fs_entry e;
+  fs_extent old[FS_MAX_EXTENTS];
+  int h, replace;
+
+  if (len > FS_NAME_LEN)
+    len = FS_NAME_LEN;
+
+  h = fs_find(name, len);
+  replace = h >= 0;
+  if (replace)
+    memcpy(old, fs_entry_get(h)->extent, sizeof(old));
+  else {
+    for (h = 0; h < FS_MAX_FILES && BIT_TEST(fs_used_slots, h); h++)
+      if (fs_used_slots[h >> 5] == 0xFFFFFFFF)
+        h |= 31;
+    if (h >= FS_MAX_FILES)
+      return -1;
+  }
+
+  memset(&e, 0, sizeof(e));
+  memcpy(e.name, name, len);
+  fs_put_be32(e.size, size);
+  e.flags = FS_ENTRY_USED;
+  if (!fs_alloc(size / FLASH_PAGE_SIZE + 1, e.extent))
+    return -1;
+
+  if (!fs_put_entry(h, &e)) {
+    fs_mark(e.extent, 0);
+    return -1;
+  }
+  if (replace) {
+    fs_cache_drop(h);
+    fs_mark(old, 0);
+  }
+  BIT_SET(fs_used_slots, h);
+  fs_cache_add(h, &e);
+  return h;
+}
+
+int
+fs_delete(int handle)
+{
+  const fs_entry *e = fs_entry_get(handle);
+  fs_extent ext[FS_MAX_EXTENTS];
+
+  if (!e)
+    return 0;
+
+  /* e points into a log page that the rewrite makes stale. */
+  memcpy(ext, e->extent, sizeof(ext));
+  if (!fs_put_entry(handle, 0))
+    return 0;
+
+  BIT_CLEAR(fs_used_slots, handle);
+  fs_cache_drop(handle);
+  fs_mark(ext, 0);
+  return 1;
+}
+
+U32
+fs_size(int handle)
+{
+  return fs_entry_get(handle) ? fs_cache[handle].size : 0;
+}
+
+/* Pages allocated to the file. */
+U32
+fs_pages(int handle)
+{
+  return fs_entry_get(handle) ? fs_cache[handle].pages : 0;
+}
+
+/* Flash page holding page n of the file, -1 past its allocation. */
+int
+fs_page(int handle, U32 n)
+{
+  const fs_entry *e = fs_entry_get(handle);
+  int i;
+
+  if (!e)
+    return -1;
+  if (n < fs_cache[handle].count)
+    return fs_cache[handle].start + n;
+  for (i = 0; i < FS_MAX_EXTENTS; i++) {
+    if (n < e->extent[i].count)
+      return e->extent[i].start + n;
+    n -= e->extent[i].count;
+  }
+  return -1;
+}
+
+/* Copies up to len bytes of the file from offset. Returns the count. */
+int
+fs_read(int handle, U32 offset, U8 *buf, int len)
+{
+  U32 size = fs_size(handle);
+  int done = 0;
+
+  if (offset >= size)
+    return 0;
+  if ((U32)len > size - offset)
+    len = size - offset;
+
+  while (done < len) {
+    int page = fs_page(handle, offset / FLASH_PAGE_SIZE);
+    int pos = offset % FLASH_PAGE_SIZE;
+    int n = FLASH_PAGE_SIZE - pos < len - done ? FLASH_PAGE_SIZE - pos : len - done;
+
+    if (page < 0)
+      break;
+    memcpy(buf + done, (const U8 *)FS_PAGE_ADDRESS(page) + pos, n);
+    offset += n;
+    done += n;
+  }
+  return done;
+}
+
+/* Where the file data at offset is in flash. *len is set to the count of
+ * bytes that follow it there, up to the end of the page or of the file;
+ * 0 and a null pointer past the end.
+ */
+const U8 *
+fs_data(int handle, U32 offset, U32 *len)
+{
+  U32 size = fs_size(handle);
+  int page = offset < size ? fs_page(handle, offset / FLASH_PAGE_SIZE) : -1;
+  U32 pos = offset % FLASH_PAGE_SIZE;
+
+  if (page < 0) {
+    *len = 0;
+    return 0;
+  }
+  *len = FLASH_PAGE_SIZE - pos < size - offset ? FLASH_PAGE_SIZE - pos : size - offset;
+  return (const U8 *)FS_PAGE_ADDRESS(page) + pos;
+}
+
+U32
+fs_free_pages(void)
+{
+  return fs_free;
+}
+
+/* Builds the old index page: the 32-byte password header followed by
+ * name[28] size[4] of the first seven files, for hosts that still read
+ * the file table with B8/B9.
+ */
+void
+fs_legacy_index(U8 *page)
+{
+  int h, i = 1;
+
+  memset(page, 0, FLASH_PAGE_SIZE);
+  memcpy(page, fs_header(), 32);
+
+  for (h = fs_next(-1); h >= 0 && i <= FS_LEGACY_ENTRIES; h = fs_next(h), i++) {
+    const fs_entry *e = fs_entry_get(h);
+
+    memcpy(page + 32 * i, e->name, FS_NAME_LEN);
+    memcpy(page + 32 * i + FS_NAME_LEN, e->size, 4);
+  }
+}
@@ -0,0 +1,95 @@
+/* Flash file system.
+ *
+ * Files live in the flash between the firmware image and the end of the
+ * array. Page FS_SUPER_PAGE is the old index page; it only marks the
+ * volume as formatted and is written once. Everything else that
+ * changes, the directory and the password, is kept in metadata pages
+ * that are appended to a log of FS_LOG_PAGES pages at the top of the
+ * array. Each new version of a metadata page goes to a fresh log page
+ * and a RAM table maps every metadata page to its newest copy.
+ *
+ * The directory is FS_DIR_PAGES metadata pages, each holding
+ * FS_DIR_ENTRIES entries. A file handle is the directory slot number,
+ * so an entry is found without any search. Each entry records the
+ * file's pages as up to FS_MAX_EXTENTS runs.
+ */
+
+#ifndef __FS_H__
+#  define __FS_H__
+
+#  include "mytypes.h"
+#  include "Board.h"
+#  include "flash.h"
+
+#  define FS_NAME_LEN      28
+#  define FS_MAX_EXTENTS   3
+#  define FS_DIR_PAGES     64
+#  define FS_DIR_ENTRIES   5     /* entries per directory page */
+#  define FS_MAX_FILES     (FS_DIR_PAGES * FS_DIR_ENTRIES)
+
+#  define FS_META_SUPER    FS_DIR_PAGES    /* metadata page with the password */
+#  define FS_META_PAGES    (FS_DIR_PAGES + 1)
+
+#  define FS_LOG_PAGES     96
+#  define FS_SUPER_PAGE    FLASH_START_PAGE
+#  define FS_DATA_FIRST    (FLASH_START_PAGE + 1)
+#  define FS_LOG_FIRST     (FLASH_PAGE_NB - FS_LOG_PAGES)
+#  define FS_DATA_PAGES    (FS_LOG_FIRST - FS_DATA_FIRST)
+
+#  define FS_PAGE_ADDRESS(page) (FLASH_BASE_ADDRESS + (page) * FLASH_PAGE_SIZE)
+
+#  define FS_ENTRY_USED    0x01
+
+/* One run of consecutive flash pages. */
+typedef struct {
+  U16 start;
+  U16 count;
+} fs_extent;
+
+/* A directory entry, 48 bytes. name and size keep the layout of the old
+ * index page entries, the size is big-endian.
+ */
+typedef struct {
+  U8 name[FS_NAME_LEN];
+  U8 size[4];
+  fs_extent extent[FS_MAX_EXTENTS];
+  U8 flags;
+  U8 reserved[3];
+} fs_entry;
+
+/* Header of every log page. seq is big-endian and grows with every
+ * append; cursor is where data allocation stood when it was written.
+ */
+typedef struct {
+  U8 magic[4];
+  U16 id;
+  U8 seq[4];
+  U16 cursor;
+  U16 check;
+  U8 reserved[2];
+} fs_meta_header;
+
+typedef struct {
+  fs_meta_header hdr;
+  fs_entry entry[FS_DIR_ENTRIES];
+} fs_dir_page;
+
+void fs_mount(void);
+void fs_format(void);
+void fs_gc(void);
+const U8 *fs_header(void);
+int fs_set_password(const U8 *password, int len);
+int fs_find(const U8 *name, int len);
+int fs_create(const U8 *name, int len, U32 size);
+int fs_delete(int handle);
+const fs_entry *fs_entry_get(int handle);
+int fs_next(int handle);
+U32 fs_size(int handle);
+U32 fs_pages(int handle);
+int fs_page(int handle, U32 n);
+int fs_read(int handle, U32 offset, U8 *buf, int len);
+const U8 *fs_data(int handle, U32 offset, U32 *len);
+U32 fs_free_pages(void);
+void fs_legacy_index(U8 *page);
+
+#endif
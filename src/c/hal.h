@@ -0,0 +1,35 @@
+/* Peripheral register access.
+ *
+ * Every driver reaches the AT91 peripherals through these macros rather
+ * than by dereferencing the register pointers itself. reg is a register
+ * address, either one of the AT91C_* register pointers or the address of
+ * a structure member such as &AT91C_BASE_MC->MC_FCR. Writes to the flash
+ * array that fill the page latch go through here as well.
+ *
+ * On the target the macros are plain volatile accesses and generate the
+ * same code as before. The host build (make host) defines HOST and routes
+ * each access to the register models in src/host instead.
+ */
+
+#ifndef __HAL_H__
+#  define __HAL_H__
+
+#  include "mytypes.h"
+#  include "AT91SAM7.h"
+
+#  ifdef HOST
+U32 hal_read(volatile AT91_REG *reg);
+void hal_write(volatile AT91_REG *reg, U32 val);
+
+#    define REG_RD(reg)          hal_read(reg)
+#    define REG_WR(reg, val)     hal_write((reg), (val))
+#  else
+#    define REG_RD(reg)          (*(reg))
+#    define REG_WR(reg, val)     (*(reg) = (val))
+#  endif
+
+/* Read-modify-write, as used by the drivers for the CSR and FMR bits */
+#  define REG_OR(reg, bits)      REG_WR((reg), REG_RD(reg) | (bits))
+#  define REG_AND(reg, bits)     REG_WR((reg), REG_RD(reg) & (bits))
+
+#endif
@@ -5,8 +5,17 @@
 #include "AT91SAM7.h"
 #include "stdio.h"
 #include "udp.h"
+#include "ccid.h"
 #include "usb_cmd.h"
 #include "flash.h"
+#include "fs.h"
+#include "timer.h"
+#include "copy.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
+#include "escape.h"
+#include "file.h"
 #include <string.h>
 
 extern U32 __free_ram_start__;
@@ -17,55 +26,197 @@ extern U32 __extra_ram_end__;
 #define USB_STATE_MASK       0xf0000000;
 #define USB_STATE_CONNECTED  0x10000000;
 #define USB_CONFIG_MASK      0x0f000000;
-#define ABDATA_SIZE 271  // This is the value of the CCID's dwMaxCCIDMessageLength
+#define ABDATA_SIZE CCID_MAX_MESSAGE  // This is the value of the CCID's dwMaxCCIDMessageLength
+#define READ_FILE_MAX (ABDATA_SIZE - 10 - 2)  // file bytes per READ FILE reply
 
 #define TEST_PAGE_NUMBER 0
 
 U8 inMsg[ABDATA_SIZE];
+ccid_header inHdr;  // header of the message in inMsg
 U8 reply[ABDATA_SIZE];
 U8 gReplyBuffer[FLASH_PAGE_SIZE];
-U8 gFlashBuffer[FLASH_PAGE_SIZE];
+U8 gFlashBuffer[FLASH_PAGE_SIZE] __attribute__ ((aligned (4)));  // copied a word at a time
+const U8 *gResponseData = gReplyBuffer;    // what GET RESPONSE returns
 char gFilename[32];
 int gOutCount;
 U8 gReplyLen = 0;
 int gBytesSent = 0;
 int gBytesReceived = 0;
-int gFlashIndex = 0;
 int gFlashPage = 0;  // start page for binary files
 int gFlashStart = 3;  // start page for binary files
 int gStartPage;
-int gHandle;
-U32 gFileSize;
-int gPagesWritten; // holds the count of pages written so far
-int gPagesRead; // holds the count of pages read so far
-int gReadBlock;
+int gFile = -1;  // descriptor of the file located by the last FIND FILE or created by C1/C2
 int gBytesToSend;
 U8 cardInited = 0;
 U8 sessionChecked = 0;
 
-void sendNotInited() {
-    reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-    reply[1] = 2;         // Count of bytes in the reply data
-    reply[5] = inMsg[5];  // bSlot
-    reply[6] = inMsg[6];  // bSeq
-    reply[7] = 0x00;      // resp byte 1
-    reply[8] = 0x00;      // resp byte 2
-    reply[9] = 0x00;      // resp byte 3
-    reply[10] = (U8)0x90;
-    reply[11] = (U8)0x01; 
-    udp_write(reply, 0, 12);
+// A command that is still running CMD_TIME_EXTENSION_MS after it was read,
+// or after its last time extension, and is about to wait for the flash again
+// asks the host for more time, which restarts the host's read timeout.
+#ifndef CMD_TIME_EXTENSION_MS
+#define CMD_TIME_EXTENSION_MS 250
+#endif
+U8 gCmdPending = 0;     // the command in inMsg has not been answered yet
+U32 gCmdExtendAt;       // systick deadline for its next time extension
+
+// Queue a reply on the bulk-IN endpoint, gathered from nseg pieces straight
+// into the transmit ring; seg[0] starts with the header in reply. dwLength
+// is filled in from their lengths, and we wait (bounded) for the transmit
+// ring rather than drop the reply.
+HOTFUNC int sendReplyv(const udp_seg *seg, int nseg) {
+    U32 dwLength = 0;
+    int i;
+
+    for (i = 0; i < nseg; i++)
+        dwLength += seg[i].len;
+    dwLength -= 10;
+
+    gCmdPending = 0;
+    reply[1] = dwLength & 0xFF;
+    reply[2] = (dwLength >> 8) & 0xFF;
+    reply[3] = (dwLength >> 16) & 0xFF;
+    reply[4] = (dwLength >> 24) & 0xFF;
+    return udp_writev_timeout(seg, nseg, USB_TIMEOUT);
 }
 
-void flash_read(unsigned int address, unsigned int length, void *data) {
-    unsigned char *source = (unsigned char *) address;
-    unsigned char *dest = (unsigned char *) data;
-    // Read data
-    while (length > 0) {
-        *dest = *source;
-        dest++;
-        source++;
-        length--;
+// Queue reply[0..len-1]
+int sendReply(int len) {
+    udp_seg seg = { reply, len };
+    return sendReplyv(&seg, 1);
+}
+
+// Fills the RDR_to_PC header of reply for the message in inMsg: the message
+// type, bSlot and bSeq echoed, status, error and the last byte zero.
+// dwLength is set by sendReply().
+void replyHeader(U8 type) {
+    reply[0] = type;
+    reply[5] = inHdr.bSlot;
+    reply[6] = inHdr.bSeq;
+    reply[7] = 0x00;        // bStatus
+    reply[8] = 0x00;        // bError
+    reply[9] = 0x00;        // bChainParameter / bClockStatus
+}
+
+// Sends a DataBlock with len response bytes from data, which may be in
+// flash, followed by the status word.
+int sendDataFrom(const U8 *data, int len, U16 sw) {
+    U8 status[2];
+    udp_seg seg[3];
+
+    replyHeader(RDR_TO_PC_DATABLOCK);
+    status[0] = sw >> 8;
+    status[1] = sw & 0xFF;
+    seg[0].data = reply;
+    seg[0].len = 10;
+    seg[1].data = data;
+    seg[1].len = len;
+    seg[2].data = status;
+    seg[2].len = 2;
+    return sendReplyv(seg, 3);
+}
+
+// As sendDataFrom(), with the response bytes already at reply+10
+int sendData(int len, U16 sw) {
+    return sendDataFrom(reply+10, len, sw);
+}
+
+int sendStatus(U16 sw) {
+    return sendData(0, sw);
+}
+
+// A response longer than one DataBlock goes out chained: the first block
+// answers the command, each later one the host's XfrBlock with
+// wLevelParameter 0x10. map returns where the response data at pos is and
+// sets *len to the bytes that follow it there; the blocks are gathered from
+// those pieces, and the status word ends the last one.
+typedef const U8 *(*apduMap)(U32 pos, U32 *len);
+
+#define RESPONSE_SEGS 4   // pieces in one block; 261 bytes span at most 3 flash pages
+
+apduMap gRespMap;       // 0 when no response is being chained
+U32 gRespPos;
+U32 gRespLen;
+U16 gRespSW;
+
+void sendResponseBlock() {
+    U32 left = gRespLen - gRespPos;
+    int last = left <= ABDATA_SIZE - 12;
+    U32 n = last ? left : ABDATA_SIZE - 10;
+    udp_seg seg[RESPONSE_SEGS + 2];
+    U8 status[2];
+    int k = 1;
+
+    replyHeader(RDR_TO_PC_DATABLOCK);
+    if (gRespPos == 0)
+        reply[9] = last ? CCID_CHAIN_NONE : CCID_CHAIN_BEGIN;
+    else
+        reply[9] = last ? CCID_CHAIN_END : CCID_CHAIN_MORE;
+    seg[0].data = reply;
+    seg[0].len = 10;
+
+    while (n > 0 && k <= RESPONSE_SEGS) {
+        U32 m;
+        const U8 *p = gRespMap(gRespPos, &m);
+
+        if (p == 0 || m == 0)
+            break;
+        if (m > n)
+            m = n;
+        seg[k].data = p;
+        seg[k].len = m;
+        k++;
+        gRespPos += m;
+        n -= m;
     }
+
+    if (last) {
+        status[0] = gRespSW >> 8;
+        status[1] = gRespSW & 0xFF;
+        seg[k].data = status;
+        seg[k].len = 2;
+        k++;
+        gRespMap = 0;
+    }
+    sendReplyv(seg, k);
+}
+
+// Sends len bytes of response data located by map, then sw
+void sendResponse(U32 len, U16 sw, apduMap map) {
+    gRespMap = map;
+    gRespPos = 0;
+    gRespLen = len;
+    gRespSW = sw;
+    sendResponseBlock();
+}
+
+// Flash wait hook: sends the time extension when one is due. The reply
+// buffer may hold a half built answer, so the header is built apart.
+void commandWait() {
+    U8 ext[CCID_HEADER_SIZE];
+
+    if (!gCmdPending || !systick_ms_expired(gCmdExtendAt))
+        return;
+
+    memset(ext, 0, sizeof(ext));
+    ext[0] = ccid_reply_type(inHdr.bMessageType);
+    ext[5] = inHdr.bSlot;
+    ext[6] = inHdr.bSeq;
+    ext[7] = CCID_TIME_EXTENSION;
+    ext[8] = 1;             // one more default timeout
+    udp_write_timeout(ext, 0, sizeof(ext), USB_TIMEOUT);
+    gCmdExtendAt = systick_deadline_ms(CMD_TIME_EXTENSION_MS);
+}
+
+// Fails the command in inMsg with bError, in the reply type it expects
+void sendError(U8 bError) {
+    replyHeader(ccid_reply_type(inHdr.bMessageType));
+    reply[7] = CCID_CMD_FAILED;
+    reply[8] = bError;
+    sendReply(10);
+}
+
+void flash_read(unsigned int address, unsigned int length, void *data) {
+    copy_bytes((U8 *) data, (const U8 *) address, length);
 }
 
 // Little Endian
@@ -88,503 +239,1033 @@ void int32ToArray(U32 n, U8 * bytes) {
 
 // called only once after the USB device is powered and before process_usb_requests() loop
 void initCheck() {
-    // read the index page
-    flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
+    fs_mount();
+
+    // the password section of the index page
     U8 blank[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-    cardInited = memcmp((U8*)gFlashBuffer+16, blank, 15) == 0 ? 0 : 1;
+    cardInited = memcmp(fs_header()+16, blank, 15) == 0 ? 0 : 1;
 }
 
 void setPassword(U8 * password, U8 len) {
-    // read the index page
-    flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-    
-    // update the index page section
-    memcpy(gFlashBuffer+16, password, len);  // the first 16 bytes is RFU
-    
-    // rewrite index page
-    AT91F_Flash_Write(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
+    // appends a new copy of the password section, the first 16 bytes is RFU
+    fs_set_password(password, len);
 }
     
-void process_usb_requests() {
-    int len = udp_read(inMsg, 0, ABDATA_SIZE);
+// Points gFile at the file with handle, closing the one it had; -1 if
+// there is no such file
+void useFile(int handle) {
+    file_close(gFile);
+    gFile = handle < 0 ? -1 : file_open(handle);
+}
 
-    if (len < 1)
-       return;
+// Closes the descriptors of a file about to be deleted or replaced
+void forgetFile(int handle) {
+    file_forget(handle);
+    if (file_handle(gFile) < 0)
+        gFile = -1;
+}
 
-    int bMessageType = inMsg[0];
-    U8 cla = inMsg[10];
-    U8 ins = inMsg[11];
-
-    // C0 is the GET RESPONSE command from the usbccid driver to request the card's data
-    if (bMessageType == PC_RDR_XFR_BLOCK && inMsg[11] == (U8)0xC0) {
-        int requestSize = inMsg[14];
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = requestSize+2;   // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        int i;
-        
-        memcpy(reply+10, gReplyBuffer, requestSize);
-        
-        if ( (gBytesSent + requestSize) == gBytesToSend ) {
-           reply[10+requestSize] = 0x90;
-           reply[10+requestSize+1] = 0x00;
-        }
-        else {
-           reply[10+requestSize] = 0x61;
-           reply[10+requestSize+1] = gBytesToSend - requestSize;
-        }
-        
-        gBytesSent += requestSize;
-        udp_write(reply, 0, 10+requestSize+2);
-    }
+// The command APDU being run. A short APDU comes whole in one XfrBlock at
+// inMsg+10; an extended one (Lc and Le up to 65535) may be chained over
+// several. Handlers flagged APDU_EXTENDED read it from here, and are called
+// once for each message of a chain with the command data that message
+// carried. A handler that fails the command part way sets sw, which is sent
+// when the chain is over.
+typedef struct {
+    U8 cla, ins, p1, p2;
+    U8 extended;
+    U32 nc;             // Lc, bytes of command data
+    U32 ne;             // Le, 0 if absent; 00 and 0000 are 256 and 65536
+    U8 *data;           // command data in this message
+    U32 len;            // its length
+    U32 pos;            // its offset in the command data
+    U8 leBytes;         // Le bytes seen so far in a chain
+    U8 last;            // this message ends the command
+    U16 sw;
+} apduCommand;
+
+apduCommand gApdu;
+U8 gChaining = 0;               // a chained command is waiting for its next part
+void (*gChainHandler)(void);    // and the handler it goes to, 0 if failed
+
+// Splits the n bytes at p of a chained command into command data and Le
+void apduTake(U8 *p, U32 n, int last) {
+    U32 left = gApdu.nc - gApdu.pos - gApdu.len;
+    U32 i;
+
+    gApdu.pos += gApdu.len;
+    gApdu.data = p;
+    gApdu.len = n < left ? n : left;
+    for (i = gApdu.len; i < n; i++, gApdu.leBytes++)
+        gApdu.ne = (gApdu.ne << 8) | p[i];
+
+    gApdu.last = last;
+    if (!last)
+        return;
+    gChaining = 0;
+    if (gApdu.sw != 0x9000)
+        return;
+    if (gApdu.pos + gApdu.len != gApdu.nc || gApdu.leBytes == 1 || gApdu.leBytes > 2)
+        gApdu.sw = 0x6700;
     else
-    // the file name and file size block is a block of 32 bytes
-    // XXXXXXXXXXXXXXXXXXXXXXXXXXXXZZZZ
-    // X = file name
-    // Z = file size
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC1) {  // The RECEIVE FILE SIZE + FILE NAME command
-        if (!cardInited) {
-            sendNotInited();
+    if (gApdu.leBytes == 2 && gApdu.ne == 0)
+        gApdu.ne = 65536;
+}
+
+// Parses the first (or only) message of a command APDU, the n bytes at a,
+// by the cases of ISO 7816-4: Lc and Le are a byte each, or in an extended
+// APDU a zero byte and then two bytes each. Only an extended APDU with
+// command data is chained.
+void apduBegin(U8 *a, U32 n, int chained) {
+    memset(&gApdu, 0, sizeof(gApdu));
+    gApdu.cla = a[0];
+    gApdu.ins = a[1];
+    gApdu.p1 = a[2];
+    gApdu.p2 = a[3];
+    gApdu.sw = 0x9000;
+    gApdu.last = 1;
+
+    if (chained) {
+        if (n < 7 || a[4] != 0 || (a[5] | a[6]) == 0) {
+            gApdu.sw = 0x6700;
             return;
         }
-        int offset = inMsg[13];
-        int reqlen = inMsg[14];   // the size of the file name + file size array
-        memcpy(gFlashBuffer+offset, inMsg+15+1, reqlen);  // 15 is where the data starts
-        AT91F_Flash_Write(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        gReplyLen = 2;
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;    // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = (U8)0x90;
-        reply[11] = (U8)0x00;
-        gPagesWritten = 1;
-        udp_write(reply, 0, 12);
+        gApdu.extended = 1;
+        gApdu.nc = (a[5] << 8) | a[6];
+        apduTake(a+7, n-7, 0);
+        return;
     }
+
+    if (n < 4)
+        gApdu.sw = 0x6700;
     else
-    // the file name and file size block is a block of 32 bytes
-    // XXXXXXXXXXXXXXXXXXXXXXXXXXXXZZZZ
-    // X = file name
-    // Z = file size
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC2) {  // The RECEIVE FILE SIZE + FILE NAME command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        int reqlen = inMsg[14];   // the size of the file name + file size array
-        U8 pageCount = 0;
-        int offset;
-        U8 sizeArray[4];
-        
-        // read the index page
-        flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        
-        // calculate occupied pages. i starts at 1 to skip the 32-byte password sector
-        for (int i=1; i<8; i++) {
-            offset = 32*i;
-            sizeArray[0] = gFlashBuffer[offset+28];
-            sizeArray[1] = gFlashBuffer[offset+29];
-            sizeArray[2] = gFlashBuffer[offset+30];
-            sizeArray[3] = gFlashBuffer[offset+31];
-            U32 size = calc_file_size_LE(sizeArray);
-            
-            if (size == 0) {
-                break;
-            }
-            
-            pageCount += (size/256) + 1;
-        }
-        
-        // update the index page section
-        memcpy(gFlashBuffer+offset, inMsg+16, reqlen);  // 16 is where the file info starts
-        
-        // rewrite index page
-        AT91F_Flash_Write(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        
-        // get a byte array
-        U8 pageArray[4];
-        int32ToArray((U32)pageCount, pageArray);
-        
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x06;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = pageArray[0];
-        reply[11] = pageArray[1];
-        reply[12] = pageArray[2];
-        reply[13] = pageArray[3];
-        reply[14] = (U8)0x90;
-        reply[15] = (U8)0x00;
-        gPagesWritten = pageCount + 1;
-        udp_write(reply, 0, 16);
-    }
+    if (n == 5)                                     // case 2S
+        gApdu.ne = a[4] ? a[4] : 256;
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC3) {  // The DELETE INDEX PAGE command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        // zero out the index page
-        memset(gFlashBuffer+32, 0x00, 256); // skip the 32-byte password section of the index page
-        
-        // write the index page
-        AT91F_Flash_Write(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        
-        gReplyLen = 2;
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = (U8)0x90;
-        reply[11] = (U8)0x00;
-        udp_write(reply, 0, 12);
+    if (n > 5 && a[4] != 0) {                       // cases 3S and 4S
+        gApdu.nc = a[4];
+        if (n == 6 + gApdu.nc)
+            gApdu.ne = a[n-1] ? a[n-1] : 256;
+        else
+        if (n != 5 + gApdu.nc)
+            gApdu.sw = 0x6700;
     }
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC4) {  // CHECK PASSWORD command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        int reqlen = inMsg[14];
-
-        // read the index page
-        flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        U8 ret;
-        U8 blank[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-        
-        if ( memcmp((U8*)gFlashBuffer+16, blank, 15) == 0) {
-            ret = 2;   // password not yet set
-        }
+    if (n == 7)                                     // case 2E
+        gApdu.ne = (a[5] << 8) | a[6] ? (a[5] << 8) | a[6] : 65536;
+    else
+    if (n > 7) {                                    // cases 3E and 4E
+        gApdu.nc = (a[5] << 8) | a[6];
+        if (n == 9 + gApdu.nc)
+            gApdu.ne = (a[n-2] << 8) | a[n-1] ? (a[n-2] << 8) | a[n-1] : 65536;
         else
-        if ( memcmp((U8*)(gFlashBuffer+16), (U8*)(inMsg+15), reqlen) == 0) {
-            ret = 0;   // password matches
-        }
-        else {
-            ret = 1;   // password doesn't match
-        }
-        
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x03;     // Count of bytes in the reply data
-        reply[5] = inMsg[5]; // bSlot
-        reply[6] = inMsg[6]; // bSeq
-        reply[7] = 0x00;     // resp byte 1
-        reply[8] = 0x00;     // resp byte 2
-        reply[9] = 0x00;     // resp byte 3
-        reply[10] = ret;
-        reply[11] = (U8)0x90;
-        reply[12] = (U8)0x00;
-        udp_write(reply, 0, 13);
+        if (gApdu.nc == 0 || n != 7 + gApdu.nc)
+            gApdu.sw = 0x6700;
+        gApdu.extended = gApdu.sw == 0x9000;
     }
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC5) {  // SET PASSWORD command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        int reqlen = inMsg[14];
-        setPassword(inMsg+15, reqlen);
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;     // Count of bytes in the reply data
-        reply[5] = inMsg[5]; // bSlot
-        reply[6] = inMsg[6]; // bSeq
-        reply[7] = 0x00;     // resp byte 1
-        reply[8] = 0x00;     // resp byte 2
-        reply[9] = 0x00;     // resp byte 3
-        reply[10] = (U8)0x90;
-        reply[11] = (U8)0x00;
-        udp_write(reply, 0, 12);
+    if (n != 4)
+        gApdu.sw = 0x6700;
+
+    if (gApdu.sw == 0x9000 && gApdu.nc) {
+        gApdu.data = a + (gApdu.extended ? 7 : 5);
+        gApdu.len = gApdu.nc;
     }
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xC6) {  // INIT CARD command
-        if (cardInited) {
-            reply[10] = (U8)0x90;
-            reply[11] = (U8)0x02; // card already initialized
-        }
-        else {
-            int reqlen = inMsg[14];
-            setPassword(inMsg+15, reqlen);
-            reply[10] = (U8)0x90;
-            reply[11] = (U8)0x00;
-            cardInited = 1;
-        }
-        
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;     // Count of bytes in the reply data
-        reply[5] = inMsg[5]; // bSlot
-        reply[6] = inMsg[6]; // bSeq
-        reply[7] = 0x00;     // resp byte 1
-        reply[8] = 0x00;     // resp byte 2
-        reply[9] = 0x00;     // resp byte 3
-        udp_write(reply, 0, 12);
-    }
-    else 
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xB3) {  // The RECEIVE DATA command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        // 10 11 12 13 14 15
-        // 80 B3 00 00 81 80
-        int writeFlag = inMsg[13];
-        int reqlen = inMsg[14] - 1;  // the size of the block of data
-        int offset = inMsg[15];
-        memcpy(gFlashBuffer+offset, inMsg+16, reqlen);  // 16 is where the data starts
-        
-        if (writeFlag == 1) {
-            AT91F_Flash_Write(DATA_BASE_ADDRESS+(gPagesWritten*256), FLASH_PAGE_SIZE, gFlashBuffer);
-            gPagesWritten++;
-        }
+        gApdu.nc = 0;
+}
+
+// Runs handler on one message of the command. A message that does not end
+// the command is answered with an empty block asking for the next one; a
+// command the handler has not answered by its end gets sw.
+void apduStep(void (*handler)(void)) {
+    if (handler && gApdu.sw == 0x9000)
+        handler();
 
-        gReplyLen = 2;
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = (U8)0x90;
-        reply[11] = (U8)0x00;
-        udp_write(reply, 0, 12);
+    if (!gApdu.last) {
+        replyHeader(RDR_TO_PC_DATABLOCK);
+        reply[9] = CCID_CHAIN_NEXT;
+        sendReply(10);
     }
     else
-    // locate the find in the index page and, if found, returns the file size back to host  
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xB5) {  // The FIND FILE command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        // read the index page
-        flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gFlashBuffer);
-        U8 found = 0;
-        U8 sizeArray[4];
-        U8 len = inMsg[14];
-        int np = 0;
-        int offset;
-        
-        // calculate occupied pages
-        for (int i=1; i<8; i++) {
-            offset = 32*i;
-            sizeArray[0] = gFlashBuffer[offset+28];
-            sizeArray[1] = gFlashBuffer[offset+29];
-            sizeArray[2] = gFlashBuffer[offset+30];
-            sizeArray[3] = gFlashBuffer[offset+31];
-            
-            if ( memcmp(gFlashBuffer+offset, inMsg+15, len) == 0) {
-                found = 1;   // password matches
-                gFileSize = calc_file_size_LE(sizeArray);
-                break;
-            }
-            
-            np += (calc_file_size_LE(sizeArray) / 256) + 1;
-        }
+    if (gCmdPending)
+        sendStatus(gApdu.sw);
+}
 
-        if (!found) {
-            memset(sizeArray, 0, 4); // zero out the response to the host
-        }
-        
-        gPagesRead = np + 1;
-        gReadBlock = 7; // this indicates we need to read on the first request
-        
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x06;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = sizeArray[0];
-        reply[11] = sizeArray[1];
-        reply[12] = sizeArray[2];
-        reply[13] = sizeArray[3];
-        reply[14] = (U8)0x90;
-        reply[15] = (U8)0x00;
-        udp_write(reply, 0, 16);
+// APDU handlers, called by xfrBlock() through apduTable[] with the APDU at
+// inMsg+10, and parsed in gApdu. Each one sends exactly one reply.
+
+// C0 is the GET RESPONSE command from the usbccid driver to request the card's data.
+// It returns at most what READ PAGE or PREPARE INDEX left to be sent, and
+// 61xx with what is left after that.
+void apduGetResponse() {
+    int requestSize = inMsg[14];
+    int left = gBytesToSend - gBytesSent;
+    const U8 *data = gResponseData;
+
+    if (left <= 0) {
+        sendStatus(0x6985);   // no response data pending
+        return;
+    }
+    if (requestSize > left)
+        requestSize = left;
+    left -= requestSize;
+
+    gBytesSent += requestSize;
+    gResponseData += requestSize;
+    sendDataFrom(data, requestSize, left ? 0x6100 | (left & 0xFF) : 0x9000);
+}
+
+// the file name and file size block is a block of 32 bytes
+// XXXXXXXXXXXXXXXXXXXXXXXXXXXXZZZZ
+// X = file name
+// Z = file size
+// C1 and C2 create it, replacing a file of that name, and make it gFile
+void createFile() {
+    int reqlen = inMsg[14];   // the size of the file name + file size array
+    int handle = -1;
+
+    if (reqlen >= 32) {
+        handle = fs_create(inMsg+16, FS_NAME_LEN, calc_file_size_LE(inMsg+16+28));
+        forgetFile(handle);  // a replaced file keeps its handle; close what was open on it
+    }
+    useFile(handle);
+}
+
+void apduCreateFile() {  // The RECEIVE FILE SIZE + FILE NAME command
+    createFile();
+    sendStatus(gFile < 0 ? 0x6A84 : 0x9000);  // 6A84: not enough memory
+}
+
+// as C1, and returns the first page of the file
+void apduCreateFilePage() {  // The RECEIVE FILE SIZE + FILE NAME command
+    U32 pageCount = 0;
+
+    createFile();
+
+    // the first page of the file, counted from the one after the index page
+    if (gFile >= 0)
+        pageCount = file_page(gFile, 0) - FS_DATA_FIRST;
+
+    int32ToArray(pageCount, reply+10);
+    sendData(4, gFile < 0 ? 0x6A84 : 0x9000);  // 6A84: not enough memory
+}
+
+void apduDeleteIndex() {  // The DELETE INDEX PAGE command
+    // drop every file, the password section of the index page is kept
+    file_reset();
+    fs_format();
+    gFile = -1;
+
+    sendStatus(0x9000);
+}
+
+void apduCheckPassword() {  // CHECK PASSWORD command
+    int reqlen = inMsg[14];
+
+    const U8 *header = fs_header();
+    U8 blank[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+
+    if ( memcmp(header+16, blank, 15) == 0) {
+        reply[10] = 2;   // password not yet set
     }
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xB7) {  // The READ PAGE command
-        if (!cardInited) {
-            sendNotInited();
-            return;
-        }
-        int reqlen = inMsg[15];  
+    if ( memcmp(header+16, (U8*)(inMsg+15), reqlen) == 0) {
+        reply[10] = 0;   // password matches
+    }
+    else {
+        reply[10] = 1;   // password doesn't match
+    }
 
-        if (gReadBlock == 7) {
-            flash_read(DATA_BASE_ADDRESS+(gPagesRead*256), FLASH_PAGE_SIZE, gFlashBuffer);
-            gReadBlock = 0;
-            gPagesRead++;
-        }
-        else {
-            gReadBlock++;
+    sendData(1, 0x9000);
+}
+
+void apduSetPassword() {  // SET PASSWORD command
+    int reqlen = inMsg[14];
+
+    setPassword(inMsg+15, reqlen);
+    sendStatus(0x9000);
+}
+
+void apduInitCard() {  // INIT CARD command
+    if (cardInited) {
+        sendStatus(0x9002);  // card already initialized
+        return;
+    }
+
+    int reqlen = inMsg[14];
+    setPassword(inMsg+15, reqlen);
+    cardInited = 1;
+    sendStatus(0x9000);
+}
+
+// 10 11 12 13 14 15
+// 80 B3 00 00 81 80
+void apduReceiveData() {  // The RECEIVE DATA command
+    int writeFlag = inMsg[13];
+    int reqlen = gApdu.nc - 1;  // the size of the block of data
+    int offset = inMsg[15];
+
+    if (gApdu.nc < 1) {
+        sendStatus(0x6700);
+        return;
+    }
+    if (offset + reqlen > FLASH_PAGE_SIZE) {
+        sendStatus(0x6B00);   // past the end of the page buffer
+        return;
+    }
+    memcpy(gFlashBuffer+offset, inMsg+16, reqlen);  // 16 is where the data starts
+
+    // the page goes through the flash pipeline and is programmed once the
+    // reply is on its way, while the host sends the next block. The pages
+    // follow on from the start of the file, at the offset of gFile.
+    if (writeFlag == 1) {
+        U32 offset = file_tell(gFile);
+        int page = file_page(gFile, offset / FLASH_PAGE_SIZE);
+        if (page >= 0) {
+            file_flush();
+            copy_words(AT91F_Flash_Pipe_Buffer(), (const void *)gFlashBuffer, FLASH_PAGE_SIZE / 4);
+            AT91F_Flash_Pipe_Commit(FS_PAGE_ADDRESS(page));
         }
+        file_seek(gFile, offset + FLASH_PAGE_SIZE);
+    }
+
+    sendStatus(0x9000);
+}
+
+// locate the find in the index page and, if found, returns the file size back to host
+void apduFindFile() {  // The FIND FILE command
+    U8 len = inMsg[14];
+
+    // READ PAGE starts from the beginning again
+    useFile(fs_find(inMsg+15, len));
+
+    int32ToArray(file_size(gFile), reply+10);  // 0 when the file is not found
+    sendData(4, 0x9000);
+}
+
+// the next reqlen bytes of gFile from its offset, for GET RESPONSE, up to
+// the end of the file
+void apduReadPage() {  // The READ PAGE command
+    int reqlen = inMsg[15];
+    U32 offset = file_tell(gFile);
+    U32 n;
+    const U8 *data = file_data_at(gFile, offset, &n);
+
+    // GET RESPONSE sends the block straight from flash or the fill buffer
+    // when it is in one page, else a copy
+    if (n < (U32)reqlen) {
+        n = file_read_at(gFile, offset, gReplyBuffer, reqlen);
+        data = gReplyBuffer;
+    }
+    if (n == 0) {
+        gBytesToSend = gBytesSent = 0;
+        sendStatus(gFile < 0 ? 0x6A82 : 0x6B00);  // no file, or past its end
+        return;
+    }
+    if (n > (U32)reqlen)
+        n = reqlen;
+    gResponseData = data;
+    file_seek(gFile, offset + n);
+
+    gBytesToSend = n;
+    gBytesSent = 0;
+    sendStatus(0x6100 | (n & 0xFF));  // tell C0 there are n bytes to be sent to the host
+}
 
-        memcpy(gReplyBuffer, gFlashBuffer+(gReadBlock*reqlen), reqlen);
-
-        reply[10] = 0x61;
-        reply[11] = reqlen; // tell C0 there are reqlen bytes to be sent to the host
-        gBytesToSend = reqlen;
-            
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        gBytesSent = 0;
-        udp_write(reply, 0, 12);
+void apduPrepareIndex() {  // The PREPARE INDEX PAGE TO BE READ command
+    // build the old file table page from the directory
+    fs_legacy_index(gReplyBuffer);
+    gResponseData = gReplyBuffer;
+    gBytesToSend = FLASH_PAGE_SIZE;
+    gBytesSent = 0;
+
+    sendStatus(0x9000);
+}
+
+// 10 11 12 13
+// 80 B9 Le offset
+void apduReadIndex() {  // The READ INDEX PAGE command
+    int reqlen = inMsg[12];
+    int offset = inMsg[13];
+
+    sendDataFrom(gReplyBuffer+offset+32, reqlen, 0x9000);
+}
+
+const U8 *statsMap(U32 pos, U32 *len) {
+    *len = sizeof(gStats) - pos;
+    return (const U8 *)&gStats + pos;
+}
+
+// returns the hot path statistics (see stats.h), as much of the table as
+// Le asks for; an extended Le of 0000 gets all of it in chained blocks.
+// P1 bit 0 clears the table instead.
+// 10 11 12 13 14 15 16
+// 80 C7 00 00 00 00 00
+// 80 C7 01 00
+void apduReadStats() {  // The READ STATS command
+    U32 size = sizeof(gStats);
+
+    if (gApdu.p1 & 0x01) {
+        stats_clear();
+        sendStatus(0x9000);
     }
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xB8) {  // The PREPARE INDEX PAGE TO BE READ command
-        if (!cardInited) {
-            sendNotInited();
+        sendResponse(gApdu.ne && gApdu.ne < size ? gApdu.ne : size, 0x9000, statsMap);
+}
+
+U32 gFileOffset;   // file position of the READ or WRITE command in progress
+int gFileFd;       // and the descriptor it is on
+
+const U8 *readFileMap(U32 pos, U32 *len) {
+    return file_data_at(gFileFd, gFileOffset + pos, len);
+}
+
+// READ FILE and READ AT on descriptor fd. A short Le of 00 or none asks for as
+// much as fits in one CCID message; an extended Le asks for up to 65536
+// bytes, which are sent in chained blocks.
+void readAt(int fd) {
+    U32 reqlen = gApdu.ne;
+    U32 size = file_size(fd);
+
+    if (gApdu.nc < 4) {
+        sendStatus(0x6700);
+        return;
+    }
+    gFileFd = fd;
+    gFileOffset = calc_file_size_LE(gApdu.data);
+
+    if (reqlen == 0 || (!gApdu.extended && reqlen > 255))
+        reqlen = READ_FILE_MAX;
+
+    if (file_handle(fd) < 0)
+        sendStatus(0x6A82);   // file not found
+    else
+    if (gFileOffset >= size)
+        sendStatus(0x6B00);   // offset outside the file
+    else
+        sendResponse(reqlen < size - gFileOffset ? reqlen : size - gFileOffset, 0x9000, readFileMap);
+}
+
+// WRITE FILE and WRITE AT on descriptor fd. Full pages are programmed after
+// the reply is sent, and with flush the last partial page too. An extended
+// command may carry up to 65531 bytes of data in chained messages, which
+// are written as they arrive.
+void writeAt(int fd, int flush) {
+    U8 *data = gApdu.data;
+    U32 len = gApdu.len;
+
+    if (gApdu.pos == 0) {
+        U32 limit = fs_pages(file_handle(fd)) * FLASH_PAGE_SIZE;  // pages allocated to the file
+
+        if (file_handle(fd) < 0) {
+            gApdu.sw = 0x6A82;   // file not found
+            return;
+        }
+        if (gApdu.nc < 4) {
+            gApdu.sw = 0x6B00;   // outside the file
+            return;
+        }
+        if (len < 4) {
+            gApdu.sw = 0x6700;   // the offset must come in the first message
+            return;
+        }
+        gFileFd = fd;
+        gFileOffset = calc_file_size_LE(data);
+        if (gFileOffset > limit || gApdu.nc - 4 > limit - gFileOffset) {
+            gApdu.sw = 0x6B00;
             return;
         }
-        // read the file table page
-        flash_read(DATA_BASE_ADDRESS, FLASH_PAGE_SIZE, gReplyBuffer);
-        
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;        // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = (U8)0x90;
-        reply[11] = (U8)0x00;
-        udp_write(reply, 0, 12);
+        data += 4;
+        len -= 4;
+    }
+
+    if (file_write_at(gFileFd, gFileOffset, data, len) < 0) {
+        gApdu.sw = 0x6B00;   // the file was closed or replaced under the chain
+        return;
     }
+    gFileOffset += len;
+    if (!gApdu.last)
+        return;
+
+    if (flush)
+        file_flush();
+
+    if (!AT91F_Flash_Pipe_Status(0))
+        sendStatus(0x6581);   // an earlier page failed to program
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK && cla == (U8)0x80 && ins == (U8)0xB9) { // The READ INDEX PAGE command 
-        if (!cardInited) {
-            sendNotInited();
+        sendStatus(0x9000);
+}
+
+// returns file data from an explicit offset into the file located by the last FIND FILE.
+// 10 11 12 13 14 15 16 17 18 19
+// 80 BA 00 00 04 [offset   ] Le
+// 80 BA 00 00 00 00 04 [offset   ] Le Le
+void apduReadFile() {  // The READ FILE command
+    readAt(gFile);
+}
+
+// streams file data to an explicit offset into the file created by the last C1/C2 command;
+// P1 bit 0 flushes the last partial page.
+// 10 11 12 13 14 15 16 17 18 19
+// 80 BB P1 00 Lc [offset   ] data...
+// 80 BB P1 00 00 Lc Lc [offset   ] data...
+void apduWriteFile() {  // The WRITE FILE command
+    writeAt(gFile, gApdu.p1 & 0x01);
+}
+
+// opens the named file on a descriptor of its own, which READ AT and WRITE AT
+// take in P1, and returns the descriptor and the file size. 6A82 if there is
+// no such file, 6A84 if every descriptor is in use.
+// 10 11 12 13 14 15
+// 80 C8 00 00 Lc name... 05
+void apduOpen() {  // The OPEN command
+    int handle = fs_find(gApdu.data, gApdu.nc);
+    int fd = handle < 0 ? -1 : file_open(handle);
+
+    if (fd < 0) {
+        sendStatus(handle < 0 ? 0x6A82 : 0x6A84);
+        return;
+    }
+    reply[10] = fd;
+    int32ToArray(file_size(fd), reply+11);
+    sendData(5, 0x9000);
+}
+
+// as READ FILE, on the descriptor in P1
+// 80 C9 fd 00 04 [offset   ] Le
+// 80 C9 fd 00 00 00 04 [offset   ] Le Le
+void apduReadAt() {  // The READ AT command
+    readAt(gApdu.p1);
+}
+
+// as WRITE FILE, on the descriptor in P1; P2 bit 0 flushes the last partial page
+// 80 CA fd P2 Lc [offset   ] data...
+// 80 CA fd P2 00 Lc Lc [offset   ] data...
+void apduWriteAt() {  // The WRITE AT command
+    writeAt(gApdu.p1, gApdu.p2 & 0x01);
+}
+
+// closes the descriptor in P1, programming what it left in the page buffer.
+// The descriptor FIND FILE and C1/C2 use is not the host's to close.
+// 80 CB fd 00
+void apduClose() {  // The CLOSE command
+    if (file_handle(gApdu.p1) < 0 || gApdu.p1 == gFile) {
+        sendStatus(0x6A82);
+        return;
+    }
+    file_close(gApdu.p1);
+    sendStatus(0x9000);
+}
+
+// An INS is only accepted with CLA 0x80 unless APDU_ANY_CLA is set, and
+// answers 90 01 while the card is not initialised if APDU_INITED is set.
+// Only handlers with APDU_EXTENDED take extended and chained APDUs; the
+// others read the short APDU at inMsg+10 and check its lengths themselves.
+#define APDU_INITED   0x01
+#define APDU_ANY_CLA  0x02
+#define APDU_EXTENDED 0x04
+
+typedef struct {
+    void (*handler)(void);
+    U8 flags;
+} apduEntry;
+
+static const apduEntry apduTable[256] = {
+    [0xB3] = { apduReceiveData,    APDU_INITED },
+    [0xB5] = { apduFindFile,       APDU_INITED },
+    [0xB7] = { apduReadPage,       APDU_INITED },
+    [0xB8] = { apduPrepareIndex,   APDU_INITED },
+    [0xB9] = { apduReadIndex,      APDU_INITED },
+    [0xBA] = { apduReadFile,       APDU_INITED | APDU_EXTENDED },
+    [0xBB] = { apduWriteFile,      APDU_INITED | APDU_EXTENDED },
+    [0xC0] = { apduGetResponse,    APDU_ANY_CLA },
+    [0xC1] = { apduCreateFile,     APDU_INITED },
+    [0xC2] = { apduCreateFilePage, APDU_INITED },
+    [0xC3] = { apduDeleteIndex,    APDU_INITED },
+    [0xC4] = { apduCheckPassword,  APDU_INITED },
+    [0xC5] = { apduSetPassword,    APDU_INITED },
+    [0xC6] = { apduInitCard,       0 },
+    [0xC7] = { apduReadStats,      APDU_EXTENDED },
+    [0xC8] = { apduOpen,           APDU_INITED },
+    [0xC9] = { apduReadAt,         APDU_INITED | APDU_EXTENDED },
+    [0xCA] = { apduWriteAt,        APDU_INITED | APDU_EXTENDED },
+    [0xCB] = { apduClose,          APDU_INITED },
+};
+
+// CCID message handlers, called through msgTable[] with the message in inMsg
+
+void xfrBlock() {
+    U16 level = CCID_LEVEL(&inHdr);
+    const apduEntry *e;
+
+    switch (level) {
+    case CCID_CHAIN_NEXT:
+        if (gRespMap)
+            sendResponseBlock();
+        else
+            sendError(CCID_ERR_BAD_LEVEL);
+        return;
+    case CCID_CHAIN_END:
+    case CCID_CHAIN_MORE:
+        if (!gChaining) {
+            sendError(CCID_ERR_BAD_LEVEL);
             return;
         }
-        // 10 11 12 13 14 15
-        // 80 B3 00 00 81 80
-        int reqlen = inMsg[12];  
-        int offset = inMsg[13];
-        
-        // copy to reply buffer
-        memcpy(reply+10, gReplyBuffer+offset+32, reqlen);
-
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 2 + reqlen;  // Count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10+reqlen] = (U8)0x90;
-        reply[11+reqlen] = (U8)0x00;
-        udp_write(reply, 0, 12+reqlen);
+        apduTake(inMsg+10, inHdr.dwLength, level == CCID_CHAIN_END);
+        apduStep(gChainHandler);
+        return;
+    case CCID_CHAIN_NONE:
+    case CCID_CHAIN_BEGIN:
+        break;
+    default:
+        sendError(CCID_ERR_BAD_LEVEL);
+        return;
     }
+
+    // a new command drops what is left of an earlier response or chain
+    gRespMap = 0;
+    gChaining = level == CCID_CHAIN_BEGIN;
+    apduBegin(inMsg+10, inHdr.dwLength, gChaining);
+
+    e = &apduTable[gApdu.ins];
+    if (e->handler == 0 || (gApdu.cla != (U8)0x80 && !(e->flags & APDU_ANY_CLA)))
+        gApdu.sw = 0x6E00;
     else
-    if  (bMessageType == PC_RDR_ICC_POWER_ON) {
-        int rLen = 0;
-//      U8 ATR[16] = {0x3B, 0x8D, 0x00, 0x4A, 0x61, 0x76, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
-//      U8 ATR[16] = {0x3B, 0x1D, 0x14, 0x4A, 0x61, 0x76, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
-//      U8 ATR[18] = {0x3B, 0x1D, 0x14, 0x14, 0x31, 0xE0, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
-//      U8 ATR[16] = {0x3B, 0x1D, 0x14, 0x4A, 0x61, 0x76, 0x61, 0x43, 0x61, 0x72, 0x64, 0x06, 0x01, 0x16, 0x01, 0x05};
-        U8 ATR[15] = {0x3B, 0xAA, 0x00, 0x40, 0x20, 0x53, 0x4F, 0x53, 0x53, 0x45, 0x06, 0x01, 0x16, 0x01, 0x05};
-        rLen = sizeof(ATR);
-
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = rLen;      // 15 bytes or 0. count of bytes in the reply data
-        reply[5] = inMsg[5];  // bSlot
-        reply[6] = inMsg[6];  // bSeq
-        reply[9] = 0x00;      // resp byte 3
-
-        int i=0;
-        for (i=0; i<sizeof(ATR); i++) {
-            reply[10+i] = ATR[i];
-        }       
-        
-        udp_write(reply, 0, 10+rLen);
-    }
+    if ((e->flags & APDU_INITED) && !cardInited)
+        gApdu.sw = 0x9001;
     else
-    if  (bMessageType ==  PC_RDR_ICC_POWER_OFF) {
-        reply[0] = RDR_TO_PC_SLOTSTATUS;
-        reply[1] = 0x00;        // 0 bytes. count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x01;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x01;        // resp byte 3
-        udp_write(reply, 0, 10);
+    if (!(e->flags & APDU_EXTENDED) && (gApdu.extended || gChaining))
+        gApdu.sw = 0x6700;
+
+    gChainHandler = e->handler;
+    apduStep(e->handler);
+}
+
+void iccPowerOn() {
+//  U8 ATR[16] = {0x3B, 0x8D, 0x00, 0x4A, 0x61, 0x76, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
+//  U8 ATR[16] = {0x3B, 0x1D, 0x14, 0x4A, 0x61, 0x76, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
+//  U8 ATR[18] = {0x3B, 0x1D, 0x14, 0x14, 0x31, 0xE0, 0x73, 0xFE, 0x21, 0x1B, 0x66, 0xD0, 0x01, 0x9F, 0x13, 0x4D};
+//  U8 ATR[16] = {0x3B, 0x1D, 0x14, 0x4A, 0x61, 0x76, 0x61, 0x43, 0x61, 0x72, 0x64, 0x06, 0x01, 0x16, 0x01, 0x05};
+    static const U8 ATR[15] = {0x3B, 0xAA, 0x00, 0x40, 0x20, 0x53, 0x4F, 0x53, 0x53, 0x45, 0x06, 0x01, 0x16, 0x01, 0x05};
+
+    replyHeader(RDR_TO_PC_DATABLOCK);
+    memcpy(reply+10, ATR, sizeof(ATR));
+    sendReply(10+sizeof(ATR));
+}
+
+void iccPowerOff() {
+    replyHeader(RDR_TO_PC_SLOTSTATUS);
+    reply[7] = 0x01;        // bStatus: card present, inactive
+    reply[9] = 0x01;        // bClockStatus: stopped in state L
+    sendReply(10);
+}
+
+void setParameters() {
+    static const U8 params[5] = {0x11, 0x00, 0x00, 0x20, 0x00};  // T=0 protocol data structure
+
+    replyHeader(RDR_TO_PC_PARAMETERS);
+    memcpy(reply+10, params, sizeof(params));
+    sendReply(10+sizeof(params));
+}
+
+// Escape sub-commands, called by escape() through escapeTable[] with their
+// parameters at gEscData (see escape.h). Each one sends exactly one reply.
+
+U8 *gEscData;   // parameters, after the sub-command byte
+U32 gEscLen;    // and their length
+
+U16 readLE16(const U8 *p) {
+    return p[0] | (p[1] << 8);
+}
+
+U32 readLE32(const U8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((U32)p[3] << 24);
+}
+
+void writeLE16(U8 *p, U16 n) {
+    p[0] = n & 0xFF;
+    p[1] = n >> 8;
+}
+
+void writeLE32(U8 *p, U32 n) {
+    writeLE16(p, n & 0xFFFF);
+    writeLE16(p+2, n >> 16);
+}
+
+// Sends a RDR_to_PC_Escape with len result bytes from data, which may be
+// in flash or at reply+10
+int escReplyFrom(const U8 *data, int len) {
+    udp_seg seg[2];
+
+    replyHeader(RDR_TO_PC_ESCAPE);
+    seg[0].data = reply;
+    seg[0].len = 10;
+    seg[1].data = data;
+    seg[1].len = len;
+    return sendReplyv(seg, 2);
+}
+
+// the file a handle parameter names, -1 if there is none
+int escHandle(const U8 *p) {
+    int handle = readLE16(p);
+    return fs_entry_get(handle) ? handle : -1;
+}
+
+// drains up to TRACE_DRAIN_MAX of the oldest records of a trace ring
+void escTrace() {
+    static trace_record rec[TRACE_DRAIN_MAX];
+    U8 ring = gEscData[0];
+    U32 lost;
+    int n;
+
+    if (ring >= TRACE_RINGS) {
+        sendError(CCID_ERR_CMD_NOT_SUPPORTED);
+        return;
     }
+    n = trace_drain(ring, rec, TRACE_DRAIN_MAX, &lost);
+    reply[10] = ring;
+    reply[11] = lost < 255 ? lost : 255;
+    reply[12] = n;
+    memcpy(reply+13, rec, n * sizeof(trace_record));
+    escReplyFrom(reply+10, 3 + n * sizeof(trace_record));
+}
+
+void escStats() {
+    U32 offset = readLE16(gEscData);
+    U32 n = offset < sizeof(gStats) ? sizeof(gStats) - offset : 0;
+
+    escReplyFrom((const U8 *)&gStats + offset, n < ESC_DATA_MAX ? n : ESC_DATA_MAX);
+}
+
+void escStatsClear() {
+    stats_clear();
+    escReplyFrom(reply+10, 0);
+}
+
+void escInfo() {
+    esc_info info;
+    int h;
+
+    info.page_size = FLASH_PAGE_SIZE;
+    info.data_pages = FS_DATA_PAGES;
+    info.free_pages = fs_free_pages();
+    info.max_files = FS_MAX_FILES;
+    info.files = 0;
+    for (h = fs_next(-1); h >= 0; h = fs_next(h))
+        info.files++;
+    info.max_message = CCID_MAX_MESSAGE;
+    memcpy(reply+10, &info, sizeof(info));
+    escReplyFrom(reply+10, sizeof(info));
+}
+
+void escFind() {
+    int handle = fs_find(gEscData, gEscLen);
+
+    if (handle < 0) {
+        sendError(ESC_ERR_NOT_FOUND);
+        return;
+    }
+    writeLE16(reply+10, handle);
+    writeLE32(reply+12, fs_size(handle));
+    escReplyFrom(reply+10, 6);
+}
+
+void escCreate() {
+    int handle;
+
+    handle = fs_create(gEscData+4, gEscLen-4, readLE32(gEscData));
+    if (handle < 0) {
+        sendError(ESC_ERR_NO_SPACE);
+        return;
+    }
+    forgetFile(handle);  // the descriptors of a file it replaced
+    writeLE16(reply+10, handle);
+    escReplyFrom(reply+10, 2);
+}
+
+// a descriptor of its own for the named file
+void escOpen() {
+    int handle = fs_find(gEscData, gEscLen);
+    int fd = handle < 0 ? -1 : file_open(handle);
+
+    if (fd < 0) {
+        sendError(handle < 0 ? ESC_ERR_NOT_FOUND : ESC_ERR_NO_DESC);
+        return;
+    }
+    reply[10] = fd;
+    writeLE16(reply+11, handle);
+    writeLE32(reply+13, fs_size(handle));
+    escReplyFrom(reply+10, 7);
+}
+
+void escClose() {
+    U8 fd = gEscData[0];
+
+    if (file_handle(fd) < 0 || fd == gFile) {
+        sendError(ESC_ERR_NOT_FOUND);
+        return;
+    }
+    file_close(fd);
+    escReplyFrom(reply+10, 0);
+}
+
+// straight from flash or the fill buffer, in a run for each file page the
+// data touches
+void escRead() {
+    U8 fd = gEscData[0];
+    U32 offset = readLE32(gEscData+1);
+    U32 len = readLE16(gEscData+5);
+    udp_seg seg[4];
+    int nseg = 1;
+
+    if (file_handle(fd) < 0) {
+        sendError(ESC_ERR_NOT_FOUND);
+        return;
+    }
+    if (offset > file_size(fd)) {
+        sendError(ESC_ERR_RANGE);
+        return;
+    }
+    if (len > ESC_DATA_MAX)
+        len = ESC_DATA_MAX;
+
+    replyHeader(RDR_TO_PC_ESCAPE);
+    seg[0].data = reply;
+    seg[0].len = 10;
+    while (len > 0 && nseg < 4) {
+        U32 n;
+        seg[nseg].data = file_data_at(fd, offset, &n);
+        if (n == 0)
+            break;
+        seg[nseg].len = n < len ? n : len;
+        offset += seg[nseg].len;
+        len -= seg[nseg].len;
+        nseg++;
+    }
+    sendReplyv(seg, nseg);
+}
+
+void escWrite() {
+    U8 fd = gEscData[0];
+    U32 offset = readLE32(gEscData+1);
+    U8 flags = gEscData[5];
+
+    if (file_handle(fd) < 0) {
+        sendError(ESC_ERR_NOT_FOUND);
+        return;
+    }
+    if (file_write_at(fd, offset, gEscData+6, gEscLen-6) < 0) {
+        sendError(ESC_ERR_RANGE);
+        return;
+    }
+    if (flags & ESC_WRITE_FLUSH)
+        file_flush();
+
+    if (!AT91F_Flash_Pipe_Status(0))
+        sendError(ESC_ERR_FLASH);
     else
-    if (bMessageType == PC_RDR_SET_PARAMETERS) {
-        reply[0] = RDR_TO_PC_PARAMETERS;    // reply message id
-        reply[1] = 0x05;        // 5 bytes. count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = 0x11;
-        reply[11] = 0x00;
-        reply[12] = 0x00;
-        reply[13] = 0x20;
-        reply[14] = 0x00;
-        udp_write(reply, 0, 15);
+        escReplyFrom(reply+10, 0);
+}
+
+void escDelete() {
+    int handle = escHandle(gEscData);
+
+    forgetFile(handle);
+    if (handle < 0 || !fs_delete(handle)) {
+        sendError(ESC_ERR_NOT_FOUND);
+        return;
     }
+    escReplyFrom(reply+10, 0);
+}
+
+// as many occupied entries as fit, from the cursor handle on
+void escList() {
+    int handle = fs_next(readLE16(gEscData) - 1);
+    U8 *p = reply+12;
+
+    while (handle >= 0) {
+        const fs_entry *e = fs_entry_get(handle);
+        int len = FS_NAME_LEN;
+
+        while (len > 0 && e->name[len-1] == 0)
+            len--;
+        if (p + ESC_LIST_ENTRY + len > reply+10+ESC_DATA_MAX)
+            break;
+        writeLE16(p, handle);
+        writeLE32(p+2, fs_size(handle));
+        p[6] = e->flags;
+        p[7] = len;
+        memcpy(p+ESC_LIST_ENTRY, e->name, len);
+        p += ESC_LIST_ENTRY + len;
+        handle = fs_next(handle);
+    }
+
+    writeLE16(reply+10, handle < 0 ? ESC_LIST_END : handle);
+    escReplyFrom(reply+10, p - (reply+10));
+}
+
+void escFormat() {
+    file_reset();
+    gFile = -1;
+    fs_format();
+    escReplyFrom(reply+10, 0);
+}
+
+// A sub-command needs at least minLen bytes of parameters, and an inited
+// card if ESC_INITED is set
+#define ESC_INITED 0x01
+
+typedef struct {
+    void (*handler)(void);
+    U8 minLen;
+    U8 flags;
+} escapeEntry;
+
+static const escapeEntry escapeTable[256] = {
+    [ESC_TRACE]       = { escTrace,      1, 0 },
+    [ESC_STATS]       = { escStats,      2, 0 },
+    [ESC_STATS_CLEAR] = { escStatsClear, 0, 0 },
+    [ESC_INFO]        = { escInfo,       0, 0 },
+    [ESC_FIND]        = { escFind,       1, ESC_INITED },
+    [ESC_CREATE]      = { escCreate,     5, ESC_INITED },
+    [ESC_READ]        = { escRead,       7, ESC_INITED },
+    [ESC_WRITE]       = { escWrite,      6, ESC_INITED },
+    [ESC_DELETE]      = { escDelete,     2, ESC_INITED },
+    [ESC_LIST]        = { escList,       2, ESC_INITED },
+    [ESC_OPEN]        = { escOpen,       1, ESC_INITED },
+    [ESC_CLOSE]       = { escClose,      1, ESC_INITED },
+    [ESC_FORMAT]      = { escFormat,     0, ESC_INITED },
+};
+
+// PC_to_RDR_Escape: abData[0] selects the sub-command
+void escape() {
+    const escapeEntry *e = &escapeTable[inMsg[10]];
+
+    gEscData = inMsg+11;
+    gEscLen = inHdr.dwLength - 1;
+    if (inHdr.dwLength == 0 || e->handler == 0)
+        sendError(CCID_ERR_CMD_NOT_SUPPORTED);
+    else
+    if (gEscLen < e->minLen)
+        sendError(CCID_ERR_BAD_LENGTH);
     else
-    if (bMessageType == PC_RDR_XFR_BLOCK) {
-        reply[0] = RDR_TO_PC_DATABLOCK; // reply message id
-        reply[1] = 0x02;        // 2 bytes. count of bytes in the reply data
-        reply[5] = inMsg[5];    // bSlot
-        reply[6] = inMsg[6];    // bSeq
-        reply[7] = 0x00;        // resp byte 1
-        reply[8] = 0x00;        // resp byte 2
-        reply[9] = 0x00;        // resp byte 3
-        reply[10] = 0x6E;
-        reply[11] = 0x00;
-        udp_write(reply, 0, 12);
+    if ((e->flags & ESC_INITED) && !cardInited)
+        sendError(ESC_ERR_NOT_INITED);
+    else
+        e->handler();
+}
+
+// PC_to_RDR message types are 0x61..0x73, indexed by their low five bits.
+// Types without a handler are failed with CCID_ERR_CMD_NOT_SUPPORTED.
+#define MSG_INDEX(type)  ((type) & 0x1F)
+
+static void (* const msgTable[32])(void) = {
+    [MSG_INDEX(PC_RDR_ICC_POWER_ON)]    = iccPowerOn,
+    [MSG_INDEX(PC_RDR_ICC_POWER_OFF)]   = iccPowerOff,
+    [MSG_INDEX(PC_RDR_XFR_BLOCK)]       = xfrBlock,
+    [MSG_INDEX(PC_RDR_SET_PARAMETERS)]  = setParameters,
+    [MSG_INDEX(PC_RDR_ESCAPE)]          = escape,
+};
+
+HOTFUNC void process_usb_requests() {
+    int status = ccid_read(inMsg, &inHdr);
+
+    if (status == CCID_NONE) {
+       // nothing from the host, reclaim a stale metadata page meanwhile
+       fs_gc();
+       return;
     }
 
-} // end of process_usb_requests()
+    gCmdPending = 1;
+    gCmdExtendAt = systick_deadline_ms(CMD_TIME_EXTENSION_MS);
+    U32 start = stats_start();
 
-int main(void) {
+    if (status == CCID_BAD_LENGTH) {
+        sendError(CCID_ERR_BAD_LENGTH);
+        stats_end(STATS_BAD_LENGTH, start);
+        return;
+    }
+
+    U8 bMessageType = inHdr.bMessageType;
+    if ((bMessageType & 0xE0) == 0x60 && msgTable[MSG_INDEX(bMessageType)]) {
+        // a new command carries its INS, later parts belong to gApdu's
+        U16 level = CCID_LEVEL(&inHdr);
+        if (bMessageType == PC_RDR_XFR_BLOCK)
+            trace(TRACE_MAIN, TRACE_APDU_START, level <= CCID_CHAIN_BEGIN ? inMsg[11] : gApdu.ins, level);
+
+        msgTable[MSG_INDEX(bMessageType)]();
+        stats_end(STATS_MSG(bMessageType), start);
+        // chained parts and response blocks count for the INS they belong to
+        if (bMessageType == PC_RDR_XFR_BLOCK) {
+            stats_end(STATS_INS(gApdu.ins), start);
+            trace(TRACE_MAIN, TRACE_APDU_END, gApdu.ins, reply[1] | (reply[2] << 8));
+        }
+    }
+    else
+        // every message gets its reply, which also clears gCmdPending; left
+        // set, a flash wait in fs_gc() would send a stale time extension
+        sendError(CCID_ERR_CMD_NOT_SUPPORTED);
+}
+
+// Brings up the interrupt controller, the timer and USB. Enumeration then
+// proceeds in the USB interrupt handler.
+void boardInit() {
   /* When we get here:
    * PLL and flash have been initialised and
    * interrupts are off, but the AIC has not been initialised.
    */
 
   aic_initialise();
+  systick_init();
+  stats_init();
   interrupts_enable();
   udp_init();
 
 
   // First, we need to enable USB
   udp_enable(1);
+}
 
-  // Now, we wait until the enumeration process has finished
-  while (1) {
-    int status = udp_status();
-    if ( (status & 0xf0000000) == 0x10000000 && (status & 0xf000000) != 0 ) // compiler will not take my defines here.
-       break;
-  }
+// true once the host has configured the device
+int usbConfigured() {
+  int status = udp_status();
+  return (status & 0xf0000000) == 0x10000000 && (status & 0xf000000) != 0; // compiler will not take my defines here.
+}
+
+// called once the device is configured, before the first mainLoopPoll()
+void sessionInit() {
+  // keep receiving while flash pages program, and ask for more time when
+  // a command keeps the host waiting
+  AT91F_Flash_Set_Busy_Hook(udp_rx_poll);
+  AT91F_Flash_Set_Wait_Hook(commandWait);
 
   // this sets the card initialization flag
   initCheck();
-  
-  while (1) {
-    // here is where we process all types of requests coming from the host,
-    // including the request to run an application.
-    process_usb_requests();
-  }
-} 
+}
+
+// one pass of the main loop
+HOTFUNC void mainLoopPoll() {
+  // here is where we process all types of requests coming from the host,
+  // including the request to run an application.
+  process_usb_requests();
+  AT91F_Flash_Pipe_Run();
+  usb_activity_poll();
+}
+
+// The host build (make host) supplies its own main() and drives the
+// functions above against the register models in src/host.
+#ifndef HOST
+int main(void) {
+  boardInit();
+
+  // Now, we wait until the enumeration process has finished
+  while (!usbConfigured())
+    ;
+
+  sessionInit();
+
+  while (1)
+    mainLoopPoll();
+}
+#endif
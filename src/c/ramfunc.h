@@ -1,6 +1,19 @@
 #ifndef __RAMFUNC_H__
 #define __RAMFUNC_H__
 
+// The host build has no .fastrun section
+#ifdef HOST
+#define RAMFUNC
+#else
 #define RAMFUNC __attribute__ ((long_call, section (".fastrun")))
+#endif
+
+// The USB data path: in flash by default, in .fastrun as well when built
+// with 'make FASTRUN_HOT=1'. 'make fastrun_report' shows what that costs.
+#if defined(FASTRUN_HOT) && !defined(HOST)
+#define HOTFUNC RAMFUNC
+#else
+#define HOTFUNC
+#endif
 
 #endif //__RAMFUNC_H__
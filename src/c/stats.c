@@ -0,0 +1,50 @@
+/* Hot path statistics, see stats.h */
+
+#include <string.h>
+
+#include "mytypes.h"
+#include "AT91SAM7.h"
+#include "hal.h"
+#include "timer.h"
+#include "ramfunc.h"
+#include "stats.h"
+
+stats_table gStats;
+
+void stats_init(void)
+{
+  REG_WR(AT91C_PMC_PCER, 1 << AT91C_ID_TC0);
+  REG_WR(AT91C_TC0_CCR, AT91C_TC_CLKDIS);
+  REG_WR(AT91C_TC0_CMR, AT91C_TC_CLKS_TIMER_DIV2_CLOCK);
+  REG_WR(AT91C_TC0_CCR, AT91C_TC_CLKEN | AT91C_TC_SWTRG);
+  stats_clear();
+}
+
+void stats_clear(void)
+{
+  memset(&gStats, 0, sizeof(gStats));
+  gStats.tick_hz = STATS_TICK_HZ;
+  gStats.slots = STATS_SLOTS;
+}
+
+// The stats_stamp() a time span starts at
+HOTFUNC U32 stats_start(void)
+{
+  return stats_stamp();
+}
+
+// Adds the time since start to slot. Called from the main loop only.
+HOTFUNC void stats_end(int slot, U32 start)
+{
+  U32 now = stats_start();
+  U32 ms = ((now >> 16) - (start >> 16)) & 0xFFFF;
+  U32 ticks = ms < STATS_TC_SPAN_MS ? (now - start) & 0xFFFF : ms * (STATS_TICK_HZ / 1000);
+  stats_entry *e = &gStats.e[slot];
+
+  if (e->count == 0 || ticks < e->min)
+    e->min = ticks;
+  if (ticks > e->max)
+    e->max = ticks;
+  e->count++;
+  e->total += ticks;
+}
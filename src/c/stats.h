@@ -0,0 +1,63 @@
+/* Hot path statistics.
+ *
+ * Count, minimum, maximum and total time of each CCID message type, each
+ * APDU INS and the driver functions udp_read() and AT91F_Flash_Write(),
+ * kept in RAM and read out with the READ STATS APDU (80 C7). Times are in
+ * ticks of TC0, which runs free at MCK/8 (STATS_TICK_HZ). Its 16-bit
+ * counter wraps after 10.9 ms, so longer spans are taken from the
+ * millisecond clock instead, to the millisecond.
+ *
+ * READ STATS returns gStats as it is in RAM: little-endian 32-bit words,
+ * the tick rate, the number of slots, then four words per slot.
+ */
+
+#ifndef __STATS_H__
+#  define __STATS_H__
+
+#  include "mytypes.h"
+#  include "AT91SAM7.h"
+#  include "hal.h"
+#  include "timer.h"
+
+#  define STATS_TICK_HZ       (CLOCK_FREQUENCY / 8)
+#  define STATS_TC_SPAN_MS    10    /* spans shorter than this fit in 16 bits of TC0 */
+
+/* Slots */
+#  define STATS_UDP_READ      0     /* udp_read() of a waiting message */
+#  define STATS_FLASH_WRITE   1     /* AT91F_Flash_Write() */
+#  define STATS_BAD_LENGTH    2     /* messages failed for their dwLength */
+#  define STATS_OTHER_INS     3     /* any INS outside 0xB0..0xCF */
+#  define STATS_MSG(type)     (4 + ((type) & 0x1F))     /* PC_to_RDR 0x61..0x73 */
+#  define STATS_INS(ins)      ((U8)((ins) - 0xB0) < 0x20 ? 36 + (U8)((ins) - 0xB0) : STATS_OTHER_INS)
+#  define STATS_SLOTS         68
+
+typedef struct {
+  unsigned int count;
+  unsigned int min;
+  unsigned int max;
+  unsigned int total;
+} stats_entry;
+
+typedef struct {
+  unsigned int tick_hz;
+  unsigned int slots;
+  stats_entry e[STATS_SLOTS];
+} stats_table;
+
+extern stats_table gStats;
+
+/* A timestamp: the millisecond clock in the upper half, TC0 in the lower.
+ * Inlined and register and RAM only, so .fastrun code can take one while
+ * the flash is busy (the trace records do).
+ */
+static inline __attribute__ ((always_inline)) U32 stats_stamp(void)
+{
+  return (systick_ram_ms() << 16) | (REG_RD(AT91C_TC0_CV) & 0xFFFF);
+}
+
+void stats_init(void);
+void stats_clear(void);
+U32 stats_start(void);
+void stats_end(int slot, U32 start);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _SYSTIME_H
 #  define _SYSTIME_H
 
-extern FOURBYTES get_sys_time_impl();
+#  include "mytypes.h"
+
+extern U32 get_sys_time_impl();
 
 #endif // _SYSTIME_H
@@ -1,9 +1,82 @@
+/* Millisecond/microsecond time base driven by the Periodic Interval Timer.
+ *
+ * The PIT runs from MCK/16 and raises the system interrupt once per
+ * millisecond. The interrupt only folds the elapsed periods into a counter;
+ * readers add any periods still pending in PICNT, so the clock keeps
+ * counting while interrupts are masked (up to 4095 ms).
+ */
+
+#include "mytypes.h"
+#include "AT91SAM7.h"
+#include "interrupts.h"
+#include "aic.h"
 #include "timer.h"
+#include "hal.h"
+#include "systime.h"
+#include "ramfunc.h"
+
+#define PIT_CLOCK   (CLOCK_FREQUENCY / 16)
+#define PIT_PERIOD  (PIT_CLOCK / 1000)      // PIT ticks per millisecond
+
+extern void systick_isr_entry(void);
+
+volatile U32 systick_ms = 0;
+
+HOTFUNC void systick_isr_C(void)
+{
+  // Reading PIVR acknowledges the interrupt and resets PICNT
+  if (REG_RD(AT91C_PITC_PISR) & AT91C_PITC_PITS)
+    systick_ms += (REG_RD(AT91C_PITC_PIVR) & AT91C_PITC_PICNT) >> 20;
+}
+
+void systick_init(void)
+{
+  int i_state = interrupts_get_and_disable();
+
+  aic_mask_off(AT91C_ID_SYS);
+  aic_set_vector(AT91C_ID_SYS, AIC_INT_LEVEL_NORMAL, (U32) systick_isr_entry);
+  aic_mask_on(AT91C_ID_SYS);
+  REG_WR(AT91C_PITC_PIMR, (PIT_PERIOD - 1) | AT91C_PITC_PITEN | AT91C_PITC_PITIEN);
+
+  if (i_state)
+    interrupts_enable();
+}
+
+HOTFUNC U32 systick_get_ms(void)
+{
+  int i_state = interrupts_get_and_disable();
+  U32 ms = systick_ms + ((REG_RD(AT91C_PITC_PIIR) & AT91C_PITC_PICNT) >> 20);
+
+  if (i_state)
+    interrupts_enable();
+  return ms;
+}
+
+U32 systick_get_us(void)
+{
+  int i_state = interrupts_get_and_disable();
+  U32 piir = REG_RD(AT91C_PITC_PIIR);
+  U32 ms = systick_ms + ((piir & AT91C_PITC_PICNT) >> 20);
+
+  if (i_state)
+    interrupts_enable();
+  return ms*1000 + ((piir & AT91C_PITC_CPIV) * 1000) / PIT_PERIOD;
+}
+
+void systick_wait_us(int unit)
+{
+  U32 deadline = systick_deadline_us(unit);
+
+  while (!systick_us_expired(deadline))
+    ;
+}
 
-// This is not working correctly. Maybe the compiler is making an optimization here...???
 void systick_wait_ms(int unit)
 {
-	int i;
-	for (i=0; i<unit*500000; i++);
+  systick_wait_us(unit*1000);
 }
 
+U32 get_sys_time_impl()
+{
+  return systick_get_ms();
+}
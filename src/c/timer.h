@@ -1,6 +1,48 @@
 #ifndef __TIMER_H__
 #  define __TIMER_H__
 
+#  include "mytypes.h"
+#  include "AT91SAM7.h"
+#  include "hal.h"
+
+void systick_init(void);
+U32 systick_get_ms(void);
+U32 systick_get_us(void);
 void systick_wait_ms(int unit);
+void systick_wait_us(int unit);
+
+/* Deadlines are absolute systick_get_ms()/systick_get_us() values. The
+ * signed difference keeps the test valid across counter wrap-around.
+ */
+#  define systick_deadline_ms(ms)   (systick_get_ms() + (U32)(ms))
+#  define systick_deadline_us(us)   (systick_get_us() + (U32)(us))
+#  define systick_ms_expired(d)     ((S32)(systick_get_ms() - (d)) >= 0)
+#  define systick_us_expired(d)     ((S32)(systick_get_us() - (d)) >= 0)
+
+/* Whole PIT periods (milliseconds) elapsed since the PIT_PIIR snapshot
+ * 'start'. Register-only and always inlined, so .fastrun code can time out
+ * while the flash is busy and interrupts are masked.
+ */
+static inline __attribute__ ((always_inline)) U32 systick_pit_elapsed_ms(U32 start)
+{
+  return ((REG_RD(AT91C_PITC_PIIR) >> 20) - (start >> 20)) & 0xFFF;
+}
+
+/* systick_get_ms() from RAM and a register only, always inlined, for .fastrun
+ * code while the flash is busy. Instead of masking interrupts it reads again
+ * if the systick interrupt folded PICNT into systick_ms in between.
+ */
+extern volatile U32 systick_ms;
+
+static inline __attribute__ ((always_inline)) U32 systick_ram_ms(void)
+{
+  U32 ms, piir;
+
+  do {
+    ms = systick_ms;
+    piir = REG_RD(AT91C_PITC_PIIR);
+  } while (ms != systick_ms);
+  return ms + ((piir & AT91C_PITC_PICNT) >> 20);
+}
 
 #endif
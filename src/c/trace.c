@@ -0,0 +1,62 @@
+/* Event trace, see trace.h */
+
+#include "mytypes.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
+
+// Both sides touch the records: volatile keeps the copy in trace_drain()
+// ahead of its second look at head, and the record ahead of head++.
+typedef struct {
+  volatile trace_record rec[TRACE_RING_SIZE];
+  volatile U32 head;    // records written, by the producer only
+  U32 tail;             // records drained or lost, by the main loop only
+  U32 lost;
+} trace_ring;
+
+static trace_ring rings[TRACE_RINGS];
+
+RAMFUNC void trace(int ring, U8 id, U8 a, U16 b)
+{
+  trace_ring *r = &rings[ring];
+  volatile trace_record *e = &r->rec[r->head & (TRACE_RING_SIZE - 1)];
+
+  e->stamp = stats_stamp();
+  e->id = id;
+  e->a = a;
+  e->b = b;
+  r->head++;
+}
+
+// Copies up to max of the oldest records of ring to out and returns their
+// number; lost gets the records overwritten since the last drain. The
+// producer may write while this runs: the slot of record n is rewritten
+// once head reaches n + TRACE_RING_SIZE, so a record only counts if head
+// was still short of that after it was copied.
+int trace_drain(int ring, trace_record *out, int max, U32 *lost)
+{
+  trace_ring *r = &rings[ring];
+  int n = 0;
+
+  while (n < max && r->tail != r->head)
+  {
+    U32 behind = r->head - r->tail;
+
+    if (behind >= TRACE_RING_SIZE)
+    {
+      r->lost += behind - (TRACE_RING_SIZE - 1);
+      r->tail += behind - (TRACE_RING_SIZE - 1);
+      continue;
+    }
+    out[n] = r->rec[r->tail & (TRACE_RING_SIZE - 1)];
+    if (r->head - r->tail < TRACE_RING_SIZE)
+      n++;
+    else
+      r->lost++;
+    r->tail++;
+  }
+
+  *lost = r->lost;
+  r->lost = 0;
+  return n;
+}
@@ -0,0 +1,52 @@
+/* Event trace.
+ *
+ * Fixed-size binary records of USB and flash events in RAM rings, read out
+ * with the Escape sub-command TRACE (see escape.h) and turned into a
+ * timeline on the host by src/host/tracedump.c.
+ *
+ * There is one ring per context and each has a single producer: TRACE_ISR
+ * for the USB interrupt handler and the receive path it shares with the
+ * flash busy hook, which runs with interrupts masked; TRACE_MAIN for the
+ * main loop. A producer only moves the head of its own ring, so neither
+ * side takes a lock. A full ring overwrites its oldest records; the drain
+ * skips what was overwritten, or is being, and counts it as lost.
+ *
+ * trace() runs from RAM and calls nothing in flash, so it may be used
+ * while a page programs.
+ */
+
+#ifndef __TRACE_H__
+#  define __TRACE_H__
+
+#  include "mytypes.h"
+#  include "ramfunc.h"
+
+/* Events, with their two arguments */
+#  define TRACE_SETUP         1     /* a bRequest, b wValue */
+#  define TRACE_RX_BANK       2     /* a EP1 bank released (0, 1), b bytes in it */
+#  define TRACE_TXCOMP        3     /* a EP2 banks still loaded, b 1 if a message ended */
+#  define TRACE_FLASH_START   4     /* a 1 if without erase (NEBP), b page */
+#  define TRACE_FLASH_END     5     /* a 1 if programmed, b page */
+#  define TRACE_APDU_START    6     /* a INS, b wLevelParameter */
+#  define TRACE_APDU_END      7     /* a INS, b dwLength of the reply */
+
+/* Rings */
+#  define TRACE_MAIN          0
+#  define TRACE_ISR           1
+#  define TRACE_RINGS         2
+
+#  define TRACE_RING_SIZE     128   /* records per ring, a power of two */
+#  define TRACE_DRAIN_MAX     32    /* records per Escape reply */
+
+/* 8 bytes, little-endian on the wire as in RAM */
+typedef struct {
+  unsigned int stamp;               /* stats_stamp(): ms << 16 | TC0 */
+  U8 id;
+  U8 a;
+  U16 b;
+} trace_record;
+
+RAMFUNC void trace(int ring, U8 id, U8 a, U16 b);
+int trace_drain(int ring, trace_record *out, int max, U32 *lost);
+
+#endif
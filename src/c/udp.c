@@ -1,10 +1,15 @@
 /**
  *
- * We use a mixture of interrupt driven and directly driven I/O. Interrupts
- * are used for handling the configuration/enumeration phases, which allows
- * us to respond quickly to events. For actual data transfer, we drive the
- * process directly thus removing the need to have data buffers available at
- * interrupt time.
+ * All I/O is interrupt driven. Interrupts handle the configuration and
+ * enumeration phases, which allows us to respond quickly to events. The bulk
+ * endpoints are serviced from the same interrupt: EP1-OUT packets are drained
+ * into a receive ring as soon as a bank fills and are split into whole
+ * CCID messages using dwLength, and EP2-IN is fed from a transmit ring as each
+ * packet completes. udp_read() and udp_write() only touch the rings;
+ * udp_writev() gathers a message from several pieces, such as a header,
+ * file data read straight from flash and a status word, into the transmit
+ * ring, which is the only copy the message needs. Requests on the control
+ * endpoint are answered by udp_enumerate() in udp_ctrl.c.
  *
  * As with other leJOS drivers, we implement only a minimal
  * set of functions in the firmware with as much as possible being done in
@@ -19,286 +24,113 @@
 #include "udp.h"
 #include "interrupts.h"
 #include "AT91SAM7.h"
+#include "hal.h"
 
 #include "aic.h"
+#include "timer.h"
+#include "ramfunc.h"
+#include "copy.h"
+#include "udp_ctrl.h"
+#include "stats.h"
+#include "trace.h"
 #include <string.h>
 
 #define AT91C_PERIPHERAL_ID_UDP        11
 
-#define AT91C_UDP_CSR0  ((AT91_REG *)   0xFFFB0030)
-#define AT91C_UDP_CSR1  ((AT91_REG *)   0xFFFB0034)
-#define AT91C_UDP_CSR2  ((AT91_REG *)   0xFFFB0038)
-#define AT91C_UDP_CSR3  ((AT91_REG *)   0xFFFB003C)
-
-#define AT91C_UDP_FDR0  ((AT91_REG *)   0xFFFB0050)
-#define AT91C_UDP_FDR1  ((AT91_REG *)   0xFFFB0054)
-#define AT91C_UDP_FDR2  ((AT91_REG *)   0xFFFB0058)
-#define AT91C_UDP_FDR3  ((AT91_REG *)   0xFFFB005C)
-
-// Set or clear flag(s) in a register
-#define SET_CSR(register, flags)        ((register) = (register) | (flags))
-#define CLEAR_CSR(register, flags)      ((register) &= ~(flags))
-
-
-// Poll the status of flags in a register
-#define ISSET(register, flags)      (((register) & (flags)) == (flags))
-#define ISCLEARED(register, flags)  (((register) & (flags)) == 0)
-
-#define UDP_CLEAREPFLAGS(register, dFlags) { \
-    while (!ISCLEARED((register), dFlags)) \
-        CLEAR_CSR((register), dFlags); \
-}
-
-#define UDP_SETEPFLAGS(register, dFlags) { \
-    while (ISCLEARED((register), dFlags)) \
-        SET_CSR((register), dFlags); \
-}
-
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-// USB States
-#define USB_READY       0
-#define USB_CONFIGURED  1
-#define USB_SUSPENDED   2
-
-#define USB_DISABLED    0x8000
-#define USB_NEEDRESET   0x4000
-#define USB_WRITEABLE   0x100000
-#define USB_READABLE    0x200000
+// Bulk endpoint rings. Each ring has exactly one producer and one consumer
+// (the interrupt handler and the main loop), and each side only writes its
+// own index, so no locking is needed. Sizes must be powers of two.
+#define UDP_RX_RING_SIZE    1024
+#define UDP_TX_RING_SIZE    1024
+#define UDP_MSG_QUEUE_SIZE  16         // complete messages queued per direction
+#define UDP_MSG_PER_PACKET  7          // most messages one OUT packet can complete
+#define UDP_RX_MSG_MAX      512        // bytes kept of a longer message
+#define UDP_TX_MSG_MAX      512        // longest message udp_writev() accepts
+#define RING_MASK(size)     ((size) - 1)
 
 //#define LED1          (1<<18)                     // PA18 green LED on Olimex regular board
 //#define LED1          (1<<8)                      // PA8 green LED on Olimex header board
 #define LED1            (1<<0)                      // DS1 green LED on Atmel board
 
+#define LED_HOLD_MS           20      // how long the activity LED stays lit
 
-static U8 currentConfig;
-static U32 currentFeatures;
+
+U8 currentConfig;
+U32 currentFeatures;
 static unsigned currentRxBank;
-static int configured = (USB_DISABLED|USB_NEEDRESET);
-static int newAddress;
-static U8 *outPtr;
-static U32 outCnt;
-static U8 delayedEnable = 0;
+int configured = (USB_DISABLED|USB_NEEDRESET);
+U8 delayedEnable = 0;
+static U32 ledOffDeadline;
+static U8 ledLit = 0;
+
+// EP1-OUT: written by the ISR, consumed by udp_read()
+static U8 rxRing[UDP_RX_RING_SIZE];
+static volatile U32 rxHead, rxTail;
+static volatile U16 rxMsgLen[UDP_MSG_QUEUE_SIZE];    // bytes kept in the ring
+static volatile U32 rxMsgFrame[UDP_MSG_QUEUE_SIZE];  // bytes received
+static volatile U32 rxMsgHead, rxMsgTail;
+static U32 rxMsgSize, rxMsgKept, rxMsgLength;  // message being received, its dwLength
+static volatile U8 rxThrottled;
+
+// EP2-IN: written by udp_write(), consumed by the ISR
+static U8 txRing[UDP_TX_RING_SIZE];
+static volatile U32 txHead, txTail;
+static volatile U16 txMsgLen[UDP_MSG_QUEUE_SIZE];
+static volatile U32 txMsgHead, txMsgTail;
+static U32 txLoadMsg, txLoadPos, txLoadSent; // next packet to load
+static volatile U8 txBanks;                  // packets in the two FIFO banks
+static U8 txBankEnds[2];                     // packet ends a message, per bank
+static U8 txBankFirst;
 
 #if REMOTE_CONSOLE
     static U8 rConsole = 0;
 #endif
 
-/*
-    Card control variables
-*/
-unsigned int clock_frequency[] = {4000, 4800, 6000, 8000};
-unsigned int data_rate[] = {10752, 12903, 21505, 25806, 43010, 86021, 129032, 172053, 215053, 344086};
-unsigned char cardInserted[] = {0x50, 0x03};
-unsigned char return_data[DATA_SIZE];
-
-// Device descriptor
-static const U8 dd[] = {
-  0x12, // size of this descriptor
-  0x01, // type of descriptor (DEVICE)
-  0x00, // USB version
-  0x02, // USB version
-  0x00, // class
-  0x00, // subclass
-  0x00, // protocol
-  0x08, // control endpoint data size
-  0xEB, // VENDOORID byte 1
-  0x03, // VENDOORID byte 2
-  0x34, // PRODUCTID byte 1
-  0x12, // PRODUCTID byte 2
-  0x00, // RELEASE byte 1
-  0x00, // RELEASE byte 2
-  0x02, // Index of manufacturer description
-  0x03, // Index of product description
-  0x01, // Index of serial number description
-  0x01  // One possible configuration
-};
-
-// Configuration descriptor
-static const U8 cfd[] =
-{
-  0x09, // size
-  0x02, // configuration type
-  0x5D, // size byte 1
-  0x00, // size byte 2
-  0x01, // There is one interface in this configuration
-  0x01, // This is configuration #1
-  0x00, // No string descriptor for this configuration
-  BUSPOWERED_NOREMOTEWAKEUP, // bmAttributes
-  50, // power (50 means 100mA)
-
-// Interface descriptor
-  0x09, // size
-  0x04, // type of descriptor (INTERFACE)
-  0x00, // This is interface #0
-  0x00, // This is alternate setting #0
-  0x03, // number of endpoints used (1 out, 1 in, 1 interrupt)
-  0x0B, // CLASS
-  0x00, // SUBCLASS
-  0x00, // PROTOCOL
-  0x00, // associated string descriptor
-
-// CCID class specific descriptor
-  0x36,                 // (bLength*) Size of this description
-  0x21,                 // (bDescriptorType*) Description type
-  0x00, 0x01,           // (bcdCCID*) version 1.00
-  0x00,                 // (bMaxSlotIndex*)
-  0x01,                 // (bVoltageSupport) 01h indicates 5.0 volts
-  0x01,0x00,0x00,0x00,  // (dwProtocols*) upper word (PPPP) must be 0. Lower word indicates support for T0 and T1 (bit 1 and 2)
-  0x00,0x48,0x00,0x00,  // dwDefaultClock (18.432Mhz given in Khz), not used in v1.00, fixed for legacy reasons
-  0x00,0x48,0x00,0x00,  // dwMaximumClock (18.432Mhz given in Khz), not used in v1.00, fixed for legacy reasons
-  0x04,                 // bNumClockSupported => no manual setting
-  0x00,0x2A,0x00,0x00,  // (10752) dwDataRate
-  0xE7,0x4C,0x06,0x00,  // (412903) dwMaxDataRate
-  0x0A,                 // bNumDataRatesSupported
-  0xFE,0x00,0x00,0x00,  // dwMaxIFSD
-  0x07,0x00,0x00,0x00,  // dwSynchProtocols
-  0x00,0x00,0x00,0x00,  // dwMechanical
-  0xB2,0x07,0x02,0x00,  // dwFeatures
-  0x0F,0x01,0x00,0x00,  // dwMaxCCIDMessageLength (271)
-  0xFF,                 // bClassGetResponse
-  0xFF,                 // bClassEnvelope
-  0x00,0x00,            // wLcdLayout
-  0x00,                 // bPINSupport
-  0x01,                 // bMaxCCIDBusySlots
-
-// Endpoint descriptors
-  0x07, // size
-  0x05, // type of configuration (ENDPOINT)
-  0x01, // endpoint number and direction (OUT)
-  0x02, // type of endpoint (BULK)
-  64,   // endpoint data size byte 1
-  0x00, // endpoint data size byte 2
-  0x00, // interval
-
-  0x07, // size
-  0x05, // type of configuration (ENDPOINT)
-  0x82, // endpoint number and direction (IN)
-  0x02, // type of endpoint (BULK)
-  64,   // endpoint data size byte 1
-  0x00, // endpoint data size byte 2
-  0x00, // interval
-
-  0x07, // size
-  0x05, // type of configuration (ENDPOINT)
-  0x83, // endpoint number and direction (IN)
-  0x03, // type of endpoint (INTERRUPT)
-  8,    // endpoint data size byte 1
-  0x00, // endpoint data size byte 2
-  0x18  // interval
-};
-
-
-// Serial Number Descriptor
-static U8 snd[] =
-{
-      0x1A,           // Descriptor length
-      0x03,           // Descriptor type 3 == string
-      0x31, 0x00,     // MSD of Lap (Lap[2,3]) in UNICode
-      0x32, 0x00,     // Lap[4,5]
-      0x33, 0x00,     // Lap[6,7]
-      0x34, 0x00,     // Lap[8,9]
-      0x35, 0x00,     // Lap[10,11]
-      0x36, 0x00,     // Lap[12,13]
-      0x37, 0x00,     // Lap[14,15]
-      0x38, 0x00,     // LSD of Lap (Lap[16,17]) in UNICode
-      0x30, 0x00,     // MSD of Nap (Nap[18,19]) in UNICode
-      0x30, 0x00,     // LSD of Nap (Nap[20,21]) in UNICode
-      0x39, 0x00,     // MSD of Uap in UNICode
-      0x30, 0x00      // LSD of Uap in UNICode
-};
-
-// Name descriptor, we allow up to 16 unicode characters
-static U8 named[] =
-{
-      0x08,           // Descriptor length
-      0x03,           // Descriptor type 3 == string
-      0x6e, 0x00,     // n
-      0x78, 0x00,     // x
-      0x74, 0x00,     // t
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00,
-      0x00, 0x00
-};
-
-// Manufacturer string descriptor
-static U8 manufacturer[] =
-{
-      0x16,           // Descriptor length
-      0x03,           // Descriptor type 3 == string
-      'B', 0x00,
-      'l', 0x00,
-      'u', 0x00,
-      'e', 0x00,
-      ' ', 0x00,
-      'R', 0x00,
-      'i', 0x00,
-      'v', 0x00,
-      'e', 0x00,
-      'r', 0x00
-};
-
-// Product string descriptor
-static U8 product[] =
-{
-      0x0E,           // Descriptor length
-      0x03,           // Descriptor type 3 == string
-      'V', 0x00,
-      '-', 0x00,
-      'C', 0x00,
-      'a', 0x00,
-      'r', 0x00,
-      'd', 0x00
-};
-
-
-static const U8 ld[] = {0x04,0x03,0x09,0x04}; // Language descriptor
-
 extern void udp_isr_entry(void);
 
 
 void led_configure()
 {
     volatile AT91PS_PIO pPIO = AT91C_BASE_PIOA;         // pointer to PIO data structure
-    pPIO->PIO_PER = LED1;               // PIO Enable Register - allow PIO to control pins P0 - P3 and pin 19
-    pPIO->PIO_OER = LED1;                           // PIO Output Enable Register - sets pins P0 - P3 to outputs
-    pPIO->PIO_SODR = LED1;                          // PIO Set Output Data Register - turns off the four LEDs
+    REG_WR(&pPIO->PIO_PER, LED1);                   // PIO Enable Register - allow PIO to control pins P0 - P3 and pin 19
+    REG_WR(&pPIO->PIO_OER, LED1);                   // PIO Output Enable Register - sets pins P0 - P3 to outputs
+    REG_WR(&pPIO->PIO_SODR, LED1);                  // PIO Set Output Data Register - turns off the four LEDs
 }
 
 void led_turnoff()
 {
     volatile AT91PS_PIO pPIO = AT91C_BASE_PIOA;         // pointer to PIO data structure
-    pPIO->PIO_SODR = LED1;                          // PIO Set Output Data Register - turns off LED
+    REG_WR(&pPIO->PIO_SODR, LED1);                  // PIO Set Output Data Register - turns off LED
 }
 
 void led_turnon()
 {
     volatile AT91PS_PIO pPIO = AT91C_BASE_PIOA;         // pointer to PIO data structure
-    pPIO->PIO_CODR = LED1;                          // PIO Set Output Data Register - turns on LED
+    REG_WR(&pPIO->PIO_CODR, LED1);                  // PIO Set Output Data Register - turns on LED
 }
 
-// turns the USB activity ON
-void usb_activity_on()
+// turns the USB activity ON. The LED is retired later by usb_activity_poll(),
+// so lighting it never stalls the data path.
+HOTFUNC void usb_activity_on()
 {
     led_turnon();
-    systick_wait_ms(20);
+    ledOffDeadline = systick_deadline_ms(LED_HOLD_MS);
+    ledLit = 1;
 }
 
 // turns the USB activity OFF
 void usb_activity_off()
 {
     led_turnoff();
-    systick_wait_ms(20);
+    ledLit = 0;
+}
+
+// called from the main loop; switches the activity LED off once its hold
+// time has expired
+HOTFUNC void usb_activity_poll()
+{
+    if (ledLit && systick_ms_expired(ledOffDeadline))
+       usb_activity_off();
 }
 
 
@@ -309,9 +141,18 @@ static void reset()
   currentRxBank = AT91C_UDP_RX_DATA_BK0;
   configured = USB_READY;
   currentFeatures = 0;
-  newAddress = -1;
-  outCnt = 0;
   delayedEnable = 0;
+  udp_ctrl_reset();
+
+  rxHead = rxTail = 0;
+  rxMsgHead = rxMsgTail = 0;
+  rxMsgSize = rxMsgKept = rxMsgLength = 0;
+  rxThrottled = 0;
+  txHead = txTail = 0;
+  txMsgHead = txMsgTail = 0;
+  txLoadMsg = txLoadPos = txLoadSent = 0;
+  txBanks = 0;
+  txBankFirst = 0;
 }
 
 
@@ -333,470 +174,361 @@ void udp_reset()
      return;
 
   // Take the hardware off line
-  *AT91C_PIOA_PER = (1 << 16);
-  *AT91C_PIOA_OER = (1 << 16);
-  *AT91C_PIOA_SODR = (1 << 16);
-  *AT91C_PMC_SCDR = AT91C_PMC_UDP;
-  *AT91C_PMC_PCDR = (1 << AT91C_ID_UDP);
+  REG_WR(AT91C_PIOA_PER, (1 << 16));
+  REG_WR(AT91C_PIOA_OER, (1 << 16));
+  REG_WR(AT91C_PIOA_SODR, (1 << 16));
+  REG_WR(AT91C_PMC_SCDR, AT91C_PMC_UDP);
+  REG_WR(AT91C_PMC_PCDR, (1 << AT91C_ID_UDP));
   systick_wait_ms(2);
 
   // now bring it back online
   i_state = interrupts_get_and_disable();
 
   /* Make sure the USB PLL and clock are set up */
-  *AT91C_CKGR_PLLR |= AT91C_CKGR_USBDIV_1;
-  *AT91C_PMC_SCER = AT91C_PMC_UDP;
-  *AT91C_PMC_PCER = (1 << AT91C_ID_UDP);
-  *AT91C_UDP_FADDR = 0;
-  *AT91C_UDP_GLBSTATE = 0;
+  REG_OR(AT91C_CKGR_PLLR, AT91C_CKGR_USBDIV_1);
+  REG_WR(AT91C_PMC_SCER, AT91C_PMC_UDP);
+  REG_WR(AT91C_PMC_PCER, (1 << AT91C_ID_UDP));
+  REG_WR(AT91C_UDP_FADDR, 0);
+  REG_WR(AT91C_UDP_GLBSTATE, 0);
 
   /* Enable the UDP pull up by outputting a zero on PA.16 */
-  *AT91C_PIOA_PER = (1 << 16);
-  *AT91C_PIOA_OER = (1 << 16);
-  *AT91C_PIOA_CODR = (1 << 16);
-  *AT91C_UDP_IDR = ~0;
+  REG_WR(AT91C_PIOA_PER, (1 << 16));
+  REG_WR(AT91C_PIOA_OER, (1 << 16));
+  REG_WR(AT91C_PIOA_CODR, (1 << 16));
+  REG_WR(AT91C_UDP_IDR, ~0);
 
   /* Set up default state */
   reset();
 
 
-  *AT91C_UDP_IER = (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM);
+  REG_WR(AT91C_UDP_IER, (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM));
   if (i_state)
     interrupts_enable();
 }
 
-int udp_read(U8* buf, int off, int len)
+RAMFUNC static void udp_rx_end(void)
 {
-  // Perform a non-blocking read operation. We use double buffering (ping-pong)
-  // operation to provide better throughput.
-  //
-  int packetSize = 0, i, blockSize = 0, a=0;
-
-  if (configured != USB_CONFIGURED)
-     return -1;
+  // Queue the message being received for udp_read()
+  U32 slot = rxMsgHead & RING_MASK(UDP_MSG_QUEUE_SIZE);
 
-  if (len == 0)
-     return 0;
+  rxMsgLen[slot] = rxMsgKept;
+  rxMsgFrame[slot] = rxMsgSize;
+  rxMsgHead++;
+  rxMsgSize = rxMsgKept = rxMsgLength = 0;
+}
 
+RAMFUNC static void udp_rx_copy(U32 n, U32 keep)
+{
+  // Move n bytes from the EP1 FIFO into the receive ring, keeping the first
+  // keep of them
+  U32 pos = rxHead & RING_MASK(UDP_RX_RING_SIZE);
+  U32 first = MIN(keep, UDP_RX_RING_SIZE - pos);
+  U8 discard[8];
+
+  fifo_read(AT91C_UDP_FDR1, rxRing+pos, first);
+  fifo_read(AT91C_UDP_FDR1, rxRing, keep-first);
+  rxHead += keep;
+  rxMsgKept += keep;
+  rxMsgSize += n;
+
+  for (n -= keep; n; n -= MIN(n, sizeof(discard)))
+    fifo_read(AT91C_UDP_FDR1, discard, MIN(n, sizeof(discard)));
+}
 
-  while (1)
+RAMFUNC static int udp_rx_drain(void)
+{
+  // Drain every filled bank into the receive ring, splitting the byte stream
+  // into CCID messages. A message ends once the 10 + dwLength bytes its
+  // header declares are in, and whatever follows in the same packet starts
+  // the next one; a short packet ends the transfer and any message still
+  // incomplete with it. Only the first UDP_RX_MSG_MAX bytes of a message are
+  // kept, the rest is counted and dropped, so an oversize frame does not
+  // upset the framing of the ones after it. The header is taken a byte at
+  // a time for its dwLength, the body in one run up to the end of the
+  // message or packet. Runs from RAM and calls nothing in flash, so it can
+  // also be used while a flash page is programming.
+  // Returns 0 if a packet had to be left in its bank for lack of room.
+  U32 count, i, n;
+
+  while (REG_RD(AT91C_UDP_CSR1) & currentRxBank)
   {
-    if ( !((*AT91C_UDP_CSR1) & currentRxBank) )
-       break;
+    count = (REG_RD(AT91C_UDP_CSR1) & AT91C_UDP_RXBYTECNT) >> 16;
 
-    packetSize = ((*AT91C_UDP_CSR1) & AT91C_UDP_RXBYTECNT) >> 16;
+    if (UDP_RX_RING_SIZE - (rxHead - rxTail) < 64 ||
+        UDP_MSG_QUEUE_SIZE - (rxMsgHead - rxMsgTail) < UDP_MSG_PER_PACKET)
+      return 0;
 
-    if (packetSize + blockSize > len) {
-        packetSize = len - blockSize;
-    }
-    else
-    if (packetSize > len)
-       packetSize = len;
+    for (i=0;i<count;i+=n)
+    {
+      if (rxMsgSize < 10)
+      {
+        // the header is always kept
+        n = 1;
+        udp_rx_copy(1, 1);
 
-    // turns the USB activity ON
-    led_turnon();
-    systick_wait_ms(20);
+        // dwLength, little-endian in header bytes 1 to 4
+        if (rxMsgSize >= 2 && rxMsgSize <= 5)
+          rxMsgLength |= (U32)rxRing[(rxHead-1) & RING_MASK(UDP_RX_RING_SIZE)] << (8 * (rxMsgSize - 2));
+      }
+      else
+      {
+        n = MIN(count - i, rxMsgLength - (rxMsgSize - 10));
+        udp_rx_copy(n, rxMsgKept < UDP_RX_MSG_MAX ? MIN(n, UDP_RX_MSG_MAX - rxMsgKept) : 0);
+      }
 
-    for (i=0;i<packetSize;i++) {
-       buf[off+a++] = *AT91C_UDP_FDR1;
+      if (rxMsgSize >= 10 && rxMsgSize - 10 == rxMsgLength)
+        udp_rx_end();
     }
 
-    // Clear transmission flag and wait for the synchronization
-    while (*AT91C_UDP_CSR1 & currentRxBank)
-       *AT91C_UDP_CSR1 &= ~(currentRxBank);
-
-    // Flip bank
+    // Release the bank and flip to the other one
+    UDP_CLEAREPFLAGS_RAM(AT91C_UDP_CSR1, currentRxBank);
+    trace(TRACE_ISR, TRACE_RX_BANK, currentRxBank == AT91C_UDP_RX_DATA_BK1, count);
     currentRxBank = currentRxBank == AT91C_UDP_RX_DATA_BK0 ? AT91C_UDP_RX_DATA_BK1 : AT91C_UDP_RX_DATA_BK0;
 
-    blockSize += packetSize;
-
-
-    // turns the USB activity OFF
-    led_turnoff();
-    systick_wait_ms(20);
-
-    if (blockSize == len || packetSize < 64)
-       break;
+    if (count < 64 && rxMsgSize)
+      udp_rx_end();
+  }
 
-    systick_wait_ms(20);
+  return 1;
+}
 
+HOTFUNC static void udp_rx_isr(void)
+{
+  // No room: leave the packet in its bank, so the host is NAKed, and mask
+  // the endpoint until udp_read() has consumed a message.
+  if (!udp_rx_drain())
+  {
+    rxThrottled = 1;
+    REG_WR(AT91C_UDP_IDR, AT91C_UDP_EPINT1);
+    return;
   }
 
-  return blockSize;
+  // Finish a CLEAR_FEATURE(HALT) that had to wait for the banks to empty
+  if (delayedEnable)
+  {
+    REG_WR(AT91C_UDP_CSR1, (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT));
+    REG_OR(AT91C_UDP_RSTEP, AT91C_UDP_EP1);
+    REG_AND(AT91C_UDP_RSTEP, ~AT91C_UDP_EP1);
+    currentRxBank = AT91C_UDP_RX_DATA_BK0;
+    delayedEnable = 0;
+  }
 }
 
+RAMFUNC void udp_rx_poll(void)
+{
+  // Flash busy hook: keeps EP1 draining while a page programs with
+  // interrupts masked. The ISR picks up anything left once they are back on.
+  if (configured == USB_CONFIGURED)
+    udp_rx_drain();
+}
 
-int udp_write(U8* buf, int off, int len)
+HOTFUNC int udp_read(U8* buf, int off, int len)
 {
-  /* Perform a non-blocking write. Return the number of bytes actually
-   * written.
-   */
-  int i;
+  // Perform a non-blocking read operation. Copies one complete CCID message
+  // from the receive ring into buf (truncated to len bytes) and returns the
+  // size it had on the bus, which is more than len for an oversize frame, or
+  // 0 if none is waiting. The interrupt handler has already drained the
+  // ping-pong banks.
+  //
+  U32 size, frame, pos, first, start;
 
   if (configured != USB_CONFIGURED)
      return -1;
 
-  // Can we write ?
-  if ((*AT91C_UDP_CSR2 & AT91C_UDP_TXPKTRDY) != 0)
+  if (len == 0 || rxMsgHead == rxMsgTail)
      return 0;
 
-  // Limit to max transfer size
-  if (len > 64)
-     len = 64;
+  start = stats_start();
+  size = rxMsgLen[rxMsgTail & RING_MASK(UDP_MSG_QUEUE_SIZE)];
+  frame = rxMsgFrame[rxMsgTail & RING_MASK(UDP_MSG_QUEUE_SIZE)];
+  pos = rxTail & RING_MASK(UDP_RX_RING_SIZE);
+  len = MIN(size, len);
+  first = MIN(len, UDP_RX_RING_SIZE - pos);
 
-  for (i=0;i<len;i++)
-      *AT91C_UDP_FDR2 = buf[off+i];
+  memcpy(buf+off, rxRing+pos, first);
+  memcpy(buf+off+first, rxRing, len-first);
 
-  UDP_SETEPFLAGS(*AT91C_UDP_CSR2, AT91C_UDP_TXPKTRDY);
-  UDP_CLEAREPFLAGS(*AT91C_UDP_CSR2, AT91C_UDP_TXCOMP);
-  return len;
-}
+  rxTail += size;
+  rxMsgTail++;
 
- /* Perform a non-blocking write through the interrupt endpoint. Return the number of bytes actually
-  * written.
-  */
+  // Let the ISR pick up a packet it had to leave in the bank
+  if (rxThrottled)
+  {
+    rxThrottled = 0;
+    REG_WR(AT91C_UDP_IER, AT91C_UDP_EPINT1);
+  }
 
-int udp_write_interrupt_in(U8* buf, int len)
-{
-  int i;
+  // turns the USB activity ON
+  usb_activity_on();
 
-  if (configured != USB_CONFIGURED)
-     return -1;
+  stats_end(STATS_UDP_READ, start);
+  return MIN(frame, 0x7FFFFFFF);
+}
 
-  // Can we write ?
-  if ((*AT91C_UDP_CSR3 & AT91C_UDP_TXPKTRDY) != 0)
-     return 0;
+HOTFUNC static int udp_tx_load(void)
+{
+  // Load the next packet into a free EP2 bank. A message is split into
+  // 64-byte packets and ends with a short packet, or with a zero-length
+  // packet when its size is an exact multiple of 64.
+  U32 size, n, pos, first;
+  U8 ends;
 
-  // Limit to max transfer size
-  if (len > 8)
-     len = 8;
+  if (txLoadMsg == txMsgHead)
+     return 0;
 
-  for (i=0;i<len;i++)
-      *AT91C_UDP_FDR3 = buf[i];
+  size = txMsgLen[txLoadMsg & RING_MASK(UDP_MSG_QUEUE_SIZE)];
+  n = MIN(size - txLoadSent, 64);
 
-  UDP_SETEPFLAGS(*AT91C_UDP_CSR3, AT91C_UDP_TXPKTRDY);
-  UDP_CLEAREPFLAGS(*AT91C_UDP_CSR3, AT91C_UDP_TXCOMP);
-  return len;
-}
+  // at most two runs, either side of the end of the ring
+  pos = txLoadPos & RING_MASK(UDP_TX_RING_SIZE);
+  first = MIN(n, UDP_TX_RING_SIZE - pos);
+  fifo_write(AT91C_UDP_FDR2, txRing+pos, first);
+  fifo_write(AT91C_UDP_FDR2, txRing, n-first);
 
+  txLoadPos += n;
+  txLoadSent += n;
+  ends = (n < 64);
+  if (ends)
+  {
+    txLoadMsg++;
+    txLoadSent = 0;
+  }
 
-static void udp_send_null()
-{
-  UDP_SETEPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
+  txBankEnds[(txBankFirst + txBanks) & 1] = ends;
+  txBanks++;
+  return 1;
 }
 
-static void udp_send_stall()
+HOTFUNC static void udp_tx_pump(void)
 {
-  UDP_SETEPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_FORCESTALL);
+  // Keep both banks busy: the first one is sent as soon as it is loaded, the
+  // second is only filled here and released by udp_tx_isr(). Called from the
+  // ISR, or with interrupts disabled.
+  if (txBanks == 0 && udp_tx_load())
+     UDP_SETEPFLAGS(AT91C_UDP_CSR2, AT91C_UDP_TXPKTRDY);
+
+  if (txBanks == 1)
+     udp_tx_load();
 }
 
-static void udp_send_control(U8* p, int len)
+HOTFUNC static void udp_tx_isr(void)
 {
-  outPtr = p;
-  outCnt = len;
-  int i;
-
-  // Start sending the first part of the data...
-  for (i=0; i<8 && i<outCnt; i++)
-      *AT91C_UDP_FDR0 = outPtr[i];
+  if (!(REG_RD(AT91C_UDP_CSR2) & AT91C_UDP_TXCOMP))
+     return;
 
-  UDP_SETEPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
-}
+  UDP_CLEAREPFLAGS(AT91C_UDP_CSR2, AT91C_UDP_TXCOMP);
 
-static void udp_enumerate()
-{
-  U8 bt, br;
-  int req, len, ind, val;
-  short status;
+  if (txBanks == 0)
+     return;
 
-  // First we deal with any completion states.
-  if ((*AT91C_UDP_CSR0) & AT91C_UDP_TXCOMP)
+  // Retire the head message once its last packet has gone
+  if (txBankEnds[txBankFirst])
   {
-    // Write operation has completed.
-    // Send config data if needed. Send a zero length packet to mark the
-    // end of the data if an exact multiple of 8.
-    if (outCnt >= 8)
-    {
-      outCnt -= 8;
-      outPtr += 8;
-      int i;
-      // Send next part of the data
-      for (i=0;i<8 && i<outCnt;i++)
-        *AT91C_UDP_FDR0 = outPtr[i];
-      UDP_SETEPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
-    }
-    else
-      outCnt = 0;
-
-    // Clear the state
-    UDP_CLEAREPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_TXCOMP);
-    if (newAddress >= 0)
-    {
-      // Set new address
-      *AT91C_UDP_FADDR = (AT91C_UDP_FEN | newAddress);
-      *AT91C_UDP_GLBSTATE  = (newAddress) ? AT91C_UDP_FADDEN : 0;
-      newAddress = -1;
-    }
+    txTail += txMsgLen[txMsgTail & RING_MASK(UDP_MSG_QUEUE_SIZE)];
+    txMsgTail++;
   }
+  trace(TRACE_ISR, TRACE_TXCOMP, txBanks - 1, txBankEnds[txBankFirst]);
+  txBankFirst ^= 1;
+  txBanks--;
 
-  if ((*AT91C_UDP_CSR0) & (AT91C_UDP_RX_DATA_BK0))
-  {
-    // Got Transfer complete ack
-    // Clear the state
-    UDP_CLEAREPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_RX_DATA_BK0);
-  }
+  // Send the packet waiting in the other bank, then refill
+  if (txBanks)
+     UDP_SETEPFLAGS(AT91C_UDP_CSR2, AT91C_UDP_TXPKTRDY);
 
-  if (*AT91C_UDP_CSR0 & AT91C_UDP_ISOERROR)
-  {
-    // Clear the state
-    UDP_CLEAREPFLAGS(*AT91C_UDP_CSR0, (AT91C_UDP_ISOERROR|AT91C_UDP_FORCESTALL));
-  }
+  udp_tx_pump();
+}
 
-  //display_goto_xy(12,3);
-  //display_string("E1");
+void udp_tx_restart(void)
+{
+  // The EP2 FIFO was flushed: send the head message again from the start
+  txBanks = 0;
+  txBankFirst = 0;
+  txLoadMsg = txMsgTail;
+  txLoadPos = txTail;
+  txLoadSent = 0;
+  udp_tx_pump();
+}
 
-  if (!((*AT91C_UDP_CSR0) & AT91C_UDP_RXSETUP))
-     return;
+HOTFUNC int udp_writev(const udp_seg *seg, int nseg)
+{
+  /* Queue one message for the bulk-IN endpoint, made of nseg pieces copied
+   * straight into the transmit ring; it is sent as many packets as needed.
+   * Return the number of bytes queued, or 0 if the transmit ring is full.
+   */
+  U32 pos, first, head;
+  int len = 0, i, i_state;
 
-  bt = *AT91C_UDP_FDR0;
-  br = *AT91C_UDP_FDR0;
-  val = ((*AT91C_UDP_FDR0 & 0xFF) | (*AT91C_UDP_FDR0 << 8));
-  ind = ((*AT91C_UDP_FDR0 & 0xFF) | (*AT91C_UDP_FDR0 << 8));
-  len = ((*AT91C_UDP_FDR0 & 0xFF) | (*AT91C_UDP_FDR0 << 8));
+  if (configured != USB_CONFIGURED)
+     return -1;
 
-  if (bt & 0x80)
-  {
-    UDP_SETEPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_DIR);
-  }
+  for (i = 0; i < nseg; i++)
+    len += seg[i].len;
 
-  UDP_CLEAREPFLAGS(*AT91C_UDP_CSR0, AT91C_UDP_RXSETUP);
+  if (len > UDP_TX_MSG_MAX)
+     return -1;
 
-  req = br << 8 | bt;
+  if (UDP_TX_RING_SIZE - (txHead - txTail) < len ||
+      txMsgHead - txMsgTail == UDP_MSG_QUEUE_SIZE)
+     return 0;
 
-  switch(req)
+  head = txHead;
+  for (i = 0; i < nseg; i++)
   {
-    // Here we treat the class specific requests first.
-    // Begin of class specific requests
-    case ABORT_COMMAND:
-        break;
-
-    case GET_CLOCK_FREQUENCIES_COMMAND:
-        // this will send data through the Control endpoint
-        udp_send_control((U8*)clock_frequency, 16);
-        break;
-
-    case GET_DATA_RATES_COMMAND:
-        // this will send data through the Control Endpoint
-        udp_send_control((U8*)data_rate, 40);
-
-        // Now inform the host driver, through the interrupt endpoint,
-        // that a card has been inserted
-        udp_write_interrupt_in((U8*)cardInserted, 2);
-        break;
-    // End of class specific requests
-
-    case STD_GET_DESCRIPTOR:
-      if (val == 0x100) // Get device descriptor
-      {
-        udp_send_control((U8 *)dd, MIN(sizeof(dd), len));
-      }
-      else
-      if (val == 0x200) // Configuration descriptor
-      {
-        udp_send_control((U8 *)cfd, MIN(sizeof(cfd), len));
-        //if (len > sizeof(cfd)) udp_send_null();
-      }
-      else
-      if ((val & 0xF00) == 0x300)
-      {
-        switch(val & 0xFF)
-        {
-          case 0x00:
-            udp_send_control((U8 *)ld, MIN(sizeof(ld), len));
-            break;
-          case 0x01:        // serial number string descriptor
-            udp_send_control(snd, MIN(sizeof(snd), len));
-            break;
-          case 0x02:        // manufacturer string descriptor
-            udp_send_control(manufacturer, MIN(sizeof(manufacturer), len));
-            break;
-          case 0x03:        // product string descriptor
-            udp_send_control(product, MIN(sizeof(product), len));
-            break;
-          default:
-            udp_send_stall();
-        }
-      }
-      else
-      {
-        udp_send_stall();
-      }
-      break;
-
-    case STD_SET_ADDRESS:
-      newAddress = val;
-      udp_send_null();
-      break;
-
-    case STD_SET_CONFIGURATION:
-      configured = (val ? USB_CONFIGURED : USB_READY);
-      currentConfig = val;
-      udp_send_null();
-      *AT91C_UDP_GLBSTATE  = (val) ? AT91C_UDP_CONFG : AT91C_UDP_FADDEN;
-      delayedEnable = 0;
-      *AT91C_UDP_CSR1 = (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT) : 0;
-      *AT91C_UDP_CSR2 = (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_IN)  : 0;
-      *AT91C_UDP_CSR3 = (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_INT_IN)   : 0;
-
-      break;
-
-    case STD_SET_FEATURE_ENDPOINT:
-      ind &= 0x0F;
+    pos = head & RING_MASK(UDP_TX_RING_SIZE);
+    first = MIN(seg[i].len, UDP_TX_RING_SIZE - pos);
+    memcpy(txRing+pos, seg[i].data, first);
+    memcpy(txRing, seg[i].data+first, seg[i].len-first);
+    head += seg[i].len;
+  }
 
-      if ((val == 0) && ind && (ind <= 3))
-      {
-        switch (ind)
-        {
-          case 1:
-            (*AT91C_UDP_CSR1) = 0;
-            delayedEnable = 0;
-            break;
-          case 2:
-            (*AT91C_UDP_CSR2) = 0;
-            break;
-          case 3:
-            (*AT91C_UDP_CSR3) = 0;
-            break;
-        }
-        udp_send_null();
-      }
-      else
-        udp_send_stall();
-      break;
+  txMsgLen[txMsgHead & RING_MASK(UDP_MSG_QUEUE_SIZE)] = len;
+  txHead = head;
+  txMsgHead++;
 
-    case STD_CLEAR_FEATURE_ENDPOINT:
-      ind &= 0x0F;
+  // Start the transfer if a bank is free
+  i_state = interrupts_get_and_disable();
+  udp_tx_pump();
+  if (i_state)
+    interrupts_enable();
 
-      if ((val == 0) && ind && (ind <= 3))
-      {
-        // Enable and reset the end point
-        if (ind == 1) {
-          // We need to take special care for the input end point because
-          // we may have data in the hardware buffer. If we do then the reset
-          // will cause this to be lost. To prevent this loss we delay the
-          // enable until the data has been read.
-          if (((*AT91C_UDP_CSR1) & AT91C_UDP_RXBYTECNT) == 0)
-          {
-            (*AT91C_UDP_CSR1) = (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT);
-            (*AT91C_UDP_RSTEP) |= AT91C_UDP_EP1;
-            (*AT91C_UDP_RSTEP) &= ~AT91C_UDP_EP1;
-            delayedEnable = 0;
-          }
-          else
-          {
-            // Use delayed anable. We also force the ep disabled to prevent
-            // any I/O using the wrong data toggle.
-            (*AT91C_UDP_CSR1) &= ~AT91C_UDP_EPEDS;
-            delayedEnable = 1;
-          }
-        }
-        else
-        if (ind == 2)
-        {
-          (*AT91C_UDP_CSR2) = (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_IN);
-          (*AT91C_UDP_RSTEP) |= AT91C_UDP_EP2;
-          (*AT91C_UDP_RSTEP) &= ~AT91C_UDP_EP2;
-        }
-        else
-        if (ind == 3)
-        {
-          (*AT91C_UDP_CSR3) = (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_INT_IN);
-          (*AT91C_UDP_RSTEP) |= AT91C_UDP_EP3;
-          (*AT91C_UDP_RSTEP) &= ~AT91C_UDP_EP3;
-        }
-        udp_send_null();
-      }
-      else
-        udp_send_stall();
+  return len;
+}
 
-      break;
+int udp_write(U8* buf, int off, int len)
+{
+  /* Queue one message for the bulk-IN endpoint from buf+off; see
+   * udp_writev().
+   */
+  udp_seg seg;
 
-    case STD_GET_CONFIGURATION:
-      udp_send_control((U8 *) &(currentConfig), MIN(sizeof(currentConfig), len));
-      break;
+  seg.data = buf+off;
+  seg.len = len;
+  return udp_writev(&seg, 1);
+}
 
-    case STD_GET_STATUS_ZERO:
-      status = 0x01;
-      udp_send_control((U8 *) &status, MIN(sizeof(status), len));
-      break;
+HOTFUNC int udp_writev_timeout(const udp_seg *seg, int nseg, U32 timeout)
+{
+  /* Like udp_writev(), but waits up to timeout ms for room in the transmit
+   * ring while earlier messages drain.
+   */
+  U32 deadline = systick_deadline_ms(timeout);
+  int ret;
 
-    case STD_GET_STATUS_INTERFACE:
-      status = 0;
-      udp_send_control((U8 *) &status, MIN(sizeof(status), len));
-      break;
+  while ((ret = udp_writev(seg, nseg)) == 0 && !systick_ms_expired(deadline))
+    ;
+  return ret;
+}
 
-    case STD_GET_STATUS_ENDPOINT:
-      status = 0;
-      ind &= 0x0F;
+int udp_write_timeout(U8* buf, int off, int len, U32 timeout)
+{
+  udp_seg seg;
 
-      if (((*AT91C_UDP_GLBSTATE) & AT91C_UDP_CONFG) && (ind <= 3))
-      {
-        switch (ind)
-        {
-          case 1:
-            status = ((*AT91C_UDP_CSR1) & AT91C_UDP_EPEDS) ? 0 : 1;
-            break;
-          case 2:
-            status = ((*AT91C_UDP_CSR2) & AT91C_UDP_EPEDS) ? 0 : 1;
-            break;
-          case 3:
-            status = ((*AT91C_UDP_CSR3) & AT91C_UDP_EPEDS) ? 0 : 1;
-            break;
-        }
-        udp_send_control((U8 *) &status, MIN(sizeof(status), len));
-      }
-      else
-      if ( ((*AT91C_UDP_GLBSTATE) & AT91C_UDP_FADDEN) && (ind == 0) )
-      {
-        status = ((*AT91C_UDP_CSR0) & AT91C_UDP_EPEDS) ? 0 : 1;
-        udp_send_control((U8 *) &status, MIN(sizeof(status), len));
-      }
-      else
-        udp_send_stall();                                // Illegal request :-(
-
-      break;
-
-    case VENDOR_SET_FEATURE_INTERFACE:
-      ind &= 0xf;
-      currentFeatures |= (1 << ind);
-      udp_send_null();
-      break;
-
-    case VENDOR_CLEAR_FEATURE_INTERFACE:
-      ind &= 0xf;
-      currentFeatures &= ~(1 << ind);
-      udp_send_null();
-      break;
-
-    case VENDOR_GET_DESCRIPTOR:
-      udp_send_control((U8 *)named, MIN(named[0], len));
-      break;
-
-    case STD_SET_FEATURE_INTERFACE:
-    case STD_CLEAR_FEATURE_INTERFACE:
-      udp_send_null();
-      break;
-
-    case STD_SET_INTERFACE:
-    case STD_SET_FEATURE_ZERO:
-    case STD_CLEAR_FEATURE_ZERO:
-    default:
-      udp_send_stall();
-  }
-  
+  seg.data = buf+off;
+  seg.len = len;
+  return udp_writev_timeout(&seg, 1, timeout);
 }
 
-void udp_isr_C(void)
+HOTFUNC void udp_isr_C(void)
 {
   /* Process interrupts. We mainly use these during the configuration and
    * enumeration stages.
@@ -806,46 +538,54 @@ void udp_isr_C(void)
   if (configured & USB_DISABLED)
      return;
 
-  if (*AT91C_UDP_ISR & END_OF_BUS_RESET)
+  if (REG_RD(AT91C_UDP_ISR) & END_OF_BUS_RESET)
   {
-    *AT91C_UDP_ICR = END_OF_BUS_RESET;
-    *AT91C_UDP_ICR = SUSPEND_RESUME;
-    *AT91C_UDP_ICR = WAKEUP;
-    *AT91C_UDP_RSTEP = 0xFFFFFFFF;
-    *AT91C_UDP_RSTEP = 0x0;
-    *AT91C_UDP_FADDR = AT91C_UDP_FEN;
+    REG_WR(AT91C_UDP_ICR, END_OF_BUS_RESET);
+    REG_WR(AT91C_UDP_ICR, SUSPEND_RESUME);
+    REG_WR(AT91C_UDP_ICR, WAKEUP);
+    REG_WR(AT91C_UDP_RSTEP, 0xFFFFFFFF);
+    REG_WR(AT91C_UDP_RSTEP, 0x0);
+    REG_WR(AT91C_UDP_FADDR, AT91C_UDP_FEN);
+    REG_WR(AT91C_UDP_IDR, (AT91C_UDP_EPINT1 | AT91C_UDP_EPINT2));
     reset();
-    UDP_SETEPFLAGS(*AT91C_UDP_CSR0,(AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_CTRL));
-    *AT91C_UDP_IER = (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM);
+    UDP_SETEPFLAGS(AT91C_UDP_CSR0,(AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_CTRL));
+    REG_WR(AT91C_UDP_IER, (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM));
     return;
   }
 
-  if (*AT91C_UDP_ISR & SUSPEND_INT)
+  if (REG_RD(AT91C_UDP_ISR) & SUSPEND_INT)
   {
     if (configured == USB_CONFIGURED)
        configured = USB_SUSPENDED;
     else
        configured = USB_READY;
-    *AT91C_UDP_ICR = SUSPEND_INT;
+    REG_WR(AT91C_UDP_ICR, SUSPEND_INT);
     currentRxBank = AT91C_UDP_RX_DATA_BK0;
   }
 
-  if (*AT91C_UDP_ISR & SUSPEND_RESUME)
+  if (REG_RD(AT91C_UDP_ISR) & SUSPEND_RESUME)
   {
     if (configured == USB_SUSPENDED)
        configured = USB_CONFIGURED;
     else
        configured = USB_READY;
-    *AT91C_UDP_ICR = WAKEUP;
-    *AT91C_UDP_ICR = SUSPEND_RESUME;
+    REG_WR(AT91C_UDP_ICR, WAKEUP);
+    REG_WR(AT91C_UDP_ICR, SUSPEND_RESUME);
   }
 
-  if (*AT91C_UDP_ISR & AT91C_UDP_EPINT0)
+  if (REG_RD(AT91C_UDP_ISR) & AT91C_UDP_EPINT0)
   {
-    *AT91C_UDP_ICR = AT91C_UDP_EPINT0;
+    REG_WR(AT91C_UDP_ICR, AT91C_UDP_EPINT0);
     udp_enumerate();
   }
 
+  // Bulk data. The endpoint interrupts clear with their CSR flags.
+  if (REG_RD(AT91C_UDP_ISR) & REG_RD(AT91C_UDP_IMR) & AT91C_UDP_EPINT1)
+    udp_rx_isr();
+
+  if (REG_RD(AT91C_UDP_ISR) & REG_RD(AT91C_UDP_IMR) & AT91C_UDP_EPINT2)
+    udp_tx_isr();
+
 }
 
 int udp_status()
@@ -861,9 +601,9 @@ int udp_status()
 
   if (configured == USB_CONFIGURED)
   {
-    if ((*AT91C_UDP_CSR1) & currentRxBank)
+    if (rxMsgHead != rxMsgTail)
        ret |= USB_READABLE;
-    if ((*AT91C_UDP_CSR2 & AT91C_UDP_TXPKTRDY) == 0)
+    if (UDP_TX_RING_SIZE - (txHead - txTail) >= 64 && txMsgHead - txMsgTail < UDP_MSG_QUEUE_SIZE)
        ret |= USB_WRITEABLE;
   }
 
@@ -889,7 +629,7 @@ void udp_enable(int reset)
   aic_mask_off(AT91C_PERIPHERAL_ID_UDP);
   aic_set_vector(AT91C_PERIPHERAL_ID_UDP, AIC_INT_LEVEL_LOWEST, (U32) udp_isr_entry);
   aic_mask_on(AT91C_PERIPHERAL_ID_UDP);
-  *AT91C_UDP_IER = (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM);
+  REG_WR(AT91C_UDP_IER, (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM));
   reset = reset || (configured & USB_NEEDRESET);
   configured &= ~USB_DISABLED;
 
@@ -905,7 +645,7 @@ void udp_disable()
   /* Disable processing of USB requests */
   int i_state = interrupts_get_and_disable();
   aic_mask_off(AT91C_PERIPHERAL_ID_UDP);
-  *AT91C_UDP_IDR = (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM);
+  REG_WR(AT91C_UDP_IDR, (AT91C_UDP_EPINT0 | AT91C_UDP_RXSUSP | AT91C_UDP_RXRSM));
   configured |= USB_DISABLED;
   currentFeatures = 0;
 
@@ -917,24 +657,6 @@ void udp_disable()
     #endif
 }
 
-void udp_set_serialno(U8 *serNo, int len)
-{
-  /* Set the USB serial number. serNo should point to a 12 character
-   * Unicode string, containing the USB serial number.
-   */
-  if (len == (sizeof(snd)-2)/2)
-    memcpy(snd+2, serNo, len*2);
-}
-
-void udp_set_name(U8 *name, int len)
-{
-  if (len <= (sizeof(named)-2)/2)
-  {
-    memcpy(named+2, name, len*2);
-    named[0] = len*2 + 2;
-  }
-}
-
 
 #if REMOTE_CONSOLE
 void udp_rconsole(U8 *buf, int cnt)
@@ -942,7 +664,6 @@ void udp_rconsole(U8 *buf, int cnt)
   if (!rConsole)
      return;
 
-  while (udp_write(buf, 0, cnt) == 0)
-    ;
+  udp_write_timeout(buf, 0, cnt, USB_TIMEOUT);
 }
 #endif
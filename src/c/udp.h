@@ -2,25 +2,39 @@
 #  define __UDP_H__
 
 #  include "mytypes.h"
+#  include "ramfunc.h"
 
 void udp_isr_C(void);
 int udp_init(void);
 void udp_disable(void);
 void udp_enable(int reset);
 void udp_reset(void);
+
+/* One piece of a message for udp_writev(); data may point anywhere the CPU
+ * can read, memory mapped flash included.
+ */
+typedef struct {
+  const U8 *data;
+  int len;
+} udp_seg;
+
 int udp_write(U8* buf, int off, int len);
+int udp_write_timeout(U8* buf, int off, int len, U32 timeout);
+int udp_writev(const udp_seg *seg, int nseg);
+int udp_writev_timeout(const udp_seg *seg, int nseg, U32 timeout);
 int udp_read(U8* buf, int off, int len);
+RAMFUNC void udp_rx_poll(void);
 int udp_status();
 void udp_set_serialno(U8 *serNo, int len);
 void udp_set_name(U8 *name, int len);
 void udp_rconsole(U8* buf, int len);
-void systick_wait_ms(int unit);
 void led_turnon();
 void led_turnoff();
 void usb_activity_on();
 void usb_activity_off();
+void usb_activity_poll();
 
-#define USB_TIMEOUT      0x0BB8
+#define USB_TIMEOUT      0x0BB8     // ms
 #define SUSPEND_INT      ((unsigned int) 0x1 << 8)
 #define SUSPEND_RESUME   ((unsigned int) 0x1 << 9)
 #define END_OF_BUS_RESET ((unsigned int) 0x1 << 12)
@@ -83,6 +97,8 @@ void usb_activity_off();
 #define RDR_TO_PC_DATABLOCK				0x80
 #define RDR_TO_PC_SLOTSTATUS			0x81
 #define RDR_TO_PC_PARAMETERS			0x82
+#define RDR_TO_PC_ESCAPE				0x83
+#define RDR_TO_PC_DATARATEANDCLOCK		0x84
 
 #define DATA_SIZE 						16
 #define DATA_BASE_ADDRESS				0x13FF00	// Start of last page on the flash for the SAM7S256
@@ -0,0 +1,572 @@
+/* USB control endpoint: the descriptors and the standard and CCID class
+ * requests on EP0, answered from udp_isr_C(). None of this is on the bulk
+ * data path, so the code profiles build it for Thumb (see the Makefile).
+ */
+
+#include "mytypes.h"
+#include "udp.h"
+#include "AT91SAM7.h"
+#include "hal.h"
+#include "timer.h"
+#include "udp_ctrl.h"
+#include "trace.h"
+#include <string.h>
+
+static int newAddress;
+static U8 *outPtr;
+static U32 outCnt;
+
+/*
+    Card control variables
+*/
+unsigned int clock_frequency[] = {4000, 4800, 6000, 8000};
+unsigned int data_rate[] = {10752, 12903, 21505, 25806, 43010, 86021, 129032, 172053, 215053, 344086};
+unsigned char cardInserted[] = {0x50, 0x03};
+unsigned char return_data[DATA_SIZE];
+
+// Device descriptor
+static const U8 dd[] = {
+  0x12, // size of this descriptor
+  0x01, // type of descriptor (DEVICE)
+  0x00, // USB version
+  0x02, // USB version
+  0x00, // class
+  0x00, // subclass
+  0x00, // protocol
+  0x08, // control endpoint data size
+  0xEB, // VENDOORID byte 1
+  0x03, // VENDOORID byte 2
+  0x34, // PRODUCTID byte 1
+  0x12, // PRODUCTID byte 2
+  0x00, // RELEASE byte 1
+  0x00, // RELEASE byte 2
+  0x02, // Index of manufacturer description
+  0x03, // Index of product description
+  0x01, // Index of serial number description
+  0x01  // One possible configuration
+};
+
+// Configuration descriptor
+static const U8 cfd[] =
+{
+  0x09, // size
+  0x02, // configuration type
+  0x5D, // size byte 1
+  0x00, // size byte 2
+  0x01, // There is one interface in this configuration
+  0x01, // This is configuration #1
+  0x00, // No string descriptor for this configuration
+  BUSPOWERED_NOREMOTEWAKEUP, // bmAttributes
+  50, // power (50 means 100mA)
+
+// Interface descriptor
+  0x09, // size
+  0x04, // type of descriptor (INTERFACE)
+  0x00, // This is interface #0
+  0x00, // This is alternate setting #0
+  0x03, // number of endpoints used (1 out, 1 in, 1 interrupt)
+  0x0B, // CLASS
+  0x00, // SUBCLASS
+  0x00, // PROTOCOL
+  0x00, // associated string descriptor
+
+// CCID class specific descriptor
+  0x36,                 // (bLength*) Size of this description
+  0x21,                 // (bDescriptorType*) Description type
+  0x00, 0x01,           // (bcdCCID*) version 1.00
+  0x00,                 // (bMaxSlotIndex*)
+  0x01,                 // (bVoltageSupport) 01h indicates 5.0 volts
+  0x01,0x00,0x00,0x00,  // (dwProtocols*) upper word (PPPP) must be 0. Lower word indicates support for T0 and T1 (bit 1 and 2)
+  0x00,0x48,0x00,0x00,  // dwDefaultClock (18.432Mhz given in Khz), not used in v1.00, fixed for legacy reasons
+  0x00,0x48,0x00,0x00,  // dwMaximumClock (18.432Mhz given in Khz), not used in v1.00, fixed for legacy reasons
+  0x04,                 // bNumClockSupported => no manual setting
+  0x00,0x2A,0x00,0x00,  // (10752) dwDataRate
+  0xE7,0x4C,0x06,0x00,  // (412903) dwMaxDataRate
+  0x0A,                 // bNumDataRatesSupported
+  0xFE,0x00,0x00,0x00,  // dwMaxIFSD
+  0x07,0x00,0x00,0x00,  // dwSynchProtocols
+  0x00,0x00,0x00,0x00,  // dwMechanical
+  0xB2,0x07,0x04,0x00,  // dwFeatures: extended APDU level exchange
+  0x0F,0x01,0x00,0x00,  // dwMaxCCIDMessageLength (271)
+  0xFF,                 // bClassGetResponse
+  0xFF,                 // bClassEnvelope
+  0x00,0x00,            // wLcdLayout
+  0x00,                 // bPINSupport
+  0x01,                 // bMaxCCIDBusySlots
+
+// Endpoint descriptors
+  0x07, // size
+  0x05, // type of configuration (ENDPOINT)
+  0x01, // endpoint number and direction (OUT)
+  0x02, // type of endpoint (BULK)
+  64,   // endpoint data size byte 1
+  0x00, // endpoint data size byte 2
+  0x00, // interval
+
+  0x07, // size
+  0x05, // type of configuration (ENDPOINT)
+  0x82, // endpoint number and direction (IN)
+  0x02, // type of endpoint (BULK)
+  64,   // endpoint data size byte 1
+  0x00, // endpoint data size byte 2
+  0x00, // interval
+
+  0x07, // size
+  0x05, // type of configuration (ENDPOINT)
+  0x83, // endpoint number and direction (IN)
+  0x03, // type of endpoint (INTERRUPT)
+  8,    // endpoint data size byte 1
+  0x00, // endpoint data size byte 2
+  0x18  // interval
+};
+
+
+// Serial Number Descriptor
+static U8 snd[] =
+{
+      0x1A,           // Descriptor length
+      0x03,           // Descriptor type 3 == string
+      0x31, 0x00,     // MSD of Lap (Lap[2,3]) in UNICode
+      0x32, 0x00,     // Lap[4,5]
+      0x33, 0x00,     // Lap[6,7]
+      0x34, 0x00,     // Lap[8,9]
+      0x35, 0x00,     // Lap[10,11]
+      0x36, 0x00,     // Lap[12,13]
+      0x37, 0x00,     // Lap[14,15]
+      0x38, 0x00,     // LSD of Lap (Lap[16,17]) in UNICode
+      0x30, 0x00,     // MSD of Nap (Nap[18,19]) in UNICode
+      0x30, 0x00,     // LSD of Nap (Nap[20,21]) in UNICode
+      0x39, 0x00,     // MSD of Uap in UNICode
+      0x30, 0x00      // LSD of Uap in UNICode
+};
+
+// Name descriptor, we allow up to 16 unicode characters
+static U8 named[] =
+{
+      0x08,           // Descriptor length
+      0x03,           // Descriptor type 3 == string
+      0x6e, 0x00,     // n
+      0x78, 0x00,     // x
+      0x74, 0x00,     // t
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00,
+      0x00, 0x00
+};
+
+// Manufacturer string descriptor
+static U8 manufacturer[] =
+{
+      0x16,           // Descriptor length
+      0x03,           // Descriptor type 3 == string
+      'B', 0x00,
+      'l', 0x00,
+      'u', 0x00,
+      'e', 0x00,
+      ' ', 0x00,
+      'R', 0x00,
+      'i', 0x00,
+      'v', 0x00,
+      'e', 0x00,
+      'r', 0x00
+};
+
+// Product string descriptor
+static U8 product[] =
+{
+      0x0E,           // Descriptor length
+      0x03,           // Descriptor type 3 == string
+      'V', 0x00,
+      '-', 0x00,
+      'C', 0x00,
+      'a', 0x00,
+      'r', 0x00,
+      'd', 0x00
+};
+
+
+static const U8 ld[] = {0x04,0x03,0x09,0x04}; // Language descriptor
+
+
+void udp_ctrl_reset(void)
+{
+  newAddress = -1;
+  outCnt = 0;
+}
+
+ /* Perform a non-blocking write through the interrupt endpoint. Return the number of bytes actually
+  * written.
+  */
+
+int udp_write_interrupt_in(U8* buf, int len)
+{
+  int i;
+
+  if (configured != USB_CONFIGURED)
+     return -1;
+
+  // Can we write ?
+  if ((REG_RD(AT91C_UDP_CSR3) & AT91C_UDP_TXPKTRDY) != 0)
+     return 0;
+
+  // Limit to max transfer size
+  if (len > 8)
+     len = 8;
+
+  for (i=0;i<len;i++)
+      REG_WR(AT91C_UDP_FDR3, buf[i]);
+
+  UDP_SETEPFLAGS(AT91C_UDP_CSR3, AT91C_UDP_TXPKTRDY);
+  UDP_CLEAREPFLAGS(AT91C_UDP_CSR3, AT91C_UDP_TXCOMP);
+  return len;
+}
+
+
+static void udp_send_null()
+{
+  UDP_SETEPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
+}
+
+static void udp_send_stall()
+{
+  UDP_SETEPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_FORCESTALL);
+}
+
+static void udp_send_control(U8* p, int len)
+{
+  outPtr = p;
+  outCnt = len;
+  int i;
+
+  // Start sending the first part of the data...
+  for (i=0; i<8 && i<outCnt; i++)
+      REG_WR(AT91C_UDP_FDR0, outPtr[i]);
+
+  UDP_SETEPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
+}
+
+void udp_enumerate()
+{
+  U8 bt, br;
+  int req, len, ind, val;
+  short status;
+
+  // First we deal with any completion states.
+  if (REG_RD(AT91C_UDP_CSR0) & AT91C_UDP_TXCOMP)
+  {
+    // Write operation has completed.
+    // Send config data if needed. Send a zero length packet to mark the
+    // end of the data if an exact multiple of 8.
+    if (outCnt >= 8)
+    {
+      outCnt -= 8;
+      outPtr += 8;
+      int i;
+      // Send next part of the data
+      for (i=0;i<8 && i<outCnt;i++)
+        REG_WR(AT91C_UDP_FDR0, outPtr[i]);
+      UDP_SETEPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_TXPKTRDY);
+    }
+    else
+      outCnt = 0;
+
+    // Clear the state
+    UDP_CLEAREPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_TXCOMP);
+    if (newAddress >= 0)
+    {
+      // Set new address
+      REG_WR(AT91C_UDP_FADDR, (AT91C_UDP_FEN | newAddress));
+      REG_WR(AT91C_UDP_GLBSTATE, (newAddress) ? AT91C_UDP_FADDEN : 0);
+      newAddress = -1;
+    }
+  }
+
+  if (REG_RD(AT91C_UDP_CSR0) & (AT91C_UDP_RX_DATA_BK0))
+  {
+    // Got Transfer complete ack
+    // Clear the state
+    UDP_CLEAREPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_RX_DATA_BK0);
+  }
+
+  if (REG_RD(AT91C_UDP_CSR0) & AT91C_UDP_ISOERROR)
+  {
+    // Clear the state
+    UDP_CLEAREPFLAGS(AT91C_UDP_CSR0, (AT91C_UDP_ISOERROR|AT91C_UDP_FORCESTALL));
+  }
+
+  //display_goto_xy(12,3);
+  //display_string("E1");
+
+  if (!(REG_RD(AT91C_UDP_CSR0) & AT91C_UDP_RXSETUP))
+     return;
+
+  bt = REG_RD(AT91C_UDP_FDR0);
+  br = REG_RD(AT91C_UDP_FDR0);
+  val = ((REG_RD(AT91C_UDP_FDR0) & 0xFF) | (REG_RD(AT91C_UDP_FDR0) << 8));
+  ind = ((REG_RD(AT91C_UDP_FDR0) & 0xFF) | (REG_RD(AT91C_UDP_FDR0) << 8));
+  len = ((REG_RD(AT91C_UDP_FDR0) & 0xFF) | (REG_RD(AT91C_UDP_FDR0) << 8));
+  trace(TRACE_ISR, TRACE_SETUP, br, val);
+
+  if (bt & 0x80)
+  {
+    UDP_SETEPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_DIR);
+  }
+
+  UDP_CLEAREPFLAGS(AT91C_UDP_CSR0, AT91C_UDP_RXSETUP);
+
+  req = br << 8 | bt;
+
+  switch(req)
+  {
+    // Here we treat the class specific requests first.
+    // Begin of class specific requests
+    case ABORT_COMMAND:
+        break;
+
+    case GET_CLOCK_FREQUENCIES_COMMAND:
+        // this will send data through the Control endpoint
+        udp_send_control((U8*)clock_frequency, 16);
+        break;
+
+    case GET_DATA_RATES_COMMAND:
+        // this will send data through the Control Endpoint
+        udp_send_control((U8*)data_rate, 40);
+
+        // Now inform the host driver, through the interrupt endpoint,
+        // that a card has been inserted
+        udp_write_interrupt_in((U8*)cardInserted, 2);
+        break;
+    // End of class specific requests
+
+    case STD_GET_DESCRIPTOR:
+      if (val == 0x100) // Get device descriptor
+      {
+        udp_send_control((U8 *)dd, MIN(sizeof(dd), len));
+      }
+      else
+      if (val == 0x200) // Configuration descriptor
+      {
+        udp_send_control((U8 *)cfd, MIN(sizeof(cfd), len));
+        //if (len > sizeof(cfd)) udp_send_null();
+      }
+      else
+      if ((val & 0xF00) == 0x300)
+      {
+        switch(val & 0xFF)
+        {
+          case 0x00:
+            udp_send_control((U8 *)ld, MIN(sizeof(ld), len));
+            break;
+          case 0x01:        // serial number string descriptor
+            udp_send_control(snd, MIN(sizeof(snd), len));
+            break;
+          case 0x02:        // manufacturer string descriptor
+            udp_send_control(manufacturer, MIN(sizeof(manufacturer), len));
+            break;
+          case 0x03:        // product string descriptor
+            udp_send_control(product, MIN(sizeof(product), len));
+            break;
+          default:
+            udp_send_stall();
+        }
+      }
+      else
+      {
+        udp_send_stall();
+      }
+      break;
+
+    case STD_SET_ADDRESS:
+      newAddress = val;
+      udp_send_null();
+      break;
+
+    case STD_SET_CONFIGURATION:
+      configured = (val ? USB_CONFIGURED : USB_READY);
+      currentConfig = val;
+      udp_send_null();
+      REG_WR(AT91C_UDP_GLBSTATE, (val) ? AT91C_UDP_CONFG : AT91C_UDP_FADDEN);
+      delayedEnable = 0;
+      REG_WR(AT91C_UDP_CSR1, (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT) : 0);
+      REG_WR(AT91C_UDP_CSR2, (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_IN)  : 0);
+      REG_WR(AT91C_UDP_CSR3, (val) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_INT_IN)   : 0);
+      if (val)
+        REG_WR(AT91C_UDP_IER, (AT91C_UDP_EPINT1 | AT91C_UDP_EPINT2));
+      else
+        REG_WR(AT91C_UDP_IDR, (AT91C_UDP_EPINT1 | AT91C_UDP_EPINT2));
+
+      break;
+
+    case STD_SET_FEATURE_ENDPOINT:
+      ind &= 0x0F;
+
+      if ((val == 0) && ind && (ind <= 3))
+      {
+        switch (ind)
+        {
+          case 1:
+            REG_WR(AT91C_UDP_CSR1, 0);
+            delayedEnable = 0;
+            break;
+          case 2:
+            REG_WR(AT91C_UDP_CSR2, 0);
+            break;
+          case 3:
+            REG_WR(AT91C_UDP_CSR3, 0);
+            break;
+        }
+        udp_send_null();
+      }
+      else
+        udp_send_stall();
+      break;
+
+    case STD_CLEAR_FEATURE_ENDPOINT:
+      ind &= 0x0F;
+
+      if ((val == 0) && ind && (ind <= 3))
+      {
+        // Enable and reset the end point
+        if (ind == 1) {
+          // We need to take special care for the input end point because
+          // we may have data in the hardware buffer. If we do then the reset
+          // will cause this to be lost. To prevent this loss we delay the
+          // enable until the data has been read.
+          if ((REG_RD(AT91C_UDP_CSR1) & AT91C_UDP_RXBYTECNT) == 0)
+          {
+            REG_WR(AT91C_UDP_CSR1, (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT));
+            REG_OR(AT91C_UDP_RSTEP, AT91C_UDP_EP1);
+            REG_AND(AT91C_UDP_RSTEP, ~AT91C_UDP_EP1);
+            delayedEnable = 0;
+          }
+          else
+          {
+            // Use delayed anable. We also force the ep disabled to prevent
+            // any I/O using the wrong data toggle.
+            REG_AND(AT91C_UDP_CSR1, ~AT91C_UDP_EPEDS);
+            delayedEnable = 1;
+          }
+        }
+        else
+        if (ind == 2)
+        {
+          REG_WR(AT91C_UDP_CSR2, (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_IN));
+          REG_OR(AT91C_UDP_RSTEP, AT91C_UDP_EP2);
+          REG_AND(AT91C_UDP_RSTEP, ~AT91C_UDP_EP2);
+          udp_tx_restart();
+        }
+        else
+        if (ind == 3)
+        {
+          REG_WR(AT91C_UDP_CSR3, (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_INT_IN));
+          REG_OR(AT91C_UDP_RSTEP, AT91C_UDP_EP3);
+          REG_AND(AT91C_UDP_RSTEP, ~AT91C_UDP_EP3);
+        }
+        udp_send_null();
+      }
+      else
+        udp_send_stall();
+
+      break;
+
+    case STD_GET_CONFIGURATION:
+      udp_send_control((U8 *) &(currentConfig), MIN(sizeof(currentConfig), len));
+      break;
+
+    case STD_GET_STATUS_ZERO:
+      status = 0x01;
+      udp_send_control((U8 *) &status, MIN(sizeof(status), len));
+      break;
+
+    case STD_GET_STATUS_INTERFACE:
+      status = 0;
+      udp_send_control((U8 *) &status, MIN(sizeof(status), len));
+      break;
+
+    case STD_GET_STATUS_ENDPOINT:
+      status = 0;
+      ind &= 0x0F;
+
+      if ((REG_RD(AT91C_UDP_GLBSTATE) & AT91C_UDP_CONFG) && (ind <= 3))
+      {
+        switch (ind)
+        {
+          case 1:
+            status = (REG_RD(AT91C_UDP_CSR1) & AT91C_UDP_EPEDS) ? 0 : 1;
+            break;
+          case 2:
+            status = (REG_RD(AT91C_UDP_CSR2) & AT91C_UDP_EPEDS) ? 0 : 1;
+            break;
+          case 3:
+            status = (REG_RD(AT91C_UDP_CSR3) & AT91C_UDP_EPEDS) ? 0 : 1;
+            break;
+        }
+        udp_send_control((U8 *) &status, MIN(sizeof(status), len));
+      }
+      else
+      if ( (REG_RD(AT91C_UDP_GLBSTATE) & AT91C_UDP_FADDEN) && (ind == 0) )
+      {
+        status = (REG_RD(AT91C_UDP_CSR0) & AT91C_UDP_EPEDS) ? 0 : 1;
+        udp_send_control((U8 *) &status, MIN(sizeof(status), len));
+      }
+      else
+        udp_send_stall();                                // Illegal request :-(
+
+      break;
+
+    case VENDOR_SET_FEATURE_INTERFACE:
+      ind &= 0xf;
+      currentFeatures |= (1 << ind);
+      udp_send_null();
+      break;
+
+    case VENDOR_CLEAR_FEATURE_INTERFACE:
+      ind &= 0xf;
+      currentFeatures &= ~(1 << ind);
+      udp_send_null();
+      break;
+
+    case VENDOR_GET_DESCRIPTOR:
+      udp_send_control((U8 *)named, MIN(named[0], len));
+      break;
+
+    case STD_SET_FEATURE_INTERFACE:
+    case STD_CLEAR_FEATURE_INTERFACE:
+      udp_send_null();
+      break;
+
+    case STD_SET_INTERFACE:
+    case STD_SET_FEATURE_ZERO:
+    case STD_CLEAR_FEATURE_ZERO:
+    default:
+      udp_send_stall();
+  }
+  
+}
+
+void udp_set_serialno(U8 *serNo, int len)
+{
+  /* Set the USB serial number. serNo should point to a 12 character
+   * Unicode string, containing the USB serial number.
+   */
+  if (len == (sizeof(snd)-2)/2)
+    memcpy(snd+2, serNo, len*2);
+}
+
+void udp_set_name(U8 *name, int len)
+{
+  if (len <= (sizeof(named)-2)/2)
+  {
+    memcpy(named+2, name, len*2);
+    named[0] = len*2 + 2;
+  }
+}
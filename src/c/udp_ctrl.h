@@ -0,0 +1,89 @@
+#ifndef __UDP_CTRL_H__
+#  define __UDP_CTRL_H__
+
+/* Internal to the UDP driver. The bulk data path (udp.c) and the control
+ * endpoint with its descriptors (udp_ctrl.c) are separate units so that
+ * they can be built for different instruction sets (see CODE_PROFILE in
+ * the Makefile); this is what they share.
+ */
+
+#  include "mytypes.h"
+#  include "hal.h"
+#  include "timer.h"
+
+#define AT91C_UDP_CSR0  ((AT91_REG *)   0xFFFB0030)
+#define AT91C_UDP_CSR1  ((AT91_REG *)   0xFFFB0034)
+#define AT91C_UDP_CSR2  ((AT91_REG *)   0xFFFB0038)
+#define AT91C_UDP_CSR3  ((AT91_REG *)   0xFFFB003C)
+
+#define AT91C_UDP_FDR0  ((AT91_REG *)   0xFFFB0050)
+#define AT91C_UDP_FDR1  ((AT91_REG *)   0xFFFB0054)
+#define AT91C_UDP_FDR2  ((AT91_REG *)   0xFFFB0058)
+#define AT91C_UDP_FDR3  ((AT91_REG *)   0xFFFB005C)
+
+// Set or clear flag(s) in a register
+#define SET_CSR(register, flags)        REG_OR((register), (flags))
+#define CLEAR_CSR(register, flags)      REG_AND((register), ~(flags))
+
+// Poll the status of flags in a register
+#define ISSET(register, flags)      ((REG_RD(register) & (flags)) == (flags))
+#define ISCLEARED(register, flags)  ((REG_RD(register) & (flags)) == 0)
+
+// The CSR flags take a few UDP clock cycles to synchronise. The waits are
+// bounded so a wedged endpoint cannot hang the caller.
+#define UDP_CLEAREPFLAGS(register, dFlags) { \
+    U32 _deadline = 0; \
+    int _armed = 0; \
+    while (!ISCLEARED((register), dFlags)) { \
+        CLEAR_CSR((register), dFlags); \
+        if (!_armed) { _deadline = systick_deadline_us(UDP_SYNC_TIMEOUT_US); _armed = 1; } \
+        else if (systick_us_expired(_deadline)) break; \
+    } \
+}
+
+// Variant for .fastrun code, bounded by the PIT registers alone
+#define UDP_CLEAREPFLAGS_RAM(register, dFlags) { \
+    U32 _start = REG_RD(AT91C_PITC_PIIR); \
+    while (!ISCLEARED((register), dFlags) && systick_pit_elapsed_ms(_start) < 2) \
+        CLEAR_CSR((register), dFlags); \
+}
+
+#define UDP_SETEPFLAGS(register, dFlags) { \
+    U32 _deadline = 0; \
+    int _armed = 0; \
+    while (ISCLEARED((register), dFlags)) { \
+        SET_CSR((register), dFlags); \
+        if (!_armed) { _deadline = systick_deadline_us(UDP_SYNC_TIMEOUT_US); _armed = 1; } \
+        else if (systick_us_expired(_deadline)) break; \
+    } \
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// USB States
+#define USB_READY       0
+#define USB_CONFIGURED  1
+#define USB_SUSPENDED   2
+
+
+#define USB_DISABLED    0x8000
+#define USB_NEEDRESET   0x4000
+#define USB_WRITEABLE   0x100000
+#define USB_READABLE    0x200000
+
+
+#define UDP_SYNC_TIMEOUT_US  100      // CSR flag synchronisation limit
+
+extern U8 currentConfig;
+extern U32 currentFeatures;
+extern int configured;
+extern U8 delayedEnable;
+
+// udp.c
+void udp_tx_restart(void);
+
+// udp_ctrl.c
+void udp_ctrl_reset(void);
+void udp_enumerate(void);
+
+#endif
@@ -0,0 +1,126 @@
+/* Copy kernel benchmark (make copybench).
+ *
+ * Runs the kernels in src/c/copy.c and the loops they replaced over the
+ * units the firmware moves: a 64-byte packet through the EP1 and EP2
+ * FIFOs and a 256-byte flash page. For each it reports the host cost per
+ * unit, in instructions or ns (see host.h), and the peripheral register
+ * accesses per unit. The FIFO pumps run against the simulated UDP, so
+ * their host cost includes the register model; the kernels are built
+ * for the host here, so the figures compare loop shapes, not ARM cycles.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mytypes.h"
+#include "hal.h"
+#include "flash.h"
+#include "copy.h"
+#include "udp_ctrl.h"
+#include "sim.h"
+#include "host.h"
+
+#define RUNS        20000
+#define PACKET      64
+#define RING_SIZE   1024
+
+static U8 ring[RING_SIZE];
+static unsigned int page[FLASH_PAGE_SIZE / 4];
+static volatile U32 sink;
+
+/* The loops the kernels replaced */
+
+static void old_fifo_read(U32 head)
+{
+  U32 i;
+
+  for (i = 0; i < PACKET; i++)
+    ring[(head++) & (RING_SIZE - 1)] = REG_RD(AT91C_UDP_FDR1);
+}
+
+static void old_fifo_write(U32 pos)
+{
+  U32 i;
+
+  for (i = 0; i < PACKET; i++)
+    REG_WR(AT91C_UDP_FDR2, ring[(pos + i) & (RING_SIZE - 1)]);
+}
+
+static void old_flash_read(const U8 *source, U8 *dest, unsigned int length)
+{
+  while (length > 0) {
+    *dest = *source;
+    dest++;
+    source++;
+    length--;
+  }
+}
+
+/* The kernels, on the same data */
+
+static void new_fifo_read(U32 head)
+{
+  fifo_read(AT91C_UDP_FDR1, ring + (head & (RING_SIZE - 1)), PACKET);
+}
+
+static void new_fifo_write(U32 pos)
+{
+  fifo_write(AT91C_UDP_FDR2, ring + (pos & (RING_SIZE - 1)), PACKET);
+}
+
+static void bench(const char *what, const char *unit, void (*fn)(U32))
+{
+  const sim_counters *c = sim_get_counters();
+  unsigned long long regs = c->reg_reads + c->reg_writes;
+  unsigned long long t = host_counter();
+  U32 i;
+
+  for (i = 0; i < RUNS; i++)
+    fn(i * PACKET);
+  t = host_counter() - t;
+  regs = c->reg_reads + c->reg_writes - regs;
+
+  printf("  %-28s %-8s %10.1f %8.1f\n", what, unit, (double)t / RUNS, (double)regs / RUNS);
+}
+
+static void page_old_flash(U32 n)
+{
+  old_flash_read(sim_flash() + (n % 64) * FLASH_PAGE_SIZE, (U8 *)page, FLASH_PAGE_SIZE);
+  sink = page[n & 63];
+}
+
+static void page_new_flash(U32 n)
+{
+  copy_bytes((U8 *)page, sim_flash() + (n % 64) * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+  sink = page[n & 63];
+}
+
+static void page_old_ram(U32 n)
+{
+  memcpy(page, ring + (n & 512), FLASH_PAGE_SIZE);
+  sink = page[n & 63];
+}
+
+static void page_new_ram(U32 n)
+{
+  copy_words(page, (const void *)(ring + (n & 512)), FLASH_PAGE_SIZE / 4);
+  sink = page[n & 63];
+}
+
+int main(void)
+{
+  host_counter_open();
+  sim_init();
+
+  printf("copy kernels, %d runs each\n", RUNS);
+  printf("  %-28s %-8s %10s %8s\n", "", "per", host_counter_unit(), "regs");
+  bench("EP1 FIFO read, byte loop", "packet", old_fifo_read);
+  bench("EP1 FIFO read, fifo_read", "packet", new_fifo_read);
+  bench("EP2 FIFO write, byte loop", "packet", old_fifo_write);
+  bench("EP2 FIFO write, fifo_write", "packet", new_fifo_write);
+  bench("flash to RAM, flash_read", "page", page_old_flash);
+  bench("flash to RAM, copy_bytes", "page", page_new_flash);
+  bench("RAM to RAM, memcpy", "page", page_old_ram);
+  bench("RAM to RAM, copy_words", "page", page_new_ram);
+  return 0;
+}
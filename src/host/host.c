@@ -0,0 +1,71 @@
+/* USB bring-up and cost counters shared by the host drivers, see host.h */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mytypes.h"
+#include "sim.h"
+#include "host.h"
+
+static int perf_fd = -1;
+
+static int control(U8 type, U8 request, U16 value, U16 length, U8 *data)
+{
+  U8 setup[8] = {type, request, value & 0xFF, value >> 8, 0, 0, length & 0xFF, length >> 8};
+
+  return sim_control(setup, data, length);
+}
+
+const char *host_enumerate(void)
+{
+  U8 desc[128];
+
+  sim_bus_reset();
+  sim_advance(1000000);
+  if (control(0x80, 0x06, 0x0100, 18, desc) != 18 || desc[1] != 1)
+    return "device descriptor";
+  if (control(0x00, 0x05, 3, 0, 0) != 0)
+    return "set address";
+  if (control(0x80, 0x06, 0x0200, 9, desc) != 9 || desc[1] != 2)
+    return "configuration descriptor header";
+  if (control(0x80, 0x06, 0x0200, desc[2], desc) != desc[2])
+    return "configuration descriptor";
+  if (control(0x00, 0x09, 1, 0, 0) != 0)
+    return "set configuration";
+  if (!usbConfigured())
+    return "configured";
+  return 0;
+}
+
+void host_counter_open(void)
+{
+  struct perf_event_attr a;
+
+  memset(&a, 0, sizeof(a));
+  a.size = sizeof(a);
+  a.type = PERF_TYPE_HARDWARE;
+  a.config = PERF_COUNT_HW_INSTRUCTIONS;
+  a.exclude_kernel = 1;
+  a.exclude_hv = 1;
+  perf_fd = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+}
+
+unsigned long long host_counter(void)
+{
+  unsigned long long v;
+  struct timespec ts;
+
+  if (perf_fd >= 0 && read(perf_fd, &v, sizeof(v)) == sizeof(v))
+    return v;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *host_counter_unit(void)
+{
+  return perf_fd >= 0 ? "instr" : "host ns";
+}
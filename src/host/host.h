@@ -0,0 +1,29 @@
+/* Shared by the host drivers (make host, make replay): the firmware entry
+ * points from main.c and the USB bring-up done by the simulated host.
+ */
+
+#ifndef __HOST_H__
+#  define __HOST_H__
+
+#  define LOOP_NS              1000       /* virtual time per main loop pass */
+
+/* main.c */
+void boardInit(void);
+int usbConfigured(void);
+void sessionInit(void);
+void mainLoopPoll(void);
+
+/* Resets the bus and runs the standard enumeration up to SET_CONFIGURATION.
+ * Returns 0, or the name of the step that failed.
+ */
+const char *host_enumerate(void);
+
+/* Host cost of the code under test: user mode instructions from the perf
+ * counters, or thread CPU time in ns where those are not available.
+ * host_counter_unit() names the one in use.
+ */
+void host_counter_open(void);
+unsigned long long host_counter(void);
+const char *host_counter_unit(void);
+
+#endif
@@ -0,0 +1,731 @@
+/* Host driver for the firmware (make host).
+ *
+ * Brings the firmware up on the register models, enumerates it from the
+ * simulated USB host and runs a short CCID session through the bulk
+ * endpoints: power on, initialise the card, write a file with WRITE FILE
+ * and read it back with FIND FILE and READ FILE, then do the same for a
+ * larger file with one extended APDU each way, chained over several
+ * messages. Both files are then opened side by side and read and written
+ * by descriptor with READ AT and WRITE AT, and the statistics table is read
+ * with READ STATS. The Escape channel then creates, opens, writes, reads
+ * back and deletes a file of its own,
+ * and lists a directory of a dozen files with LIST over several replies.
+ * The event trace is drained with Escape TRACE after enumeration and again
+ * at the end, into TRACE_OUT for tracedump (make trace_run).
+ * Every reply is checked; the exit status is the number of failed checks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mytypes.h"
+#include "udp.h"
+#include "ccid.h"
+#include "stats.h"
+#include "trace.h"
+#include "escape.h"
+#include "sim.h"
+#include "host.h"
+
+#define REPLY_TIMEOUT_NS 2000000000ULL
+#define CHUNK            261            /* abData of the largest message */
+
+#ifndef TRACE_OUT
+#  define TRACE_OUT      "build/host/trace.bin"
+#endif
+
+static int failures;
+static U8 seq;
+
+static void check(int ok, const char *what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+/* Sends one CCID message with the given wLevelParameter and runs the main
+ * loop until its reply is back. Returns the reply length, -1 on time out.
+ */
+static int transact_level(U8 type, int level, const U8 *data, int len, U8 *reply, int max)
+{
+  U8 msg[10 + 512];
+  unsigned long long deadline = sim_time_ns() + REPLY_TIMEOUT_NS;
+  int n;
+
+  memset(msg, 0, 10);
+  msg[0] = type;
+  msg[1] = len & 0xFF;
+  msg[2] = (len >> 8) & 0xFF;
+  msg[6] = seq++;
+  msg[8] = level & 0xFF;
+  msg[9] = level >> 8;
+  memcpy(msg + 10, data, len);
+  sim_bulk_out(msg, 10 + len);
+
+  while ((n = sim_bulk_in(reply, max)) < 0 && sim_time_ns() < deadline) {
+    mainLoopPoll();
+    sim_advance(LOOP_NS);
+  }
+  return n;
+}
+
+static int transact(U8 type, const U8 *data, int len, U8 *reply, int max)
+{
+  return transact_level(type, 0, data, len, reply, max);
+}
+
+/* Sends an extended APDU chained over as many XfrBlocks as it needs and
+ * collects the chained response. Returns the response length without the
+ * status word, -1 on failure.
+ */
+static int xapdu(const U8 *apdu, int len, U8 *resp, int max, U16 sw, const char *what)
+{
+  U8 reply[10 + 512];
+  int off, n, level, got = 0;
+
+  for (off = 0; ; off += CHUNK) {
+    if (len <= CHUNK)
+      level = 0;
+    else if (off == 0)
+      level = 1;
+    else
+      level = off + CHUNK >= len ? 2 : 3;
+    n = transact_level(PC_RDR_XFR_BLOCK, level, apdu + off, len - off < CHUNK ? len - off : CHUNK,
+                       reply, sizeof(reply));
+    if (level != 1 && level != 3)
+      break;
+    if (n != 10 || reply[9] != 0x10) {
+      check(0, what);
+      return -1;
+    }
+  }
+
+  for (;;) {
+    if (n < 10 || reply[0] != RDR_TO_PC_DATABLOCK || reply[6] != (U8)(seq - 1) ||
+        got + n - 10 > max + 2) {
+      check(0, what);
+      return -1;
+    }
+    memcpy(resp + got, reply + 10, n - 10);
+    got += n - 10;
+    if (reply[9] == 0x00 || reply[9] == 0x02)
+      break;
+    n = transact_level(PC_RDR_XFR_BLOCK, 0x10, 0, 0, reply, sizeof(reply));
+  }
+
+  if (got < 2 || ((resp[got-2] << 8) | resp[got-1]) != sw) {
+    check(0, what);
+    return -1;
+  }
+  return got - 2;
+}
+
+/* Sends an APDU in an XfrBlock and checks the status word of the reply.
+ * Returns the length of the response data, -1 on failure.
+ */
+static int apdu(const U8 *apdu, int len, U8 *resp, int max, U16 sw, const char *what)
+{
+  U8 reply[10 + 512];
+  int n = transact(PC_RDR_XFR_BLOCK, apdu, len, reply, sizeof(reply));
+
+  if (n < 12 || reply[0] != RDR_TO_PC_DATABLOCK || reply[6] != (U8)(seq - 1) ||
+      ((reply[n-2] << 8) | reply[n-1]) != sw) {
+    check(0, what);
+    return -1;
+  }
+  n -= 12;
+  memcpy(resp, reply + 10, n < max ? n : max);
+  return n;
+}
+
+static void session(void)
+{
+  static const U8 name[] = "hello.txt";
+  U8 cmd[271], resp[512], data[600], reply[64];
+  int i, off, n;
+
+  for (i = 0; i < (int)sizeof(data); i++)
+    data[i] = i * 7 + 3;
+
+  n = transact(PC_RDR_ICC_POWER_ON, 0, 0, reply, sizeof(reply));
+  check(n == 25 && reply[0] == RDR_TO_PC_DATABLOCK && reply[10] == 0x3B, "power on");
+
+  n = transact(PC_RDR_SET_PARAMETERS, (const U8 *)"\x11\x00\x00\x0A\x00", 5, reply, sizeof(reply));
+  check(n == 15 && reply[0] == RDR_TO_PC_PARAMETERS, "set parameters");
+
+  // INIT CARD with a password. Erased flash already reads as initialised
+  // and gets 90 02.
+  memcpy(cmd, "\x80\xC6\x00\x00\x04" "1234", 9);
+  n = transact(PC_RDR_XFR_BLOCK, cmd, 9, reply, sizeof(reply));
+  check(n == 12 && reply[10] == 0x90 && (reply[11] == 0x00 || reply[11] == 0x02), "init card");
+
+  // create the file: name padded to 28 bytes, then the big-endian size
+  memset(cmd, 0, sizeof(cmd));
+  memcpy(cmd, "\x80\xC1\x00\x00\x21", 5);
+  memcpy(cmd + 6, name, sizeof(name) - 1);
+  cmd[6+28+2] = sizeof(data) >> 8;
+  cmd[6+28+3] = sizeof(data) & 0xFF;
+  apdu(cmd, 6 + 32, resp, sizeof(resp), 0x9000, "create file");
+
+  // WRITE FILE in 200 byte blocks, the last one flushes
+  for (off = 0; off < (int)sizeof(data); off += 200) {
+    memcpy(cmd, "\x80\xBB\x00\x00", 4);
+    cmd[2] = off + 200 >= (int)sizeof(data);
+    cmd[4] = 4 + 200;
+    cmd[5] = cmd[6] = 0;
+    cmd[7] = off >> 8;
+    cmd[8] = off & 0xFF;
+    memcpy(cmd + 9, data + off, 200);
+    apdu(cmd, 9 + 200, resp, sizeof(resp), 0x9000, "write file");
+  }
+
+  // an offset that wraps around 2^32 with the data length
+  memcpy(cmd, "\x80\xBB\x00\x00\xFC\xFF\xFF\xFF\x08", 9);
+  apdu(cmd, 9 + 248, resp, sizeof(resp), 0x6B00, "write file offset wrap");
+
+  // RECEIVE DATA with a malformed Lc, no data, an extended header that does
+  // not add up, and a block past the end of the page buffer
+  apdu((const U8 *)"\x80\xB3\x00\x00\x05\x00", 6, resp, sizeof(resp), 0x6700, "receive data bad Lc");
+  apdu((const U8 *)"\x80\xB3\x00\x00\x00", 5, resp, sizeof(resp), 0x6700, "receive data no data");
+  apdu((const U8 *)"\x80\xB3\x00\x00\x00\x00\x09\x00", 8, resp, sizeof(resp), 0x6700,
+       "receive data bad extended Lc");
+  memset(cmd, 0, 5 + 33);
+  memcpy(cmd, "\x80\xB3\x00\x00\x21\xF0", 6);
+  apdu(cmd, 5 + 33, resp, sizeof(resp), 0x6B00, "receive data past the page");
+
+  // FIND FILE returns the size
+  memcpy(cmd, "\x80\xB5\x00\x00", 4);
+  cmd[4] = sizeof(name) - 1;
+  memcpy(cmd + 5, name, sizeof(name) - 1);
+  n = apdu(cmd, 5 + sizeof(name) - 1, resp, sizeof(resp), 0x9000, "find file");
+  check(n == 4 && resp[2] == (sizeof(data) >> 8) && resp[3] == (sizeof(data) & 0xFF), "file size");
+
+  // READ FILE until the end
+  for (off = 0; off < (int)sizeof(data); off += n) {
+    memcpy(cmd, "\x80\xBA\x00\x00\x04\x00\x00", 7);
+    cmd[7] = off >> 8;
+    cmd[8] = off & 0xFF;
+    n = apdu(cmd, 9, resp, sizeof(resp), 0x9000, "read file");
+    if (n <= 0)
+      break;
+    check(memcmp(resp, data + off, n) == 0, "file contents");
+  }
+}
+
+/* A file several messages long, written with one extended WRITE FILE and
+ * read back with one extended READ FILE
+ */
+static void session_extended(void)
+{
+  static const U8 name[] = "big.bin";
+  static U8 data[3000], cmd[16 + sizeof(data)], resp[sizeof(data) + 2];
+  int i, n;
+
+  for (i = 0; i < (int)sizeof(data); i++)
+    data[i] = i * 13 + 5;
+
+  memset(cmd, 0, 6 + 32);
+  memcpy(cmd, "\x80\xC1\x00\x00\x21", 5);
+  memcpy(cmd + 6, name, sizeof(name) - 1);
+  cmd[6+28+2] = sizeof(data) >> 8;
+  cmd[6+28+3] = sizeof(data) & 0xFF;
+  apdu(cmd, 6 + 32, resp, sizeof(resp), 0x9000, "create big file");
+
+  // 80 BB 01 00 00 Lc Lc, offset 0, the data; no Le
+  memcpy(cmd, "\x80\xBB\x01\x00\x00", 5);
+  cmd[5] = (4 + sizeof(data)) >> 8;
+  cmd[6] = (4 + sizeof(data)) & 0xFF;
+  memset(cmd + 7, 0, 4);
+  memcpy(cmd + 11, data, sizeof(data));
+  xapdu(cmd, 11 + sizeof(data), resp, sizeof(resp), 0x9000, "extended write file");
+
+  memcpy(cmd, "\x80\xB5\x00\x00", 4);
+  cmd[4] = sizeof(name) - 1;
+  memcpy(cmd + 5, name, sizeof(name) - 1);
+  apdu(cmd, 5 + sizeof(name) - 1, resp, sizeof(resp), 0x9000, "find big file");
+
+  // 80 BA 00 00 00 00 04, offset 0, Le 0000 for as much as there is
+  memcpy(cmd, "\x80\xBA\x00\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00", 13);
+  n = xapdu(cmd, 13, resp, sizeof(resp), 0x9000, "extended read file");
+  check(n == (int)sizeof(data) && memcmp(resp, data, sizeof(data)) == 0, "big file contents");
+}
+
+// OPEN of a file by name, returning the descriptor; -1 on failure
+static int open_file(const char *name, U32 size, U16 sw, const char *what)
+{
+  U8 cmd[64], resp[16];
+  int len = strlen(name), n;
+
+  memcpy(cmd, "\x80\xC8\x00\x00", 4);
+  cmd[4] = len;
+  memcpy(cmd + 5, name, len);
+  cmd[5 + len] = 5;
+  n = apdu(cmd, 6 + len, resp, sizeof(resp), sw, what);
+  if (sw != 0x9000)
+    return -1;
+  check(n == 5 && ((U32)resp[1] << 24 | resp[2] << 16 | resp[3] << 8 | resp[4]) == size, what);
+  return n == 5 ? resp[0] : -1;
+}
+
+// READ AT of len bytes from off, checked against data
+static void read_at(int fd, int off, int len, const U8 *data, const char *what)
+{
+  U8 cmd[10] = { 0x80, 0xC9, fd, 0x00, 0x04, 0x00, 0x00, off >> 8, off & 0xFF, len };
+  U8 resp[256];
+  int n = apdu(cmd, sizeof(cmd), resp, sizeof(resp), 0x9000, what);
+
+  check(n == len && memcmp(resp, data + off, len) == 0, what);
+}
+
+/* The files of session() and session_extended() open side by side with
+ * OPEN, read alternately from the middle with READ AT, one of them written
+ * with WRITE AT and read back before and after the flush, then closed and
+ * read again with FIND FILE and READ FILE, which keep a descriptor of
+ * their own.
+ */
+static void session_handles(void)
+{
+  static const U8 close_bad[] = { 0x80, 0xCB, 0x07, 0x00 };
+  U8 small[600], big[3000], cmd[16 + 40], resp[512], chain[11 + 300], reply[64];
+  int i, n, off, fd_small, fd_big, fd[2];
+
+  for (i = 0; i < (int)sizeof(small); i++)
+    small[i] = i * 7 + 3;
+  for (i = 0; i < (int)sizeof(big); i++)
+    big[i] = i * 13 + 5;
+
+  fd_small = open_file("hello.txt", sizeof(small), 0x9000, "open hello.txt");
+  fd_big = open_file("big.bin", sizeof(big), 0x9000, "open big.bin");
+  open_file("none", 0, 0x6A82, "open missing file");
+  check(fd_small >= 0 && fd_big >= 0 && fd_small != fd_big, "open descriptors");
+
+  for (i = 0; i < 4; i++) {
+    read_at(fd_small, 240 + i * 16, 64, small, "read at hello.txt");
+    read_at(fd_big, 1480 + i * 16, 64, big, "read at big.bin");
+  }
+
+  // WRITE AT without a flush, seen by READ AT from the fill buffer while
+  // big.bin is read from flash
+  for (i = 0; i < 40; i++)
+    small[300 + i] = ~small[300 + i];
+  memcpy(cmd, "\x80\xCA\x00\x00\x2C\x00\x00\x01\x2C", 9);
+  cmd[2] = fd_small;
+  memcpy(cmd + 9, small + 300, 40);
+  apdu(cmd, 9 + 40, resp, sizeof(resp), 0x9000, "write at hello.txt");
+  read_at(fd_small, 280, 64, small, "read at unflushed");
+  read_at(fd_big, 2900, 64, big, "read at big.bin");
+
+  // a WRITE AT with no data and P2 bit 0 flushes
+  memcpy(cmd, "\x80\xCA\x00\x01\x04\x00\x00\x00\x00", 9);
+  cmd[2] = fd_small;
+  apdu(cmd, 9, resp, sizeof(resp), 0x9000, "write at flush");
+  read_at(fd_small, 280, 64, small, "read at flushed");
+
+  memcpy(cmd, "\x80\xC9\x00\x00\x04\x00\x00\x02\x58\x10", 10);
+  cmd[2] = fd_small;
+  apdu(cmd, 10, resp, sizeof(resp), 0x6B00, "read at past the end");
+
+  // FIND FILE keeps one descriptor, so two more fill the table
+  fd[0] = open_file("hello.txt", sizeof(small), 0x9000, "open third");
+  open_file("big.bin", sizeof(big), 0x6A84, "open with no descriptor free");
+  cmd[0] = 0x80, cmd[1] = 0xCB, cmd[2] = fd[0], cmd[3] = 0;
+  apdu(cmd, 4, resp, sizeof(resp), 0x9000, "close third");
+  fd[1] = open_file("big.bin", sizeof(big), 0x9000, "open after close");
+  check(fd[1] == fd[0], "descriptor reused");
+
+  for (i = 0; i < 2; i++) {
+    cmd[2] = i ? fd_small : fd_big;
+    apdu(cmd, 4, resp, sizeof(resp), 0x9000, "close");
+  }
+  cmd[2] = fd[1];
+  apdu(cmd, 4, resp, sizeof(resp), 0x9000, "close");
+  apdu(cmd, 4, resp, sizeof(resp), 0x6A82, "close twice");
+  apdu(close_bad, sizeof(close_bad), resp, sizeof(resp), 0x6A82, "close bad descriptor");
+  memcpy(cmd, "\x80\xCA\x07\x00\x05\x00\x00\x00\x00\xAA", 10);
+  apdu(cmd, 10, resp, sizeof(resp), 0x6A82, "write at bad descriptor");
+
+  memcpy(cmd, "\x80\xB5\x00\x00\x09hello.txt", 14);
+  apdu(cmd, 14, resp, sizeof(resp), 0x9000, "find file");
+  for (off = 0; off < (int)sizeof(small); off += i) {
+    memcpy(cmd, "\x80\xBA\x00\x00\x04\x00\x00", 7);
+    cmd[7] = off >> 8;
+    cmd[8] = off & 0xFF;
+    i = apdu(cmd, 9, resp, sizeof(resp), 0x9000, "read file");
+    if (i <= 0)
+      break;
+    check(memcmp(resp, small + off, i) == 0, "file contents after write at");
+  }
+
+  // READ PAGE in 48 byte blocks, one across the page boundary and over data
+  // WRITE AT left in the fill buffer, then short at the end of the file
+  fd[0] = open_file("hello.txt", sizeof(small), 0x9000, "open for read page");
+  for (i = 0; i < 16; i++)
+    small[250 + i] = ~small[250 + i];
+  memcpy(cmd, "\x80\xCA\x00\x00\x14\x00\x00\x00\xFA", 9);
+  cmd[2] = fd[0];
+  memcpy(cmd + 9, small + 250, 16);
+  apdu(cmd, 9 + 16, resp, sizeof(resp), 0x9000, "write at for read page");
+  for (off = 0; off < (int)sizeof(small); off += n) {
+    n = sizeof(small) - off < 48 ? sizeof(small) - off : 48;
+    memcpy(cmd, "\x80\xB7\x00\x00\x01\x30", 6);
+    apdu(cmd, 6, resp, sizeof(resp), 0x6100 | n, "read page");
+    memcpy(cmd, "\x00\xC0\x00\x00", 4);
+    cmd[4] = n;
+    check(apdu(cmd, 5, resp, sizeof(resp), 0x9000, "get response") == n &&
+          memcmp(resp, small + off, n) == 0, "read page data");
+  }
+  memcpy(cmd, "\x80\xB7\x00\x00\x01\x30", 6);
+  apdu(cmd, 6, resp, sizeof(resp), 0x6B00, "read page past the end");
+  memcpy(cmd, "\x00\xC0\x00\x00\x20", 5);
+  apdu(cmd, 5, resp, sizeof(resp), 0x6985, "get response after the end");
+
+  // GET RESPONSE returns what READ PAGE left, in parts, and no more
+  memcpy(cmd, "\x80\xB5\x00\x00\x09hello.txt", 14);
+  apdu(cmd, 14, resp, sizeof(resp), 0x9000, "find file");
+  memcpy(cmd, "\x80\xB7\x00\x00\x01\x20", 6);
+  apdu(cmd, 6, resp, sizeof(resp), 0x6120, "read page");
+  memcpy(cmd, "\x00\xC0\x00\x00\x08", 5);
+  check(apdu(cmd, 5, resp, sizeof(resp), 0x6118, "get response part") == 8 &&
+        memcmp(resp, small, 8) == 0, "get response part data");
+  cmd[4] = 0xFF;
+  check(apdu(cmd, 5, resp, sizeof(resp), 0x9000, "get response rest") == 24 &&
+        memcmp(resp, small + 8, 24) == 0, "get response rest data");
+  apdu(cmd, 5, resp, sizeof(resp), 0x6985, "get response with none left");
+  cmd[0] = 0x80, cmd[1] = 0xCB, cmd[2] = fd[0], cmd[3] = 0;
+  apdu(cmd, 4, resp, sizeof(resp), 0x9000, "close");
+
+  // a chained WRITE AT whose descriptor is closed between its parts
+  fd[0] = open_file("hello.txt", sizeof(small), 0x9000, "open for chain");
+  memcpy(chain, "\x80\xCA\x00\x00\x00\x01\x30\x00\x00\x00\x00", 11);
+  chain[2] = fd[0];
+  memcpy(chain + 11, small, 300);
+  n = transact_level(PC_RDR_XFR_BLOCK, 1, chain, CHUNK, reply, sizeof(reply));
+  check(n == 10 && reply[9] == 0x10, "write at chain begin");
+  cmd[0] = ESC_CLOSE;
+  cmd[1] = fd[0];
+  n = transact(PC_RDR_ESCAPE, cmd, 2, reply, sizeof(reply));
+  check(n == 10 && reply[0] == RDR_TO_PC_ESCAPE && reply[7] == 0, "close during chain");
+  n = transact_level(PC_RDR_XFR_BLOCK, 2, chain + CHUNK, sizeof(chain) - CHUNK, reply, sizeof(reply));
+  check(n == 12 && reply[10] == 0x6B && reply[11] == 0x00, "write at closed during chain");
+}
+
+// READ STATS after the sessions above, then cleared
+static void session_stats(void)
+{
+  static const U8 read[] = { 0x80, 0xC7, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  static const U8 clear[] = { 0x80, 0xC7, 0x01, 0x00 };
+  static U8 resp[sizeof(stats_table) + 2];
+  stats_table t;
+  const stats_entry *e;
+  int n;
+
+  n = xapdu(read, sizeof(read), resp, sizeof(resp), 0x9000, "read stats");
+  check(n == (int)sizeof(t), "stats table size");
+  memcpy(&t, resp, sizeof(t));
+  check(t.tick_hz == STATS_TICK_HZ && t.slots == STATS_SLOTS, "stats header");
+
+  e = &t.e[STATS_INS(0xBB)];
+  check(e->count >= 2 && e->min > 0 && e->min <= e->max && e->total >= e->max, "stats for WRITE FILE");
+  check(t.e[STATS_FLASH_WRITE].count > 0, "stats for flash writes");
+  check(t.e[STATS_UDP_READ].count >= t.e[STATS_MSG(PC_RDR_XFR_BLOCK)].count, "stats for udp_read");
+
+  apdu(clear, sizeof(clear), resp, sizeof(resp), 0x9000, "clear stats");
+  n = xapdu(read, sizeof(read), resp, sizeof(resp), 0x9000, "read stats");
+  memcpy(&t, resp, sizeof(t));
+  check(n == (int)sizeof(t) && t.e[STATS_INS(0xBB)].count == 0 && t.e[STATS_INS(0xC7)].count >= 1,
+        "stats cleared");
+}
+
+/* Sends an Escape sub-command with len bytes of parameters. Returns the
+ * length of the result, or -1 after checking that it failed with bError.
+ */
+static int escape(U8 sub, const U8 *param, int len, U8 *result, int max, int bError, const char *what)
+{
+  U8 msg[CCID_MAX_MESSAGE], reply[CCID_MAX_MESSAGE];
+  int n;
+
+  msg[0] = sub;
+  memcpy(msg + 1, param, len);
+  n = transact(PC_RDR_ESCAPE, msg, 1 + len, reply, sizeof(reply));
+  if (n < 10 || reply[0] != RDR_TO_PC_ESCAPE || reply[6] != (U8)(seq - 1) ||
+      (bError < 0 ? reply[7] != 0 || n - 10 > max : n != 10 || reply[7] != CCID_CMD_FAILED || reply[8] != bError)) {
+    check(0, what);
+    return -1;
+  }
+  memcpy(result, reply + 10, n - 10);
+  return bError < 0 ? n - 10 : -1;
+}
+
+static void put16(U8 *p, unsigned n) { p[0] = n; p[1] = n >> 8; }
+static void put32(U8 *p, unsigned n) { put16(p, n); put16(p + 2, n >> 16); }
+
+// A file through the Escape channel: opened, written in two parts, read
+// back whole and from the middle, closed, then deleted
+static void session_escape(void)
+{
+  static const U8 name[] = "esc.bin";
+  U8 param[CCID_MAX_MESSAGE], result[CCID_MAX_MESSAGE], data[600];
+  esc_info info;
+  int i, n, off, handle, fd, files;
+
+  for (i = 0; i < (int)sizeof(data); i++)
+    data[i] = i * 11 + 1;
+
+  n = escape(ESC_INFO, 0, 0, result, sizeof(result), -1, "escape info");
+  memcpy(&info, result, sizeof(info));
+  check(n == (int)sizeof(info) && info.page_size == 256 && info.max_message == CCID_MAX_MESSAGE &&
+        info.free_pages <= info.data_pages, "escape info fields");
+  files = info.files;
+
+  put32(param, sizeof(data));
+  memcpy(param + 4, name, sizeof(name) - 1);
+  n = escape(ESC_CREATE, param, 4 + sizeof(name) - 1, result, sizeof(result), -1, "escape create");
+  handle = n == 2 ? result[0] | (result[1] << 8) : 0;
+
+  n = escape(ESC_OPEN, name, sizeof(name) - 1, result, sizeof(result), -1, "escape open");
+  check(n == 7 && (result[1] | (result[2] << 8)) == handle &&
+        (result[3] | (result[4] << 8)) == sizeof(data), "escape open result");
+  fd = result[0];
+
+  for (off = 0; off < (int)sizeof(data); off += n) {
+    n = sizeof(data) - off < ESC_WRITE_DATA_MAX ? sizeof(data) - off : ESC_WRITE_DATA_MAX;
+    param[0] = fd;
+    put32(param + 1, off);
+    param[5] = off + n == sizeof(data) ? ESC_WRITE_FLUSH : 0;
+    memcpy(param + 6, data + off, n);
+    escape(ESC_WRITE, param, 6 + n, result, sizeof(result), -1, "escape write");
+  }
+
+  n = escape(ESC_FIND, name, sizeof(name) - 1, result, sizeof(result), -1, "escape find");
+  check(n == 6 && (result[0] | (result[1] << 8)) == handle &&
+        (result[2] | (result[3] << 8)) == sizeof(data), "escape find result");
+
+  for (off = 0; off < (int)sizeof(data); off += n) {
+    param[0] = fd;
+    put32(param + 1, off);
+    put16(param + 5, 0xFFFF);
+    n = escape(ESC_READ, param, 7, result, sizeof(result), -1, "escape read");
+    if (n <= 0)
+      break;
+    check(n == (sizeof(data) - off < ESC_DATA_MAX ? sizeof(data) - off : ESC_DATA_MAX) &&
+          memcmp(result, data + off, n) == 0, "escape read data");
+  }
+
+  // 64 bytes across the first page boundary
+  put32(param + 1, 230);
+  put16(param + 5, 64);
+  n = escape(ESC_READ, param, 7, result, sizeof(result), -1, "escape read at");
+  check(n == 64 && memcmp(result, data + 230, 64) == 0, "escape read at data");
+
+  // a write is read back before it is flushed
+  for (i = 0; i < 16; i++)
+    data[300 + i] = ~data[300 + i];
+  put32(param + 1, 300);
+  param[5] = 0;
+  memcpy(param + 6, data + 300, 16);
+  escape(ESC_WRITE, param, 6 + 16, result, sizeof(result), -1, "escape write unflushed");
+  put32(param + 1, 290);
+  put16(param + 5, 40);
+  n = escape(ESC_READ, param, 7, result, sizeof(result), -1, "escape read unflushed");
+  check(n == 40 && memcmp(result, data + 290, 40) == 0, "escape read unflushed data");
+
+  put32(param + 1, sizeof(data) + 1);
+  escape(ESC_READ, param, 7, result, sizeof(result), ESC_ERR_RANGE, "escape read past the end");
+  put32(param + 1, 1024);
+  param[5] = 0;
+  escape(ESC_WRITE, param, 7, result, sizeof(result), ESC_ERR_RANGE, "escape write past the end");
+
+  // closing programs the page left in the buffer
+  escape(ESC_CLOSE, param, 1, result, sizeof(result), -1, "escape close");
+  escape(ESC_CLOSE, param, 1, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape close twice");
+  escape(ESC_READ, param, 7, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape read closed");
+  n = escape(ESC_OPEN, name, sizeof(name) - 1, result, sizeof(result), -1, "escape reopen");
+  param[0] = fd = result[0];
+  put32(param + 1, 290);
+  put16(param + 5, 40);
+  n = escape(ESC_READ, param, 7, result, sizeof(result), -1, "escape read reopened");
+  check(n == 40 && memcmp(result, data + 290, 40) == 0, "escape read reopened data");
+
+  // deleting the file closes its descriptor
+  put16(param, handle);
+  escape(ESC_DELETE, param, 2, result, sizeof(result), -1, "escape delete");
+  escape(ESC_FIND, name, sizeof(name) - 1, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape find deleted");
+  param[0] = fd;
+  put32(param + 1, 0);
+  put16(param + 5, 16);
+  escape(ESC_READ, param, 7, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape read deleted");
+  escape(ESC_READ, param, 6, result, sizeof(result), CCID_ERR_BAD_LENGTH, "escape short parameters");
+  escape(ESC_OPEN, name, sizeof(name) - 1, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape open deleted");
+  escape(0x7F, 0, 0, result, sizeof(result), CCID_ERR_CMD_NOT_SUPPORTED, "escape unknown");
+
+  n = escape(ESC_INFO, 0, 0, result, sizeof(result), -1, "escape info");
+  memcpy(&info, result, sizeof(info));
+  check(n == (int)sizeof(info) && info.files == files, "escape info after delete");
+
+  // a replace too big for the flash fails and leaves the old file and its
+  // descriptor as they were; one that fits closes the descriptor
+  put32(param, 100);
+  memcpy(param + 4, name, sizeof(name) - 1);
+  n = escape(ESC_CREATE, param, 4 + sizeof(name) - 1, result, sizeof(result), -1, "escape create");
+  handle = n == 2 ? result[0] | (result[1] << 8) : 0;
+  escape(ESC_OPEN, name, sizeof(name) - 1, result, sizeof(result), -1, "escape open");
+  param[0] = fd = result[0];
+  put32(param + 1, 0);
+  param[5] = ESC_WRITE_FLUSH;
+  memcpy(param + 6, data, 100);
+  escape(ESC_WRITE, param, 6 + 100, result, sizeof(result), -1, "escape write");
+
+  put32(param, (info.free_pages + 8) * info.page_size);
+  memcpy(param + 4, name, sizeof(name) - 1);
+  escape(ESC_CREATE, param, 4 + sizeof(name) - 1, result, sizeof(result), ESC_ERR_NO_SPACE,
+         "escape replace too big");
+  n = escape(ESC_FIND, name, sizeof(name) - 1, result, sizeof(result), -1, "escape find after failed replace");
+  check(n == 6 && (result[0] | (result[1] << 8)) == handle && (result[2] | (result[3] << 8)) == 100,
+        "escape file kept by failed replace");
+  param[0] = fd;
+  put32(param + 1, 0);
+  put16(param + 5, 100);
+  n = escape(ESC_READ, param, 7, result, sizeof(result), -1, "escape read after failed replace");
+  check(n == 100 && memcmp(result, data, 100) == 0, "escape data kept by failed replace");
+
+  put32(param, 300);
+  memcpy(param + 4, name, sizeof(name) - 1);
+  n = escape(ESC_CREATE, param, 4 + sizeof(name) - 1, result, sizeof(result), -1, "escape replace");
+  check(n == 2 && (result[0] | (result[1] << 8)) == handle, "escape replace keeps the handle");
+  param[0] = fd;
+  put32(param + 1, 0);
+  put16(param + 5, 16);
+  escape(ESC_READ, param, 7, result, sizeof(result), ESC_ERR_NOT_FOUND, "escape read replaced");
+  put16(param, handle);
+  escape(ESC_DELETE, param, 2, result, sizeof(result), -1, "escape delete");
+
+  put16(param, 0);
+  n = escape(ESC_STATS, param, 2, result, sizeof(result), -1, "escape stats");
+  check(n == ESC_DATA_MAX && result[4] == STATS_SLOTS, "escape stats header");
+}
+
+// name of the i-th file of session_list(), a name longer with each one
+static int list_name(int i, char *name)
+{
+  return sprintf(name, "list-%02d-%.*s", i, i, "abcdefghijkl");
+}
+
+// LIST of a directory that takes more than one reply, resumed by cursor
+static void session_list(void)
+{
+  U8 param[64], result[CCID_MAX_MESSAGE], *e;
+  char name[32];
+  int seen[12] = { 0 };
+  int i, n, cursor, replies = 0, entries = 0;
+  esc_info info;
+
+  for (i = 0; i < 12; i++) {
+    n = list_name(i, name);
+    put32(param, 100 * i);
+    memcpy(param + 4, name, n);
+    escape(ESC_CREATE, param, 4 + n, result, sizeof(result), -1, "list create");
+  }
+  escape(ESC_INFO, 0, 0, result, sizeof(result), -1, "list info");
+  memcpy(&info, result, sizeof(info));
+
+  for (cursor = 0; cursor != ESC_LIST_END; replies++) {
+    put16(param, cursor);
+    n = escape(ESC_LIST, param, 2, result, sizeof(result), -1, "list");
+    if (n < 2)
+      break;
+    cursor = result[0] | (result[1] << 8);
+    for (e = result + 2; e + ESC_LIST_ENTRY <= result + n; e += ESC_LIST_ENTRY + e[7], entries++)
+      for (i = 0; i < 12; i++)
+        if (e[7] == list_name(i, name) && memcmp(e + ESC_LIST_ENTRY, name, e[7]) == 0) {
+          check((e[2] | (e[3] << 8) | (e[4] << 16) | (e[5] << 24)) == 100 * i, "list entry size");
+          seen[i]++;
+        }
+    check(e == result + n, "list packing");
+  }
+  check(replies > 1 && entries == info.files, "list resumed over several replies");
+  for (i = 0; i < 12; i++)
+    check(seen[i] == 1, "list shows each file once");
+
+  for (i = 0; i < 12; i++) {
+    n = list_name(i, name);
+    if (escape(ESC_FIND, (U8 *)name, n, result, sizeof(result), -1, "list find") == 6)
+      escape(ESC_DELETE, result, 2, result, sizeof(result), -1, "list delete");
+  }
+}
+
+/* Drains both trace rings with Escape TRACE, appending the abData of the
+ * replies to out; count[] adds up the records of each event.
+ */
+static void drain_trace(FILE *out, int *count)
+{
+  U8 cmd[2] = { ESC_TRACE, 0 }, reply[10 + 3 + TRACE_DRAIN_MAX * sizeof(trace_record)];
+  int ring, n, i;
+
+  for (ring = 0; ring < TRACE_RINGS; ring++) {
+    cmd[1] = ring;
+    do {
+      n = transact(PC_RDR_ESCAPE, cmd, sizeof(cmd), reply, sizeof(reply));
+      if (n < 13 || reply[0] != RDR_TO_PC_ESCAPE || reply[10] != ring ||
+          n != 13 + reply[12] * (int)sizeof(trace_record)) {
+        check(0, "trace drain");
+        return;
+      }
+      if (out)
+        fwrite(reply + 10, 1, n - 10, out);
+      for (i = 0; i < reply[12]; i++)
+        count[reply[13 + i * sizeof(trace_record) + 4]]++;
+    } while (reply[12] == TRACE_DRAIN_MAX);
+  }
+}
+
+// the SETUP packets of the enumeration, before the session overwrites them
+static void session_trace_setup(FILE *out)
+{
+  int count[256] = { 0 };
+
+  drain_trace(out, count);
+  check(count[TRACE_SETUP] >= 3, "trace of the SETUP packets");
+}
+
+// the data path after the sessions
+static void session_trace(FILE *out)
+{
+  int count[256] = { 0 };
+
+  drain_trace(out, count);
+  check(count[TRACE_RX_BANK] > 0 && count[TRACE_TXCOMP] > 0, "trace of the bulk banks");
+  check(count[TRACE_FLASH_START] > 0 && count[TRACE_FLASH_END] > 0, "trace of the flash pages");
+  check(count[TRACE_APDU_START] > 0 && count[TRACE_APDU_END] > 0, "trace of the APDUs");
+}
+
+int main(void)
+{
+  const sim_counters *c = sim_get_counters();
+  const char *err;
+  FILE *trace_out = fopen(TRACE_OUT, "wb");
+
+  sim_init();
+  boardInit();
+  if ((err = host_enumerate()))
+    check(0, err);
+  sessionInit();
+  session_trace_setup(trace_out);
+  session();
+  session_extended();
+  session_handles();
+  session_stats();
+  session_escape();
+  session_list();
+  session_trace(trace_out);
+  if (trace_out)
+    fclose(trace_out);
+
+  printf("%llu us virtual, %llu register accesses, %llu interrupts, "
+         "%llu page writes, %llu page programs, %llu/%llu packets out/in\n",
+         sim_time_ns() / 1000, c->reg_reads + c->reg_writes, c->irqs,
+         c->flash_writes, c->flash_programs, c->packets_out, c->packets_in);
+  printf(failures ? "host: %d check(s) failed\n" : "host: all checks passed\n", failures);
+  return failures;
+}
@@ -0,0 +1,150 @@
+/* Function profile of the firmware on the replay streams (make profile_run).
+ *
+ * The firmware sources are built with -finstrument-functions for this
+ * target; the hooks below count the calls of every function and the host
+ * time spent in it, without its callees. At exit the table is written to
+ * PROFILE_OUT, sorted by that self time, one function per line:
+ *
+ *   name calls self_ns share
+ *
+ * which 'make fastrun_report' reads next to the .fastrun sizes of the ARM
+ * build. The hooks cost some ns per call, charged to the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROFILE_FUNCS   512
+#define PROFILE_DEPTH   64
+#define NO_PROFILE      __attribute__ ((no_instrument_function))
+
+#ifndef PROFILE_OUT
+#  define PROFILE_OUT   "build/host/profile.txt"
+#endif
+
+typedef struct {
+  void *fn;
+  unsigned long long calls, self_ns;
+  char name[64];
+} prof_func;
+
+static prof_func funcs[PROFILE_FUNCS];
+static int nfuncs;
+static struct {
+  prof_func *f;
+  unsigned long long start, child_ns;
+} stack[PROFILE_DEPTH];
+static int depth;
+
+NO_PROFILE static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+NO_PROFILE static prof_func *lookup(void *fn)
+{
+  int i;
+
+  for (i = 0; i < nfuncs; i++)
+    if (funcs[i].fn == fn)
+      return &funcs[i];
+  if (nfuncs == PROFILE_FUNCS)
+    return 0;
+  funcs[nfuncs].fn = fn;
+  return &funcs[nfuncs++];
+}
+
+NO_PROFILE void __cyg_profile_func_enter(void *fn, void *site)
+{
+  (void)site;
+  if (depth < PROFILE_DEPTH) {
+    stack[depth].f = lookup(fn);
+    stack[depth].child_ns = 0;
+    stack[depth].start = now_ns();
+  }
+  depth++;
+}
+
+NO_PROFILE void __cyg_profile_func_exit(void *fn, void *site)
+{
+  unsigned long long t;
+
+  (void)fn;
+  (void)site;
+  if (--depth >= PROFILE_DEPTH || depth < 0)
+    return;
+  t = now_ns() - stack[depth].start;
+  if (stack[depth].f) {
+    stack[depth].f->calls++;
+    stack[depth].f->self_ns += t - stack[depth].child_ns;
+  }
+  if (depth > 0 && depth - 1 < PROFILE_DEPTH)
+    stack[depth - 1].child_ns += t;
+}
+
+NO_PROFILE static int by_self(const void *a, const void *b)
+{
+  const prof_func *x = a, *y = b;
+
+  return x->self_ns < y->self_ns ? 1 : x->self_ns > y->self_ns ? -1 : 0;
+}
+
+/* Names the functions from the symbol table of the running program, which
+ * is linked without PIE so that its addresses are the ones nm prints.
+ */
+NO_PROFILE static void name_funcs(void)
+{
+  char line[256], name[64], exe[200];
+  unsigned long addr;
+  char type;
+  FILE *nm;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < nfuncs; i++)
+    snprintf(funcs[i].name, sizeof(funcs[i].name), "%p", funcs[i].fn);
+  if ((n = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) < 0)
+    return;
+  exe[n] = 0;
+  snprintf(line, sizeof(line), "nm '%s' 2>/dev/null", exe);
+  if (!(nm = popen(line, "r")))
+    return;
+  while (fgets(line, sizeof(line), nm))
+    if (sscanf(line, "%lx %c %63s", &addr, &type, name) == 3 && (type == 't' || type == 'T'))
+      for (i = 0; i < nfuncs; i++)
+        if ((unsigned long)funcs[i].fn == addr)
+          snprintf(funcs[i].name, sizeof(funcs[i].name), "%s", name);
+  pclose(nm);
+}
+
+NO_PROFILE static void profile_write(void)
+{
+  unsigned long long total = 0;
+  FILE *out = fopen(PROFILE_OUT, "w");
+  int i;
+
+  if (!out) {
+    perror(PROFILE_OUT);
+    return;
+  }
+  name_funcs();
+  qsort(funcs, nfuncs, sizeof(funcs[0]), by_self);
+  for (i = 0; i < nfuncs; i++)
+    total += funcs[i].self_ns;
+  for (i = 0; i < nfuncs; i++)
+    fprintf(out, "%s %llu %llu %.4f\n", funcs[i].name, funcs[i].calls, funcs[i].self_ns,
+            total ? (double)funcs[i].self_ns / total : 0.0);
+  fclose(out);
+  printf("profile: %d functions written to %s\n", nfuncs, PROFILE_OUT);
+}
+
+NO_PROFILE __attribute__ ((constructor)) static void profile_init(void)
+{
+  atexit(profile_write);
+}
@@ -0,0 +1,517 @@
+/* CCID replay benchmark (make replay).
+ *
+ * Feeds recorded bulk OUT message streams to the firmware through the
+ * simulated UDP and checks every bulk IN reply byte for byte against the
+ * recording, so that performance work cannot quietly change the protocol.
+ * For each command, keyed by the message type or, for XfrBlock, by INS
+ * (the later parts of a chained APDU are keyed as XfrBlock), it reports:
+ *
+ *  - latency in virtual time, from queueing the message until the last
+ *    packet of its last reply has been taken off the bus, as a summary and
+ *    a log2 histogram, and the share of it spent on the receive path (until
+ *    the device accepted the last OUT packet);
+ *  - peripheral register accesses made by the firmware;
+ *  - host instructions spent in the main loop and the register models, from
+ *    the perf counters, or host CPU time where those are not available;
+ *  - flash page writes, page programs and flash busy time;
+ *  - time extension requests (bStatus 0x80) sent while the command ran.
+ *    Like a host driver, replay does not count them as replies; they are
+ *    neither recorded nor compared. One with the bSeq of another message
+ *    is counted as a reply, so it shows up as a difference.
+ *
+ * After the last reply the main loop keeps running until nothing has been
+ * sent or programmed for SETTLE_NS, so replies and page programs that the
+ * firmware defers are charged to the command that caused them.
+ *
+ * For reference, the receive path before udp_read() lost its busy-waits
+ * spun 3 x 20 ms per 64-byte packet. With those spins put back, a one
+ * packet command took 40049 us instead of 99 us, an APDU B3 of the write
+ * stream (three packets) 160137 us instead of 196 us, and the five packet
+ * APDU BA of the framing stream 280249 us instead of 299 us.
+ *
+ * Usage: replay [-r] [-n count] stream...
+ *
+ * The streams run in order in one session, so a stream may depend on what
+ * the previous ones left in flash. In a stream, blank lines and lines
+ * starting with '#' are comments, '>' is a message for bulk OUT and each
+ * '<' after it is one reply expected on bulk IN. Messages are in hex;
+ * whitespace between the digits is ignored, and XX in a reply matches any
+ * byte, for fields such as allocated page numbers that change when a
+ * stream is repeated. -n repeats every stream count times. -r records: the
+ * '<' lines are rewritten with the replies the firmware gives now, keeping
+ * their XX bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mytypes.h"
+#include "udp.h"
+#include "sim.h"
+#include "host.h"
+
+#define MSG_MAX          1024
+#define REPLY_MAX        4              /* replies to one message */
+#define SETTLE_NS        (4 * SIM_PACKET_NS)
+#define REPLY_TIMEOUT_NS 2000000000ULL
+#define HIST_BUCKETS     24             /* log2 of the latency in us */
+#define HIST_BAR         40
+
+typedef struct {
+  int line;
+  U8 *out;
+  int out_len;
+  int expected;                 /* number of '<' lines */
+  U8 *exp[REPLY_MAX];
+  U8 *exp_any[REPLY_MAX];       /* 1 where the recording has XX */
+  int exp_len[REPLY_MAX];
+  int got;
+  U8 reply[REPLY_MAX][MSG_MAX];
+  int reply_len[REPLY_MAX];
+} step;
+
+typedef struct {
+  char *text;                   /* comment line, or 0 for a step */
+  int step;
+} item;
+
+typedef struct {
+  const char *path;
+  item *items;
+  int nitems;
+  step *steps;
+  int nsteps;
+} stream;
+
+typedef struct {
+  unsigned long count;
+  unsigned long long lat_sum, lat_min, lat_max, rx_sum;
+  unsigned long long regs, host, flash_writes, flash_programs, flash_busy_ns;
+  unsigned long long time_ext;
+  unsigned long hist[HIST_BUCKETS];
+} cmd_stats;
+
+static cmd_stats stats[512];     /* message type, or 0x100 + INS for XfrBlock */
+static int failures;
+
+static void *xrealloc(void *p, size_t n)
+{
+  if (!(p = realloc(p, n))) {
+    fprintf(stderr, "replay: out of memory\n");
+    exit(2);
+  }
+  return p;
+}
+
+
+/* Streams */
+
+/* Parses a line of hex digits into buf, setting any[i] where the byte is
+ * XX. Returns the length, -1 if the line is not valid hex.
+ */
+static int parse_hex(const char *s, U8 *buf, U8 *any, int max)
+{
+  int n = 0, nibble = -1, d;
+
+  for (; *s; s++) {
+    if (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+      continue;
+    if ((s[0] | 0x20) == 'x' && (s[1] | 0x20) == 'x' && nibble < 0) {
+      if (n == max)
+        return -1;
+      any[n] = 1;
+      buf[n++] = 0;
+      s++;
+      continue;
+    }
+    if (*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if ((*s | 0x20) >= 'a' && (*s | 0x20) <= 'f')
+      d = (*s | 0x20) - 'a' + 10;
+    else
+      return -1;
+    if (nibble < 0) {
+      nibble = d;
+      continue;
+    }
+    if (n == max)
+      return -1;
+    any[n] = 0;
+    buf[n++] = nibble << 4 | d;
+    nibble = -1;
+  }
+  return nibble < 0 ? n : -1;
+}
+
+static void print_byte(FILE *f, const U8 *msg, const U8 *any, int any_len, int k)
+{
+  if (k < any_len && any[k])
+    fputs("XX", f);
+  else
+    fprintf(f, "%02X", msg[k]);
+}
+
+/* Writes a message with the CCID header fields grouped, then the payload
+ * in groups of 16 bytes. Bytes set in the first any_len of any are XX.
+ */
+static void print_hex(FILE *f, char dir, const U8 *msg, int len, const U8 *any, int any_len)
+{
+  static const int fields[] = {1, 4, 1, 1, 3};
+  int i, k = 0, f_i;
+
+  fputc(dir, f);
+  for (f_i = 0; f_i < 5 && k < len; f_i++) {
+    fputc(' ', f);
+    for (i = 0; i < fields[f_i] && k < len; i++)
+      print_byte(f, msg, any, any_len, k++);
+  }
+  for (i = 0; k < len; i++, k++) {
+    if (i % 16 == 0)
+      fputc(' ', f);
+    print_byte(f, msg, any, any_len, k);
+  }
+  fputc('\n', f);
+}
+
+static int load(stream *s, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char *line = 0;
+  size_t cap = 0;
+  int lineno = 0, n;
+  U8 buf[MSG_MAX], any[MSG_MAX];
+  step *st;
+
+  memset(s, 0, sizeof(*s));
+  s->path = path;
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  while (getline(&line, &cap, f) > 0) {
+    lineno++;
+    if (line[0] != '>' && line[0] != '<') {
+      s->items = xrealloc(s->items, (s->nitems + 1) * sizeof(item));
+      s->items[s->nitems].text = strdup(line);
+      s->items[s->nitems++].step = -1;
+      continue;
+    }
+    if ((n = parse_hex(line + 1, buf, any, MSG_MAX)) < 10) {
+      fprintf(stderr, "%s:%d: not a CCID message\n", path, lineno);
+      goto fail;
+    }
+    if (line[0] == '>') {
+      s->steps = xrealloc(s->steps, (s->nsteps + 1) * sizeof(step));
+      st = &s->steps[s->nsteps];
+      memset(st, 0, sizeof(*st));
+      st->line = lineno;
+      st->out = xrealloc(0, n);
+      memcpy(st->out, buf, n);
+      st->out_len = n;
+      s->items = xrealloc(s->items, (s->nitems + 1) * sizeof(item));
+      s->items[s->nitems].text = 0;
+      s->items[s->nitems++].step = s->nsteps++;
+      continue;
+    }
+    if (!s->nsteps || (st = &s->steps[s->nsteps - 1])->expected == REPLY_MAX) {
+      fprintf(stderr, "%s:%d: reply without a message\n", path, lineno);
+      goto fail;
+    }
+    st->exp[st->expected] = xrealloc(0, n);
+    memcpy(st->exp[st->expected], buf, n);
+    st->exp_any[st->expected] = xrealloc(0, n);
+    memcpy(st->exp_any[st->expected], any, n);
+    st->exp_len[st->expected++] = n;
+  }
+  free(line);
+  fclose(f);
+  return 0;
+
+fail:
+  free(line);
+  fclose(f);
+  return -1;
+}
+
+/* Rewrites the stream with the replies of the last run */
+static int record(const stream *s)
+{
+  char tmp[4096];
+  FILE *f;
+  int i, k;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", s->path);
+  if (!(f = fopen(tmp, "w"))) {
+    perror(tmp);
+    return -1;
+  }
+  for (i = 0; i < s->nitems; i++) {
+    const step *st;
+
+    if (s->items[i].text) {
+      fputs(s->items[i].text, f);
+      continue;
+    }
+    st = &s->steps[s->items[i].step];
+    print_hex(f, '>', st->out, st->out_len, 0, 0);
+    for (k = 0; k < st->got; k++)
+      print_hex(f, '<', st->reply[k], st->reply_len[k], st->exp_any[k], k < st->expected ? st->exp_len[k] : 0);
+  }
+  if (fclose(f) || rename(tmp, s->path)) {
+    perror(s->path);
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Replay */
+
+static int command_key(const step *st)
+{
+  int level = st->out_len >= 10 ? st->out[8] | (st->out[9] << 8) : 0;
+
+  if (st->out[0] != PC_RDR_XFR_BLOCK || st->out_len <= 11 || (level != 0 && level != 1))
+    return st->out[0];
+  return 0x100 + st->out[11];
+}
+
+static const char *command_name(int key)
+{
+  static char name[16];
+
+  switch (key) {
+  case PC_RDR_ICC_POWER_ON:     return "PowerOn";
+  case PC_RDR_ICC_POWER_OFF:    return "PowerOff";
+  case PC_RDR_GET_SLOT_STATUS:  return "GetSlotStatus";
+  case PC_RDR_XFR_BLOCK:        return "XfrBlock";
+  case PC_RDR_GET_PARAMETERS:   return "GetParameters";
+  case PC_RDR_RESET_PARAMETERS: return "ResetParameters";
+  case PC_RDR_SET_PARAMETERS:   return "SetParameters";
+  case PC_RDR_ESCAPE:           return "Escape";
+  }
+  snprintf(name, sizeof(name), key & 0x100 ? "APDU %02X" : "msg %02X", key & 0xFF);
+  return name;
+}
+
+static int bucket(unsigned long long ns)
+{
+  unsigned long long us = ns / 1000;
+  int b = 0;
+
+  while (us > 1 && b < HIST_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+/* Sends one message and runs the main loop until its replies are in and
+ * the firmware has settled. Returns the virtual time the step took.
+ */
+static unsigned long long run_step(step *st)
+{
+  cmd_stats *cs = &stats[command_key(st)];
+  sim_counters c0 = *sim_get_counters();
+  const sim_counters *c = sim_get_counters();
+  unsigned long long t0 = sim_time_ns(), last = 0, rx = 0, quiet = t0, host = 0, h;
+  unsigned long long flash_ops = c->flash_writes + c->flash_programs;
+  int n;
+
+  if (!sim_bulk_out(st->out, st->out_len)) {
+    fprintf(stderr, "replay: bulk OUT queue full\n");
+    exit(2);
+  }
+  st->got = 0;
+  for (;;) {
+    while ((n = sim_bulk_in(st->reply[st->got < REPLY_MAX ? st->got : REPLY_MAX - 1], MSG_MAX)) >= 0) {
+      U8 *r = st->reply[st->got < REPLY_MAX ? st->got : REPLY_MAX - 1];
+
+      if (n == 10 && r[7] == 0x80 && r[6] == st->out[6]) {
+        cs->time_ext++;
+        continue;
+      }
+      st->reply_len[st->got < REPLY_MAX ? st->got : REPLY_MAX - 1] = n;
+      if (st->got < REPLY_MAX)
+        st->got++;
+      last = sim_bulk_in_time();
+      quiet = sim_time_ns();
+    }
+    if (!rx && sim_bulk_out_time() > t0)
+      rx = sim_bulk_out_time() - t0;
+    if (c->flash_writes + c->flash_programs != flash_ops) {
+      flash_ops = c->flash_writes + c->flash_programs;
+      quiet = sim_time_ns();
+    }
+    if (st->got && sim_time_ns() - quiet >= SETTLE_NS)
+      break;
+    if (sim_time_ns() - t0 > REPLY_TIMEOUT_NS)
+      break;
+    h = host_counter();
+    mainLoopPoll();
+    host += host_counter() - h;
+    sim_advance(LOOP_NS);
+  }
+
+  if (st->got) {
+    unsigned long long lat = last - t0;
+
+    cs->count++;
+    cs->lat_sum += lat;
+    cs->lat_min = cs->count == 1 || lat < cs->lat_min ? lat : cs->lat_min;
+    cs->lat_max = lat > cs->lat_max ? lat : cs->lat_max;
+    cs->rx_sum += rx;
+    cs->hist[bucket(lat)]++;
+  }
+  cs->regs += c->reg_reads + c->reg_writes - c0.reg_reads - c0.reg_writes;
+  cs->host += host;
+  cs->flash_writes += c->flash_writes - c0.flash_writes;
+  cs->flash_programs += c->flash_programs - c0.flash_programs;
+  cs->flash_busy_ns += c->flash_busy_ns - c0.flash_busy_ns;
+  return sim_time_ns() - t0;
+}
+
+/* Compares the replies of a step with the recording. Returns the number
+ * of differences, which are printed unless quiet is set.
+ */
+static int check_step(const stream *s, const step *st, int quiet)
+{
+  int k, i, len, diffs = 0;
+
+  if (st->got != st->expected) {
+    if (!quiet)
+      printf("%s:%d: %d replies, recorded %d\n", s->path, st->line, st->got, st->expected);
+    diffs++;
+  }
+  for (k = 0; k < st->got && k < st->expected; k++) {
+    len = st->reply_len[k] < st->exp_len[k] ? st->reply_len[k] : st->exp_len[k];
+    for (i = 0; i < len && (st->exp_any[k][i] || st->reply[k][i] == st->exp[k][i]); i++)
+      ;
+    if (i < len || st->reply_len[k] != st->exp_len[k]) {
+      if (!quiet) {
+        printf("%s:%d: reply %d differs at byte %d\n", s->path, st->line, k + 1, i);
+        print_hex(stdout, '<', st->reply[k], st->reply_len[k], 0, 0);
+        print_hex(stdout, '=', st->exp[k], st->exp_len[k], st->exp_any[k], st->exp_len[k]);
+      }
+      diffs++;
+    }
+  }
+  return diffs;
+}
+
+static void report(const stream *s, int iterations, unsigned long long elapsed,
+                   unsigned long long bytes_out, unsigned long long bytes_in)
+{
+  const char *unit = host_counter_unit();
+  unsigned long total = 0;
+  unsigned long max;
+  char range[32];
+  int key, b, w;
+
+  printf("\n%s: %d step(s) x %d\n", s->path, s->nsteps, iterations);
+  printf("  %-16s %6s %9s %9s %9s %8s %8s %10s %6s %6s %9s %5s\n", "command", "n", "avg us", "min us",
+         "max us", "rx us", "regs", unit, "fwrite", "fprog", "busy us", "ext");
+  for (key = 0; key < 512; key++) {
+    const cmd_stats *cs = &stats[key];
+
+    if (!cs->count)
+      continue;
+    total += cs->count;
+    printf("  %-16s %6lu %9.1f %9.1f %9.1f %8.1f %8llu %10llu %6.2f %6.2f %9.1f %5.2f\n",
+           command_name(key), cs->count, cs->lat_sum / 1000.0 / cs->count, cs->lat_min / 1000.0,
+           cs->lat_max / 1000.0, cs->rx_sum / 1000.0 / cs->count, cs->regs / cs->count,
+           cs->host / cs->count, (double)cs->flash_writes / cs->count,
+           (double)cs->flash_programs / cs->count, cs->flash_busy_ns / 1000.0 / cs->count,
+           (double)cs->time_ext / cs->count);
+  }
+  printf("  %lu commands in %.1f us virtual: %.0f commands/s, %llu bytes out, %llu bytes in, %.1f KB/s in\n",
+         total, elapsed / 1000.0, total * 1e9 / elapsed, bytes_out, bytes_in,
+         bytes_in * 1e9 / 1024 / elapsed);
+
+  for (key = 0; key < 512; key++) {
+    const cmd_stats *cs = &stats[key];
+
+    if (!cs->count)
+      continue;
+    printf("  %s latency:\n", command_name(key));
+    for (max = 0, b = 0; b < HIST_BUCKETS; b++)
+      max = cs->hist[b] > max ? cs->hist[b] : max;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      if (!cs->hist[b])
+        continue;
+      w = (cs->hist[b] * HIST_BAR + max - 1) / max;
+      snprintf(range, sizeof(range), "%lu-%lu us", b ? 1UL << b : 0, (2UL << b) - 1);
+      printf("    %20s |%.*s %lu\n", range, w, "########################################", cs->hist[b]);
+    }
+  }
+}
+
+static void replay(stream *s, int iterations, int recording)
+{
+  unsigned long long elapsed = 0, bytes_out = 0, bytes_in = 0;
+  int i, k, r, changed = 0;
+
+  memset(stats, 0, sizeof(stats));
+  for (i = 0; i < iterations; i++) {
+    for (k = 0; k < s->nsteps; k++) {
+      step *st = &s->steps[k];
+
+      elapsed += run_step(st);
+      bytes_out += st->out_len;
+      for (r = 0; r < st->got; r++)
+        bytes_in += st->reply_len[r];
+      if (!st->got)
+        printf("%s:%d: no reply\n", s->path, st->line);
+      if (!recording)
+        failures += check_step(s, st, 0);
+      else if (i == 0)
+        changed += check_step(s, st, 1) != 0;
+    }
+    if (recording && i == 0) {
+      if (record(s))
+        failures++;
+      printf("%s: recorded, %d step(s) changed\n", s->path, changed);
+    }
+  }
+  report(s, iterations, elapsed ? elapsed : 1, bytes_out, bytes_in);
+}
+
+int main(int argc, char **argv)
+{
+  int recording = 0, iterations = 1, opt, i;
+  const char *err;
+  stream s;
+
+  while ((opt = getopt(argc, argv, "rn:")) != -1) {
+    if (opt == 'r')
+      recording = 1;
+    else if (opt == 'n' && atoi(optarg) > 0)
+      iterations = atoi(optarg);
+    else
+      break;
+  }
+  if (opt != -1 || optind == argc) {
+    fprintf(stderr, "usage: %s [-r] [-n count] stream...\n", argv[0]);
+    return 2;
+  }
+
+  host_counter_open();
+  sim_init();
+  boardInit();
+  if ((err = host_enumerate())) {
+    printf("replay: enumeration failed at %s\n", err);
+    return 1;
+  }
+  sessionInit();
+
+  for (i = optind; i < argc; i++) {
+    if (load(&s, argv[i]))
+      return 2;
+    replay(&s, iterations, recording);
+  }
+
+  printf(failures ? "\nreplay: %d mismatch(es)\n" : "\nreplay: all replies match\n", failures);
+  return failures != 0;
+}
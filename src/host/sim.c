@@ -0,0 +1,809 @@
+/* Register models for the host build, see sim.h.
+ *
+ * Only the behaviour the drivers depend on is modelled. Registers without
+ * a model simply keep the last value written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "mytypes.h"
+#include "AT91SAM7.h"
+#include "Board.h"
+#include "flash.h"
+#include "hal.h"
+#include "interrupts.h"
+#include "sim.h"
+
+#define ADDR(reg)           ((U32)(uintptr_t)(reg))
+
+#define PERIPH_BASE         0xFFFA0000
+#define PERIPH_WORDS        ((0x100000000ULL - PERIPH_BASE) / 4)
+
+#define UDP_CSR(n)          (0xFFFB0030 + 4*(n))
+#define UDP_FDR(n)          (0xFFFB0050 + 4*(n))
+#define UDP_ID              11
+
+#define CSR_W0C             (AT91C_UDP_TXCOMP | AT91C_UDP_RX_DATA_BK0 | AT91C_UDP_RXSETUP | \
+                             AT91C_UDP_ISOERROR | AT91C_UDP_RX_DATA_BK1)
+#define CSR_RW              (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE | AT91C_UDP_DIR | AT91C_UDP_FORCESTALL)
+#define CSR_INT             CSR_W0C
+
+#define PIT_HZ              (CLOCK_FREQUENCY / 16)
+#define TC_HZ               (CLOCK_FREQUENCY / 8)     /* TC0 on TIMER_CLOCK2 */
+
+/* A flag the firmware has just changed is left alone by the bus for this
+ * long, so the drivers' set-and-check loops see their own write.
+ */
+#define TURNAROUND_NS       2000
+
+#define OUT_QUEUE           4096          /* bulk OUT packets */
+#define IN_QUEUE            64            /* bulk IN transfers */
+#define IN_MAX              1024
+#define CONTROL_TIMEOUT_NS  100000000ULL
+
+extern void udp_isr_C(void);
+extern void systick_isr_C(void);
+
+typedef struct {
+  U32 csr;
+  U8 fifo[2][64];
+  int count[2];
+  int rd;
+  int cpu_bank;                 /* bank the firmware reads or fills */
+  int bus_bank;                 /* bank the host fills or takes next */
+  unsigned long long changed;   /* time of the last flag change by the firmware */
+} sim_ep;
+
+enum { CTL_IDLE, CTL_DATA_IN, CTL_STATUS_IN, CTL_STATUS_OUT, CTL_DONE, CTL_STALL };
+
+static sim_counters counters;
+static unsigned long long now, next_packet;
+static U32 regs[PERIPH_WORDS];
+static U8 *flash;
+static int busy;                /* inside the models, no interrupts */
+
+/* CPU and AIC */
+static int irq_enabled;
+static int irq_level = -1;
+static U32 aic_enabled;
+
+/* PIT */
+static U32 pit_mr;
+static unsigned long long pit_start, pit_acked;
+
+/* TC0, free running */
+static int tc_on;
+static unsigned long long tc_start;
+
+/* EFC */
+static unsigned int latch[FLASH_PAGE_SIZE_LONG];
+static U32 fmr;
+static unsigned long long flash_ready;
+
+/* UDP */
+static sim_ep eps[4];
+static U32 udp_imr, udp_latched;
+
+/* USB host side */
+static U8 out_data[OUT_QUEUE][64];
+static int out_len[OUT_QUEUE];
+static unsigned out_head, out_tail;
+static unsigned long long out_done;   /* time the OUT queue last drained */
+static U8 in_data[IN_QUEUE][IN_MAX];
+static int in_len[IN_QUEUE];
+static unsigned long long in_time[IN_QUEUE];
+static unsigned long long in_last;    /* completion of the transfer last returned */
+static unsigned in_head, in_tail;
+static int in_size;             /* transfer being received */
+static U8 int_data[8];
+static int int_len = -1;
+static int ctl_state;
+static U8 *ctl_data;
+static int ctl_len, ctl_max, ctl_wlength;
+
+
+static U32 udp_isr(void);
+
+static void sim_fatal(const char *what, U32 addr)
+{
+  fprintf(stderr, "sim: %s 0x%08lx at %llu ns\n", what, addr, now);
+  exit(2);
+}
+
+static int ep_size(int n)
+{
+  return (n == 1 || n == 2) ? 64 : 8;
+}
+
+static int ep_banks(int n)
+{
+  return (n == 1 || n == 2) ? 2 : 1;
+}
+
+static int ep_settled(sim_ep *ep)
+{
+  return now - ep->changed >= TURNAROUND_NS;
+}
+
+
+/* PIT */
+
+static unsigned long long pit_ticks(void)
+{
+  return (unsigned long long)((unsigned __int128)now * PIT_HZ / 1000000000ULL);
+}
+
+static unsigned long long pit_periods(U32 *cpiv)
+{
+  unsigned long long t, period;
+
+  if (!(pit_mr & AT91C_PITC_PITEN)) {
+    *cpiv = 0;
+    return pit_acked;
+  }
+  t = pit_ticks() - pit_start;
+  period = (pit_mr & AT91C_PITC_PIV) + 1;
+  *cpiv = t % period;
+  return t / period;
+}
+
+static U32 pit_read(U32 addr)
+{
+  U32 cpiv;
+  unsigned long long periods = pit_periods(&cpiv);
+  U32 piir = (((periods - pit_acked) & 0xFFF) << 20) | cpiv;
+
+  if (addr == ADDR(AT91C_PITC_PISR))
+    return periods > pit_acked ? AT91C_PITC_PITS : 0;
+  if (addr == ADDR(AT91C_PITC_PIVR))
+    pit_acked = periods;
+  return piir;
+}
+
+
+/* TC0 */
+
+static unsigned long long tc_ticks(void)
+{
+  return (unsigned long long)((unsigned __int128)now * TC_HZ / 1000000000ULL);
+}
+
+static void tc_command(U32 val)
+{
+  if (val & AT91C_TC_CLKDIS)
+    tc_on = 0;
+  else if (val & AT91C_TC_CLKEN)
+    tc_on = 1;
+  if (tc_on && (val & AT91C_TC_SWTRG))
+    tc_start = tc_ticks();
+}
+
+
+/* AIC */
+
+static U32 aic_pending(void)
+{
+  U32 cpiv, pending = 0;
+
+  if ((pit_mr & AT91C_PITC_PITIEN) && pit_periods(&cpiv) > pit_acked)
+    pending |= 1 << AT91C_ID_SYS;
+  if (udp_isr() & (udp_imr | AT91C_UDP_ENDBUSRES))
+    pending |= 1 << UDP_ID;
+  return pending;
+}
+
+static int aic_priority(int line)
+{
+  return regs[(ADDR(AT91C_AIC_SMR) - PERIPH_BASE) / 4 + line] & AT91C_AIC_PRIOR;
+}
+
+/* Run the handler of the highest priority pending line, as long as the
+ * CPU accepts interrupts and the line outranks the one being serviced.
+ */
+static void irq_check(void)
+{
+  int line, best, saved, storm = 0;
+  U32 pending;
+
+  while (irq_enabled && !busy) {
+    pending = aic_pending() & aic_enabled;
+    best = -1;
+    for (line = 0; line < 32; line++)
+      if ((pending & (1u << line)) && aic_priority(line) > irq_level &&
+          (best < 0 || aic_priority(line) > aic_priority(best)))
+        best = line;
+    if (best < 0)
+      return;
+    if (++storm > 100000)
+      sim_fatal("interrupt storm on line", best);
+
+    saved = irq_level;
+    irq_level = aic_priority(best);
+    counters.irqs++;
+    ((void (*)(void)) regs[(ADDR(AT91C_AIC_SVR) - PERIPH_BASE) / 4 + best])();
+    irq_level = saved;
+    irq_enabled = 1;
+  }
+}
+
+int interrupts_get_and_disable(void)
+{
+  int was = irq_enabled;
+
+  irq_enabled = 0;
+  return was;
+}
+
+void interrupts_enable(void)
+{
+  irq_enabled = 1;
+  irq_check();
+}
+
+/* Stand-ins for the wrappers in irq.S */
+void udp_isr_entry(void)
+{
+  udp_isr_C();
+}
+
+void systick_isr_entry(void)
+{
+  systick_isr_C();
+}
+
+void default_isr(void)
+{
+  sim_fatal("unhandled interrupt", 0);
+}
+
+void default_fiq(void)
+{
+  sim_fatal("unhandled fast interrupt", 0);
+}
+
+void spurious_isr(void)
+{
+  sim_fatal("spurious interrupt", 0);
+}
+
+
+/* EFC */
+
+static void efc_command(U32 val)
+{
+  unsigned int *page;
+  int i;
+
+  if ((val & AT91C_MC_KEY) != AT91C_MC_CORRECT_KEY)
+    return;
+
+  switch (val & AT91C_MC_FCMD) {
+    case AT91C_MC_FCMD_START_PROG:
+      page = (unsigned int *)(flash + ((val & AT91C_MC_PAGEN) >> 8) * FLASH_PAGE_SIZE);
+      for (i = 0; i < FLASH_PAGE_SIZE_LONG; i++)
+        page[i] = (fmr & AT91C_MC_NEBP) ? page[i] & latch[i] : latch[i];
+      if (fmr & AT91C_MC_NEBP) {
+        counters.flash_programs++;
+        flash_ready = now + SIM_PROG_NEBP_NS;
+      }
+      else {
+        counters.flash_writes++;
+        flash_ready = now + SIM_PROG_NS;
+      }
+      counters.flash_busy_ns += flash_ready - now;
+      break;
+    case AT91C_MC_FCMD_ERASE_ALL:
+      memset(flash, 0xFF, FLASH_PAGE_NB * FLASH_PAGE_SIZE);
+      flash_ready = now + SIM_PROG_NS;
+      break;
+    default:
+      flash_ready = now + SIM_ACCESS_NS;
+  }
+  memset(latch, 0xFF, sizeof(latch));
+}
+
+
+/* UDP, firmware side */
+
+static void ep_reset(int n)
+{
+  memset(&eps[n], 0, sizeof(eps[n]));
+}
+
+static U32 udp_isr(void)
+{
+  U32 isr = udp_latched;
+  int n;
+
+  for (n = 0; n < 4; n++)
+    if (eps[n].csr & CSR_INT)
+      isr |= AT91C_UDP_EPINT0 << n;
+  return isr;
+}
+
+static U32 csr_read(int n)
+{
+  sim_ep *ep = &eps[n];
+  U32 csr = ep->csr;
+
+  if (csr & (AT91C_UDP_RX_DATA_BK0 | AT91C_UDP_RX_DATA_BK1 | AT91C_UDP_RXSETUP))
+    csr |= (U32)ep->count[ep->cpu_bank] << 16;
+  return csr;
+}
+
+static void csr_write(int n, U32 val)
+{
+  sim_ep *ep = &eps[n];
+  U32 cleared = ep->csr & CSR_W0C & ~val;
+  int b;
+
+  for (b = 0; b < 2; b++)
+    if (cleared & (b ? AT91C_UDP_RX_DATA_BK1 : AT91C_UDP_RX_DATA_BK0)) {
+      ep->count[b] = 0;
+      if (b == ep->cpu_bank && ep_banks(n) == 2)
+        ep->cpu_bank ^= 1;
+      ep->rd = 0;
+    }
+  if (cleared & AT91C_UDP_RXSETUP) {
+    ep->count[0] = 0;
+    ep->rd = 0;
+  }
+
+  ep->csr = (val & CSR_RW) | (ep->csr & CSR_W0C & val) | (ep->csr & AT91C_UDP_TXPKTRDY);
+  if ((val & AT91C_UDP_TXPKTRDY) && !(ep->csr & AT91C_UDP_TXPKTRDY)) {
+    ep->csr |= AT91C_UDP_TXPKTRDY;
+    if (ep_banks(n) == 2)
+      ep->cpu_bank ^= 1;
+  }
+  if (cleared || (val & AT91C_UDP_TXPKTRDY))
+    ep->changed = now;
+}
+
+static U32 fdr_read(int n)
+{
+  sim_ep *ep = &eps[n];
+
+  if (ep->rd >= ep->count[ep->cpu_bank])
+    return 0;
+  return ep->fifo[ep->cpu_bank][ep->rd++];
+}
+
+static void fdr_write(int n, U32 val)
+{
+  sim_ep *ep = &eps[n];
+  int b = ep->cpu_bank;
+
+  if (ep->count[b] < ep_size(n))
+    ep->fifo[b][ep->count[b]++] = val;
+}
+
+
+/* UDP, host side. One packet per endpoint per SIM_PACKET_NS. */
+
+/* Takes the packet the firmware has made ready on an IN endpoint, -1 if
+ * there is none.
+ */
+static int bus_take(int n, U8 *data)
+{
+  sim_ep *ep = &eps[n];
+  int b = ep->bus_bank, len;
+
+  if (!(ep->csr & AT91C_UDP_TXPKTRDY) || !ep_settled(ep))
+    return -1;
+  len = ep->count[b];
+  memcpy(data, ep->fifo[b], len);
+  ep->count[b] = 0;
+  if (ep_banks(n) == 2)
+    ep->bus_bank ^= 1;
+  ep->csr = (ep->csr & ~AT91C_UDP_TXPKTRDY) | AT91C_UDP_TXCOMP;
+  return len;
+}
+
+static void bus_control(void)
+{
+  sim_ep *ep = &eps[0];
+  U8 packet[8];
+  int len;
+
+  if (ep->csr & AT91C_UDP_RXSETUP)
+    return;
+
+  if ((ep->csr & AT91C_UDP_FORCESTALL) && ctl_state != CTL_IDLE && ctl_state != CTL_DONE &&
+      ctl_state != CTL_STALL) {
+    ep->csr |= AT91C_UDP_ISOERROR;
+    ctl_state = CTL_STALL;
+    return;
+  }
+
+  switch (ctl_state) {
+    case CTL_DATA_IN:
+      if ((len = bus_take(0, packet)) < 0)
+        break;
+      if (ctl_len + len <= ctl_max)
+        memcpy(ctl_data + ctl_len, packet, len);
+      ctl_len += len;
+      if (len < 8 || ctl_len >= ctl_wlength)
+        ctl_state = CTL_STATUS_OUT;
+      break;
+    case CTL_STATUS_OUT:
+      // the status packet follows once the last IN packet is acknowledged
+      if (ep->csr & (AT91C_UDP_TXCOMP | AT91C_UDP_RX_DATA_BK0))
+        break;
+      if (!(ep->csr & AT91C_UDP_RX_DATA_BK0) && ep->count[0] == 0 && ep_settled(ep)) {
+        ep->csr |= AT91C_UDP_RX_DATA_BK0;
+        ctl_state = CTL_DONE;
+      }
+      break;
+    case CTL_STATUS_IN:
+      if (bus_take(0, packet) >= 0)
+        ctl_state = CTL_DONE;
+      break;
+  }
+}
+
+static void bus_out(void)
+{
+  sim_ep *ep = &eps[1];
+  int b = ep->bus_bank;
+  U32 flag = b ? AT91C_UDP_RX_DATA_BK1 : AT91C_UDP_RX_DATA_BK0;
+
+  if (out_head == out_tail || !(ep->csr & AT91C_UDP_EPEDS) || (ep->csr & flag) || !ep_settled(ep))
+    return;
+
+  memcpy(ep->fifo[b], out_data[out_tail % OUT_QUEUE], out_len[out_tail % OUT_QUEUE]);
+  ep->count[b] = out_len[out_tail % OUT_QUEUE];
+  ep->csr |= flag;
+  ep->bus_bank ^= 1;
+  out_tail++;
+  counters.packets_out++;
+  if (out_tail == out_head)
+    out_done = now;
+}
+
+static void bus_in(void)
+{
+  U8 packet[64];
+  int len = bus_take(2, packet);
+
+  if (len < 0)
+    return;
+  counters.packets_in++;
+  if (in_size + len <= IN_MAX)
+    memcpy(in_data[in_head % IN_QUEUE] + in_size, packet, len);
+  in_size += len;
+  if (len < 64) {
+    in_len[in_head % IN_QUEUE] = in_size > IN_MAX ? IN_MAX : in_size;
+    in_time[in_head % IN_QUEUE] = now;
+    in_size = 0;
+    if (in_head - in_tail < IN_QUEUE)
+      in_head++;
+  }
+}
+
+static void bus_interrupt(void)
+{
+  U8 packet[8];
+  int len = bus_take(3, packet);
+
+  if (len >= 0) {
+    memcpy(int_data, packet, len);
+    int_len = len;
+  }
+}
+
+static void bus_tick(void)
+{
+  bus_control();
+  bus_out();
+  bus_in();
+  bus_interrupt();
+}
+
+
+/* Time */
+
+static void step(U32 ns)
+{
+  now += ns;
+  if (!busy) {
+    busy = 1;
+    while (now >= next_packet) {
+      next_packet += SIM_PACKET_NS;
+      bus_tick();
+    }
+    busy = 0;
+  }
+  irq_check();
+}
+
+void sim_advance(U32 ns)
+{
+  unsigned long long end = now + ns;
+
+  while (now < end)
+    step((next_packet > now && next_packet < end ? next_packet : end) - now);
+}
+
+unsigned long long sim_time_ns(void)
+{
+  return now;
+}
+
+
+/* Register file */
+
+static U32 *reg(U32 addr)
+{
+  if (addr < PERIPH_BASE || (addr & 3))
+    sim_fatal("bad register address", addr);
+  return &regs[(addr - PERIPH_BASE) / 4];
+}
+
+U32 hal_read(volatile AT91_REG *r)
+{
+  U32 addr = ADDR(r);
+  int n;
+
+  counters.reg_reads++;
+  step(SIM_ACCESS_NS);
+
+  if (addr >= ADDR(AT91C_PITC_PIMR) && addr <= ADDR(AT91C_PITC_PIIR))
+    return addr == ADDR(AT91C_PITC_PIMR) ? pit_mr : pit_read(addr);
+  if (addr == ADDR(AT91C_TC0_CV))
+    return tc_on ? (tc_ticks() - tc_start) & 0xFFFF : 0;
+  if (addr == ADDR(AT91C_MC_FSR))
+    return now >= flash_ready ? AT91C_MC_FRDY : 0;
+  if (addr == ADDR(AT91C_MC_FMR))
+    return fmr;
+  if (addr == ADDR(AT91C_AIC_IMR))
+    return aic_enabled;
+  if (addr == ADDR(AT91C_AIC_IPR))
+    return aic_pending();
+  if (addr == ADDR(AT91C_UDP_ISR))
+    return udp_isr();
+  if (addr == ADDR(AT91C_UDP_IMR))
+    return udp_imr;
+  for (n = 0; n < 4; n++) {
+    if (addr == UDP_CSR(n))
+      return csr_read(n);
+    if (addr == UDP_FDR(n))
+      return fdr_read(n);
+  }
+  return *reg(addr);
+}
+
+void hal_write(volatile AT91_REG *r, U32 val)
+{
+  U32 addr = ADDR(r);
+  int n;
+
+  counters.reg_writes++;
+  step(SIM_ACCESS_NS);
+
+  // vectors are host function pointers and keep all their bits
+  if (!(addr >= ADDR(AT91C_AIC_SVR) && addr < ADDR(AT91C_AIC_IVR)) && addr != ADDR(AT91C_AIC_SPU))
+    val &= 0xFFFFFFFF;
+
+  if (addr >= FLASH_BASE_ADDRESS && addr < FLASH_BASE_ADDRESS + FLASH_PAGE_NB * FLASH_PAGE_SIZE) {
+    latch[(addr % FLASH_PAGE_SIZE) / 4] = val;
+    return;
+  }
+
+  if (addr == ADDR(AT91C_PITC_PIMR)) {
+    if ((val & AT91C_PITC_PITEN) && !(pit_mr & AT91C_PITC_PITEN)) {
+      pit_start = pit_ticks();
+      pit_acked = 0;
+    }
+    pit_mr = val;
+  }
+  else if (addr == ADDR(AT91C_TC0_CCR))
+    tc_command(val);
+  else if (addr == ADDR(AT91C_MC_FCR))
+    efc_command(val);
+  else if (addr == ADDR(AT91C_MC_FMR))
+    fmr = val;
+  else if (addr == ADDR(AT91C_AIC_IECR))
+    aic_enabled |= val;
+  else if (addr == ADDR(AT91C_AIC_IDCR))
+    aic_enabled &= ~val;
+  else if (addr == ADDR(AT91C_UDP_IER))
+    udp_imr |= val;
+  else if (addr == ADDR(AT91C_UDP_IDR))
+    udp_imr &= ~val;
+  else if (addr == ADDR(AT91C_UDP_ICR))
+    udp_latched &= ~val;
+  else if (addr == ADDR(AT91C_UDP_RSTEP)) {
+    for (n = 0; n < 4; n++)
+      if (val & (1 << n)) {
+        U32 keep = eps[n].csr & CSR_RW;
+        ep_reset(n);
+        eps[n].csr = keep;
+      }
+  }
+  else {
+    for (n = 0; n < 4; n++) {
+      if (addr == UDP_CSR(n)) {
+        csr_write(n, val);
+        break;
+      }
+      if (addr == UDP_FDR(n)) {
+        fdr_write(n, val);
+        break;
+      }
+    }
+    if (n == 4)
+      *reg(addr) = val;
+  }
+  irq_check();
+}
+
+
+/* Setup and the host side API */
+
+void sim_init(void)
+{
+  if (!flash) {
+    flash = mmap((void *)FLASH_BASE_ADDRESS, FLASH_PAGE_NB * FLASH_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (flash != (U8 *)FLASH_BASE_ADDRESS)
+      sim_fatal("cannot map the flash at", FLASH_BASE_ADDRESS);
+  }
+  memset(flash, 0xFF, FLASH_PAGE_NB * FLASH_PAGE_SIZE);
+  memset(latch, 0xFF, sizeof(latch));
+  memset(regs, 0, sizeof(regs));
+  memset(&counters, 0, sizeof(counters));
+  memset(eps, 0, sizeof(eps));
+  now = 0;
+  next_packet = SIM_PACKET_NS;
+  irq_enabled = 0;
+  irq_level = -1;
+  aic_enabled = 0;
+  pit_mr = 0;
+  pit_start = pit_acked = 0;
+  tc_on = 0;
+  tc_start = 0;
+  fmr = 0;
+  flash_ready = 0;
+  udp_imr = udp_latched = 0;
+  out_head = out_tail = 0;
+  out_done = 0;
+  in_head = in_tail = 0;
+  in_last = 0;
+  in_size = 0;
+  int_len = -1;
+  ctl_state = CTL_IDLE;
+}
+
+U8 *sim_flash(void)
+{
+  return flash;
+}
+
+const sim_counters *sim_get_counters(void)
+{
+  return &counters;
+}
+
+/* Reset signalling from the host: every endpoint is disabled and emptied */
+void sim_bus_reset(void)
+{
+  int n;
+
+  for (n = 0; n < 4; n++)
+    ep_reset(n);
+  out_head = out_tail = 0;
+  in_size = 0;
+  ctl_state = CTL_IDLE;
+  udp_latched |= AT91C_UDP_ENDBUSRES;
+  irq_check();
+}
+
+/* Runs one control transfer on EP0. Only requests without an OUT data
+ * stage are supported. Returns the number of bytes of the IN data stage,
+ * or -1 if the request was stalled or not answered in time.
+ */
+int sim_control(const U8 *setup, U8 *data, int max)
+{
+  sim_ep *ep = &eps[0];
+  unsigned long long deadline = now + CONTROL_TIMEOUT_NS;
+
+  while (!(ep->csr & AT91C_UDP_EPEDS) || (ep->csr & AT91C_UDP_RXSETUP))
+    if (now > deadline)
+      return -1;
+    else
+      sim_advance(SIM_PACKET_NS);
+
+  busy = 1;
+  memcpy(ep->fifo[0], setup, 8);
+  ep->count[0] = 8;
+  ep->rd = 0;
+  ep->csr = (ep->csr & ~AT91C_UDP_TXPKTRDY) | AT91C_UDP_RXSETUP;
+  ctl_data = data;
+  ctl_max = max;
+  ctl_len = 0;
+  ctl_wlength = setup[6] | (setup[7] << 8);
+  ctl_state = (setup[0] & 0x80) && ctl_wlength ? CTL_DATA_IN : CTL_STATUS_IN;
+  busy = 0;
+  irq_check();
+
+  while (ctl_state != CTL_DONE && ctl_state != CTL_STALL && now <= deadline)
+    sim_advance(SIM_PACKET_NS);
+
+  // let the firmware see the end of the status stage
+  sim_advance(2 * SIM_PACKET_NS);
+  if (ctl_state != CTL_DONE)
+    return -1;
+  ctl_state = CTL_IDLE;
+  return ctl_len > max ? max : ctl_len;
+}
+
+/* Queues one bulk OUT transfer as 64 byte packets. Returns 0 if the queue
+ * is full.
+ */
+int sim_bulk_out(const U8 *msg, int len)
+{
+  int packets = len / 64 + 1, n;
+
+  if (OUT_QUEUE - (out_head - out_tail) < (unsigned)packets)
+    return 0;
+
+  do {
+    n = len < 64 ? len : 64;
+    memcpy(out_data[out_head % OUT_QUEUE], msg, n);
+    out_len[out_head % OUT_QUEUE] = n;
+    out_head++;
+    msg += n;
+    len -= n;
+  } while (len > 0);
+  return 1;
+}
+
+/* Returns the next complete bulk IN transfer, or -1 if there is none */
+int sim_bulk_in(U8 *msg, int max)
+{
+  int len;
+
+  if (in_head == in_tail)
+    return -1;
+  len = in_len[in_tail % IN_QUEUE];
+  if (len > max)
+    len = max;
+  memcpy(msg, in_data[in_tail % IN_QUEUE], len);
+  in_last = in_time[in_tail % IN_QUEUE];
+  in_tail++;
+  return len;
+}
+
+/* Time the last packet of the transfer last returned by sim_bulk_in() was
+ * taken off the bus
+ */
+unsigned long long sim_bulk_in_time(void)
+{
+  return in_last;
+}
+
+/* Time the device accepted the last queued bulk OUT packet, or 0 while
+ * packets are still waiting
+ */
+unsigned long long sim_bulk_out_time(void)
+{
+  return out_head == out_tail ? out_done : 0;
+}
+
+/* Returns the last interrupt IN packet, or -1 if there is none */
+int sim_int_in(U8 *data, int max)
+{
+  int len = int_len;
+
+  if (len < 0)
+    return -1;
+  if (len > max)
+    len = max;
+  memcpy(data, int_data, len);
+  int_len = -1;
+  return len;
+}
@@ -0,0 +1,63 @@
+/* Software model of the AT91SAM7S256 peripherals the firmware uses, for
+ * the host build (make host).
+ *
+ * The drivers reach the hardware through hal_read() and hal_write() (see
+ * hal.h). Those land here and are decoded into models of:
+ *
+ *  - the UDP: EP0 control, EP1 bulk OUT and EP2 bulk IN with their two
+ *    ping-pong banks, EP3 interrupt IN, the CSR flag semantics and the
+ *    interrupt status/mask registers;
+ *  - the embedded flash controller: the page latch, START_PROG with and
+ *    without erase (NEBP) and FRDY, over a 256 KB array mapped at its real
+ *    address so the firmware reads it directly;
+ *  - the PIT and the AIC, so that the systick and USB interrupt handlers
+ *    run as they do on the board;
+ *  - the counter value of TC0, free running for the statistics.
+ *
+ * Time is virtual. Every register access costs SIM_ACCESS_NS and the host
+ * side of the bus moves one packet per endpoint every SIM_PACKET_NS, so a
+ * run is deterministic and does not depend on the speed of the machine.
+ * Interrupts are delivered between register accesses whenever the
+ * firmware has them enabled.
+ */
+
+#ifndef __SIM_H__
+#  define __SIM_H__
+
+#  include "mytypes.h"
+
+#  define SIM_ACCESS_NS        42         /* two MCK cycles */
+#  define SIM_PACKET_NS        50000      /* one full-speed bulk packet */
+#  define SIM_PROG_NS          6000000    /* erase and program one page */
+#  define SIM_PROG_NEBP_NS     3000000    /* program only */
+
+/* Operation counters, reset by sim_init() and readable at any time */
+typedef struct {
+  unsigned long long reg_reads;
+  unsigned long long reg_writes;
+  unsigned long long irqs;
+  unsigned long long flash_writes;       /* erase and program */
+  unsigned long long flash_programs;     /* program only (NEBP) */
+  unsigned long long flash_busy_ns;
+  unsigned long long packets_out;
+  unsigned long long packets_in;
+} sim_counters;
+
+void sim_init(void);
+unsigned long long sim_time_ns(void);
+void sim_advance(U32 ns);
+const sim_counters *sim_get_counters(void);
+
+/* Flash array, FLASH_PAGE_NB pages at FLASH_BASE_ADDRESS */
+U8 *sim_flash(void);
+
+/* USB host side */
+void sim_bus_reset(void);
+int sim_control(const U8 *setup, U8 *data, int max);
+int sim_bulk_out(const U8 *msg, int len);
+int sim_bulk_in(U8 *msg, int max);
+unsigned long long sim_bulk_out_time(void);
+unsigned long long sim_bulk_in_time(void);
+int sim_int_in(U8 *data, int max);
+
+#endif
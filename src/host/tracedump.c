@@ -0,0 +1,153 @@
+/* Event trace decoder (make trace_run).
+ *
+ *   tracedump <dump>
+ *
+ * The dump is the abData of Escape TRACE replies one after the other,
+ * as the host session writes them to build/host/trace.bin: the ring, the
+ * records lost before these, their count, then the records themselves (see
+ * src/c/trace.h). The records of both rings are merged into one timeline,
+ * in microseconds from the first record.
+ *
+ * A record is stamped with the low 16 bits of the millisecond clock and
+ * with TC0, which wraps every 10.9 ms. The milliseconds order the records,
+ * unwrapped along each ring, so a dump should span less than 32 s; the TC0
+ * ticks order the records that are close together and time the gaps of
+ * less than STATS_TC_SPAN_MS, as in stats.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mytypes.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_MAX         65536
+#define TICKS_PER_MS      (STATS_TICK_HZ / 1000)
+
+typedef struct {
+  long long ms;         // unwrapped
+  unsigned tc;
+  int ring;
+  int lost;             // records lost just before this one
+  U8 id, a;
+  U16 b;
+} event;
+
+static event ev[TRACE_MAX];
+static int nev;
+
+static int by_time(const void *x, const void *y)
+{
+  const event *p = x, *q = y;
+  long long d = p->ms - q->ms;
+
+  // within a few ms TC0 has not wrapped and gives the order
+  if (d > -5 && d < 5)
+    d = (short)(p->tc - q->tc);
+  return d < 0 ? -1 : d > 0 ? 1 : p->ring - q->ring;
+}
+
+static void describe(const event *e, char *s, int n)
+{
+  switch (e->id) {
+  case TRACE_SETUP:
+    snprintf(s, n, "SETUP bRequest %02X wValue %04X", e->a, e->b);
+    break;
+  case TRACE_RX_BANK:
+    snprintf(s, n, "EP1 bank %d released, %d bytes", e->a, e->b);
+    break;
+  case TRACE_TXCOMP:
+    snprintf(s, n, "EP2 TXCOMP%s, %d bank(s) loaded", e->b ? " end of message" : "", e->a);
+    break;
+  case TRACE_FLASH_START:
+    snprintf(s, n, "flash page %d %s", e->b, e->a ? "program" : "erase and program");
+    break;
+  case TRACE_FLASH_END:
+    snprintf(s, n, "flash page %d %s", e->b, e->a ? "done" : "FAILED");
+    break;
+  case TRACE_APDU_START:
+    snprintf(s, n, "APDU %02X start, level %02X", e->a, e->b);
+    break;
+  case TRACE_APDU_END:
+    snprintf(s, n, "APDU %02X end, %d byte reply", e->a, e->b);
+    break;
+  default:
+    snprintf(s, n, "event %d %02X %04X", e->id, e->a, e->b);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  static const char *ring_name[TRACE_RINGS] = { "main", "isr" };
+  long long last_ms[TRACE_RINGS];
+  int seen[TRACE_RINGS] = { 0 }, lost[TRACE_RINGS] = { 0 };
+  unsigned long long us = 0;
+  U8 hdr[3], r[sizeof(trace_record)];
+  char what[80];
+  FILE *f;
+  int i, j;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+    return 1;
+  }
+  if (!(f = fopen(argv[1], "rb"))) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  while (fread(hdr, 1, 3, f) == 3) {
+    if (hdr[0] >= TRACE_RINGS || hdr[2] > TRACE_DRAIN_MAX) {
+      fprintf(stderr, "%s: bad block header\n", argv[1]);
+      return 1;
+    }
+    lost[hdr[0]] += hdr[1];
+    for (i = 0; i < hdr[2] && nev < TRACE_MAX; i++) {
+      event *e = &ev[nev++];
+      long long ms;
+
+      if (fread(r, 1, sizeof(r), f) != sizeof(r)) {
+        fprintf(stderr, "%s: truncated\n", argv[1]);
+        return 1;
+      }
+      // unwrap the 16-bit milliseconds against the ring's last record, or
+      // the first record of the dump
+      ms = r[2] | (r[3] << 8);
+      if (seen[hdr[0]])
+        ms = last_ms[hdr[0]] + (U16)(ms - last_ms[hdr[0]]);
+      else if (nev > 1)
+        ms = ev[0].ms + (short)(ms - ev[0].ms);
+      seen[hdr[0]] = 1;
+      last_ms[hdr[0]] = ms;
+
+      e->ms = ms;
+      e->tc = r[0] | (r[1] << 8);
+      e->ring = hdr[0];
+      e->lost = lost[hdr[0]];
+      e->id = r[4];
+      e->a = r[5];
+      e->b = r[6] | (r[7] << 8);
+      lost[hdr[0]] = 0;
+    }
+  }
+  fclose(f);
+
+  qsort(ev, nev, sizeof(ev[0]), by_time);
+  for (i = 0; i < nev; i++) {
+    if (i) {
+      long long dms = ev[i].ms - ev[i-1].ms;
+      us += (dms < STATS_TC_SPAN_MS ? (U16)(ev[i].tc - ev[i-1].tc) : dms * TICKS_PER_MS)
+            * 1000000ULL / STATS_TICK_HZ;
+    }
+    if (ev[i].lost)
+      printf("%12s %-4s (%d%s record(s) lost)\n", "", ring_name[ev[i].ring],
+             ev[i].lost, ev[i].lost >= 255 ? " or more" : "");
+    describe(&ev[i], what, sizeof(what));
+    printf("%12llu %-4s %s\n", us, ring_name[ev[i].ring], what);
+  }
+  for (j = 0; j < TRACE_RINGS; j++)
+    if (!seen[j])
+      printf("%12s %-4s (no records)\n", "", ring_name[j]);
+  return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Size and cycle comparison of the code profiles (make code_profiles).
+#
+#   code_profiles.sh <objdump> <size> <profile> <elf>...
+#
+# For each image: .text, .data (with .fastrun) and .bss, the flash it takes
+# against the pages below the file store, and an estimate of the cycles the
+# profiled run spends fetching code. The estimate counts each instruction
+# of a function once per call in <profile> (make profile_run), one cycle
+# plus one wait state (FWS=1) when it is fetched from flash; loops are not
+# unrolled, so compare the figures between profiles, not with a scope.
+
+OBJDUMP=$1
+SIZE=$2
+PROFILE=$3
+shift 3
+
+FLASH_PAGE_SIZE=256
+FLASH_START_PAGE=320    # first file store page, src/c/flash.h
+FLASH_WS=1
+
+if [ ! -f "$PROFILE" ] || [ $# -eq 0 ]; then
+  echo "usage: $0 <objdump> <size> <profile> <elf>..." >&2
+  exit 1
+fi
+
+for ELF in "$@"; do
+  SECTIONS=$("$SIZE" -A "$ELF")
+  "$OBJDUMP" -d "$ELF" | awk -v name="$(basename "$ELF" .elf)" -v profile="$PROFILE" \
+      -v sections="$SECTIONS" -v page=$FLASH_PAGE_SIZE -v ws=$FLASH_WS '
+  BEGIN {
+    while ((getline line < profile) > 0) {
+      split(line, f, " ")
+      calls[f[1]] = f[2]
+    }
+    n = split(sections, l, "\n")
+    for (i = 1; i <= n; i++) {
+      split(l[i], f, " ")
+      size[f[1]] = f[2]
+    }
+  }
+  # "00100234 <udp_read>:" starts a function
+  /^[0-9a-f]+ <[^>]+>:$/ {
+    fn = substr($2, 2, length($2) - 3)
+    inram = $1 >= "00200000"
+    next
+  }
+  # "  100234:	e92d4070 	push ..." is one instruction, ARM or Thumb
+  fn in calls && /^ *[0-9a-f]+:\t/ {
+    cycles += calls[fn] * (inram ? 1 : 1 + ws)
+  }
+  END {
+    flash = size[".text"] + size[".data"]
+    print name, size[".text"], size[".data"], size[".bss"], flash,
+          int((flash + page - 1) / page), cycles
+  }'
+done | awk -v start=$FLASH_START_PAGE '
+BEGIN {
+  printf "%-8s %8s %8s %8s %8s %9s %12s %6s\n",
+         "profile", "text", "data", "bss", "flash", "pages", "est.cycles", "ratio"
+}
+{
+  if (NR == 1)
+    base = $7
+  printf "%-8s %8d %8d %8d %8d %4d/%-4d %12d %6.2f\n",
+         $1, $2, $3, $4, $5, $6, start, $7, base ? $7 / base : 0
+}'
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Checks the .fastrun code of a linked image (make fastrun_check, run by
+# every build).
+#
+#   fastrun_check.sh <objdump> <elf>
+#
+# A function the linker placed in SRAM must run while the flash is busy,
+# so it may not branch into flash: not to a libgcc helper such as
+# __aeabi_uidiv, nor to a flash function or a veneer that leads there.
+# It must also be ARM code (src/c/ramfunc.h, the SRC_FASTRUN sources in
+# the Makefile). Calls through long_call load the address into a register
+# and are not seen here; RAMFUNCs only long_call other RAMFUNCs.
+# Exits 1 and lists the offending instructions if there are any.
+
+OBJDUMP=$1
+ELF=$2
+RAM_START=00200000
+
+if [ ! -f "$ELF" ]; then
+  echo "usage: $0 <objdump> <elf>" >&2
+  exit 1
+fi
+
+"$OBJDUMP" -d "$ELF" | awk -F '\t' -v ram=$RAM_START '
+# "00200234 <udp_rx_poll>:" starts a function
+/^[0-9a-f]+ <[^>]+>:$/ {
+  split($0, f, " ")
+  fn = substr(f[2], 2, length(f[2]) - 3)
+  inram = (f[1] "") >= (ram "")
+  thumb_seen = 0
+  next
+}
+# "  200234:	eb000123 	bl	100400 <__aeabi_uidiv>" is one instruction
+inram && /^ *[0-9a-f]+:\t/ {
+  enc = $2
+  sub(/ +$/, "", enc)
+  if ((length(enc) != 8 || enc ~ / /) && $3 !~ /^\./ && !thumb_seen) {
+    printf "%s: Thumb code in SRAM\n", fn
+    thumb_seen = 1
+    bad++
+  }
+  if ($3 ~ /^bl?x?(eq|ne|cs|cc|hs|lo|mi|pl|vs|vc|hi|ls|ge|lt|gt|le|al)?(\.[nw])?$/ && $4 ~ /^[0-9a-f]+ </) {
+    split($4, t, " ")
+    target = sprintf("%08s", t[1])
+    gsub(/ /, "0", target)
+    if (target < (ram "") || t[2] ~ /veneer/) {
+      printf "%s: %s %s in flash\n", fn, $3, t[2]
+      bad++
+    }
+  }
+}
+END {
+  if (bad) {
+    printf "fastrun_check: %d problem(s) in the .fastrun code\n", bad
+    exit 1
+  }
+}'
@@ -0,0 +1,74 @@
+#!/bin/sh
+# SRAM budget of the .fastrun functions against their measured share of the
+# run time (make fastrun_report).
+#
+#   fastrun_report.sh <objdump> <elf> <profile>
+#
+# The functions in SRAM are the F symbols the linker placed in .data (the
+# script puts .fastrun there). At FWS=1 every instruction fetched from flash
+# costs an extra cycle, so the wait states saved by a function in SRAM grow
+# with the instructions it executes; the share of self time in <profile>
+# (make profile_run) stands in for that. Hot functions still in flash are
+# listed after the budget as candidates for HOTFUNC.
+
+OBJDUMP=$1
+ELF=$2
+PROFILE=$3
+DATA_SIZE=65536
+
+if [ ! -f "$ELF" ] || [ ! -f "$PROFILE" ]; then
+  echo "usage: $0 <objdump> <elf> <profile>" >&2
+  exit 1
+fi
+
+"$OBJDUMP" -t "$ELF" | awk -v data_size=$DATA_SIZE -v profile="$PROFILE" '
+function hex(s,   i, c, v) {
+  v = 0
+  s = tolower(s)
+  for (i = 1; i <= length(s); i++) {
+    c = index("0123456789abcdef", substr(s, i, 1))
+    v = v * 16 + c - 1
+  }
+  return v
+}
+BEGIN {
+  while ((getline line < profile) > 0) {
+    split(line, f, " ")
+    calls[f[1]] = f[2]
+    share[f[1]] = f[4]
+    order[++nprof] = f[1]
+  }
+}
+$3 == "F" && $4 == ".data" { ram[$6] = hex($5); nram++ }
+$3 == "F" && $4 == ".text" { rom[$6] = hex($5) }
+$NF == "_data" { data_start = hex($1) }
+$NF == "_edata" { data_end = hex($1) }
+$NF == "__bss_end__" { bss_end = hex($1) }
+END {
+  used = bss_end - data_start
+  for (n in ram)
+    fastrun += ram[n]
+  printf "SRAM %d bytes: .data+.fastrun %d (.fastrun %d in %d functions), .bss %d, free for stack %d\n\n",
+         data_size, data_end - data_start, fastrun, nram, bss_end - data_end, data_size - used
+  printf "  %-28s %6s %8s %7s %8s %7s\n", "in SRAM", "bytes", "calls", "share", "cum", "cum"
+  for (i = 1; i <= nprof; i++) {
+    n = order[i]
+    if (!(n in ram))
+      continue
+    bytes += ram[n]
+    cum += share[n]
+    printf "  %-28s %6d %8d %6.1f%% %8d %6.1f%%\n", n, ram[n], calls[n], 100 * share[n], bytes, 100 * cum
+    seen[n] = 1
+  }
+  for (n in ram)
+    if (!(n in seen))
+      printf "  %-28s %6d %8s %7s\n", n, ram[n], "-", "-"
+  printf "\n  %-28s %6s %8s %7s\n", "hot, in flash", "bytes", "calls", "share"
+  for (i = 1; i <= nprof && shown < 10; i++) {
+    n = order[i]
+    if (n in rom && share[n] > 0) {
+      printf "  %-28s %6d %8d %6.1f%%\n", n, rom[n], calls[n], 100 * share[n]
+      shown++
+    }
+  }
+}'